@@ -0,0 +1,117 @@
+;;; -*- Mode: Scheme; -*-
+
+;;; Benchmarks for the imagetools modules. Each measurement is written
+;;; to the standard output as one JSON object per line, so that the
+;;; results of different builds can be compared mechanically.
+
+(use-module '{imagick exif qrcode})
+
+(define corpus (config 'corpus "bench/corpus"))
+(define iterations (config 'iterations 10))
+(define fit-size (config 'fitsize 256))
+
+(define (jsonstring string) (stringout "\"" string "\""))
+
+(define (emit op input times bytes pixels)
+  (let* ((n (length times))
+	 (total (apply + times))
+	 (mean (/~ total n)))
+    (lineout "{\"op\":" (jsonstring op)
+      ",\"input\":" (jsonstring input)
+      ",\"iterations\":" n
+      ",\"total\":" total
+      ",\"mean\":" mean
+      ",\"min\":" (apply min times)
+      ",\"max\":" (apply max times)
+      ",\"ops_per_sec\":" (if (> total 0) (/~ n total) 0)
+      ",\"mb_per_sec\":" (if (> total 0) (/~ (* n bytes) (* total 1000000)) 0)
+      ",\"mpixels_per_sec\":"
+      (if (> total 0) (/~ (* n pixels) (* total 1000000)) 0)
+      "}")))
+
+;;; Runs thunk once to warm up and then *iterations* times, returning
+;;; the list of elapsed times in seconds.
+(define (timings thunk)
+  (thunk)
+  (let ((times '()))
+    (dotimes (i iterations)
+      (let ((started (elapsed-time)))
+	(thunk)
+	(set! times (cons (elapsed-time started) times))))
+    times))
+
+;;; Returns the SIMD levels up to *best*, the one IMAGICK:SIMD chose,
+;;; so that luma export is timed with each kernel the CPU supports.
+(define (simd-levels best)
+  (let ((levels '()) (done #f))
+    (dolist (level '("scalar" "sse2" "avx2"))
+      (unless done
+	(set! levels (cons level levels))
+	(when (equal? level best) (set! done #t))))
+    (reverse levels)))
+
+(define (bench-image file)
+  (let* ((name (basename file))
+	 (packet (filedata file))
+	 (image (packet->imagick packet))
+	 (pixels (* (get image 'width) (get image 'height)))
+	 (target (if (has-suffix name ".png") "JPEG" "PNG")))
+    (emit "decode" name (timings (lambda () (packet->imagick packet)))
+	  (length packet) pixels)
+    (emit "fit" name
+	  (timings (lambda () (imagick/fit (imagick/clone image)
+					   fit-size fit-size)))
+	  0 pixels)
+    (emit (glom "convert:" target) name
+	  (timings (lambda ()
+		     (imagick->packet
+		      (imagick/format (imagick/clone image) target))))
+	  0 pixels)
+    (emit "imagick->packet" name
+	  (timings (lambda () (imagick->packet image)))
+	  0 pixels)
+    (let ((best (config 'imagick:simd)))
+      (dolist (level (simd-levels best))
+	(config! 'imagick:simd level)
+	(emit (glom "luma:" level) name
+	      (timings (lambda () (imagick->pixels image 'luma)))
+	      0 pixels))
+      (config! 'imagick:simd best))
+    (when (and (search "-exif" name) (has-suffix name ".jpg"))
+      (emit "exif-get" name (timings (lambda () (exif-get packet)))
+	    (length packet) 0))))
+
+(define qrcode-inputs
+  '(("short" . 16) ("medium" . 256) ("long" . 1024)))
+
+(define (bench-qrcode)
+  (dolist (input qrcode-inputs)
+    (let ((string (make-string (cdr input) #\x)))
+      (emit "qrencode" (car input)
+	    (timings (lambda () (qrencode string)))
+	    (cdr input) 0))))
+
+(define (emit-metrics table)
+  (do-choices (prim (getkeys table))
+    (let ((entry (get table prim)))
+      (lineout "{\"op\":\"metrics\",\"prim\":" (jsonstring prim)
+	",\"calls\":" (get entry 'calls)
+	",\"errors\":" (get entry 'errors)
+	",\"total\":" (get entry 'total)
+	",\"max\":" (get entry 'max)
+	",\"mean\":" (get entry 'mean)
+	",\"bytes_in\":" (get entry 'bytes-in)
+	",\"bytes_out\":" (get entry 'bytes-out)
+	",\"megapixels\":" (get entry 'megapixels)
+	"}"))))
+
+(define (main)
+  (imagick/metrics #t)
+  (exif/metrics #t)
+  (qrcode/metrics #t)
+  (do-choices (file (pick (getfiles corpus) has-suffix {".jpg" ".png" ".tif"}))
+    (bench-image file))
+  (bench-qrcode)
+  (emit-metrics (imagick/metrics))
+  (emit-metrics (exif/metrics))
+  (emit-metrics (qrcode/metrics)))
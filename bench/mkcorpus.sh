@@ -0,0 +1,32 @@
+#!/bin/sh
+# Generates the benchmark image corpus in the directory given as the
+# first argument (default bench/corpus). The images are synthesized
+# from a fixed seed so that every build measures the same inputs.
+
+CORPUS=${1:-bench/corpus}
+CONVERT=${CONVERT:-convert}
+SEED=${BENCH_SEED:-4217}
+
+mkdir -p ${CORPUS} || exit 1
+
+# A minimal EXIF profile (little endian TIFF structure) with Make,
+# Model and Orientation entries.
+EXIF=${CORPUS}/bench.exif
+printf 'Exif\000\000II\052\000\010\000\000\000\003\000' > ${EXIF}
+printf '\017\001\002\000\006\000\000\000\062\000\000\000' >> ${EXIF}
+printf '\020\001\002\000\010\000\000\000\070\000\000\000' >> ${EXIF}
+printf '\022\001\003\000\001\000\000\000\001\000\000\000' >> ${EXIF}
+printf '\000\000\000\000Bench\000Corpus1\000' >> ${EXIF}
+
+for size in small:320x240 medium:1280x960 large:4000x3000; do
+    name=${size%%:*}; geometry=${size#*:};
+    base=${CORPUS}/${name}.miff
+    ${CONVERT} -seed ${SEED} -size ${geometry} plasma:fractal \
+	       -attenuate 0.3 +noise Gaussian +repage ${base} || exit 1
+    for fmt in jpg png tif; do
+	${CONVERT} ${base} -strip ${CORPUS}/${name}.${fmt} || exit 1
+	${CONVERT} ${base} -strip -profile ${EXIF} \
+		   ${CORPUS}/${name}-exif.${fmt} || exit 1
+    done
+    rm -f ${base}
+done
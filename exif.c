@@ -22,9 +22,15 @@
 #include <libexif/exif-data.h>
 #include <libexif/exif-tag.h>
 
+#include "imagetools_metrics.h"
 
 KNO_EXPORT int kno_init_exif(void) KNO_LIBINIT_FN;
 
+static struct KNO_PRIM_METRIC exif_get_metric = {"exif-get"};
+
+#define EXIF_DONE(result,in) \
+  (metrics_done(&exif_get_metric,started,result,in,0,0))
+
 static lispval exif2lisp(ExifEntry *exentry)
 {
   switch (exentry->format) {
@@ -246,16 +252,22 @@ DEFC_PRIM("exif-get",exif_get,
 	  {"prop",kno_any_type,KNO_VOID})
 static lispval exif_get(lispval x,lispval prop)
 {
+  long long started = metrics_start();
   ExifData *exdata;
-  if (KNO_PACKETP(x))
-    exdata = exif_data_new_from_data(KNO_PACKET_DATA(x),KNO_PACKET_LENGTH(x));
+  size_t bytes_in = 0;
+  if (KNO_PACKETP(x)) {
+    bytes_in = KNO_PACKET_LENGTH(x);
+    exdata = exif_data_new_from_data(KNO_PACKET_DATA(x),KNO_PACKET_LENGTH(x));}
   else if (KNO_STRINGP(x)) {
     ssize_t n_bytes;
     unsigned char *data = u8_filedata(KNO_CSTRING(x),&n_bytes);
-    if (data == NULL) return KNO_ERROR;
+    if (data == NULL) return EXIF_DONE(KNO_ERROR,0);
+    bytes_in = n_bytes;
     exdata = exif_data_new_from_data(KNO_PACKET_DATA(x),KNO_PACKET_LENGTH(x));
     u8_free(data);}
-  else return kno_type_error(_("filename or packet"),"exif_get",x);
+  else {
+    kno_type_error(_("filename or packet"),"exif_get",x);
+    return EXIF_DONE(KNO_ERROR,0);}
   if (KNO_VOIDP(prop)) {
     lispval slotmap = kno_empty_slotmap();
     struct TAGINFO *scan = taginfo;
@@ -267,16 +279,27 @@ static lispval exif_get(lispval x,lispval prop)
 	kno_add(slotmap,scan->tagsym,val);
 	kno_decref(val);}
       scan++;}
-    return slotmap;}
+    return EXIF_DONE(slotmap,bytes_in);}
   else {
     ExifEntry *exentry; ExifTag tag;
     lispval tagval = kno_hashtable_get(&exif_tagmap,prop,KNO_VOID);
-    if (!(KNO_FIXNUMP(tagval)))
-      return kno_type_error(_("exif tag"),"exif_get",prop);
+    if (!(KNO_FIXNUMP(tagval))) {
+      kno_type_error(_("exif tag"),"exif_get",prop);
+      return EXIF_DONE(KNO_ERROR,bytes_in);}
     tag = (ExifTag)KNO_FIX2INT(tagval);
     exentry = exif_data_get_entry(exdata,tag);
-    if (exentry) return exif2lisp(exentry);
-    else return KNO_EMPTY_CHOICE;}
+    if (exentry) return EXIF_DONE(exif2lisp(exentry),bytes_in);
+    else return EXIF_DONE(KNO_EMPTY_CHOICE,bytes_in);}
+}
+
+DEFC_PRIM("exif/metrics",exif_metrics_prim,
+	  KNO_MAX_ARGS(1)|KNO_MIN_ARGS(0),
+	  "Returns a table of call statistics for exif-get. If *reset* "
+	  "is true, the statistics are zeroed after being read.",
+	  {"reset",kno_any_type,KNO_FALSE})
+static lispval exif_metrics_prim(lispval reset)
+{
+  return metrics_table(&exif_get_metric,1,(!(KNO_FALSEP(reset))));
 }
 
 static long long int exif_init = 0;
@@ -298,6 +321,12 @@ KNO_EXPORT int kno_init_exif()
     scan->tagsym = symbol;
     scan++;}
 
+  init_metrics_symbols();
+  kno_register_config
+    ("EXIF:METRICS",
+     "Whether to record call statistics for exif-get",
+     kno_boolconfig_get,kno_boolconfig_set,&metrics_enabled);
+
   link_local_cprims();
 
   u8_register_source_file(_FILEINFO);
@@ -308,4 +337,5 @@ KNO_EXPORT int kno_init_exif()
 static void link_local_cprims()
 {
   KNO_LINK_CPRIM("exif-get",exif_get,2,exif_module);
+  KNO_LINK_CPRIM("exif/metrics",exif_metrics_prim,1,exif_module);
 }
@@ -0,0 +1,123 @@
+/* -*- Mode: C; Character-encoding: utf-8; -*- */
+
+/* imagetools_metrics.h
+   This implements per-primitive call statistics for the imagetools
+   modules. Each module includes this file and keeps its own table
+   of KNO_PRIM_METRIC structs, one per instrumented primitive.
+
+   Primitives return every result, including argument errors, through
+   metrics_done(), so errors counts all failed calls except those with
+   arguments rejected by the DEFC_PRIM type checks before the primitive
+   is entered.
+
+   Copyright (C) 2020-2022 beingmeta, LLC
+*/
+
+#include <time.h>
+
+typedef struct KNO_PRIM_METRIC {
+  u8_string name;
+  long long calls, errors;
+  long long total_nsecs, max_nsecs;
+  long long bytes_in, bytes_out, pixels;} KNO_PRIM_METRIC;
+typedef struct KNO_PRIM_METRIC *kno_prim_metric;
+
+/* Set by the module's METRICS config */
+static int metrics_enabled = 1;
+
+static lispval metric_calls_symbol, metric_errors_symbol;
+static lispval metric_total_symbol, metric_max_symbol, metric_mean_symbol;
+static lispval metric_bytes_in_symbol, metric_bytes_out_symbol;
+static lispval metric_megapixels_symbol;
+
+#define METRIC_ADD(var,delta) \
+  (__atomic_add_fetch(&(var),delta,__ATOMIC_RELAXED))
+
+/* Returns a start time for metrics_done(), or 0 when disabled */
+static long long metrics_start()
+{
+  if (!(metrics_enabled)) return 0;
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC,&now);
+  return (((long long)now.tv_sec)*1000000000LL)+now.tv_nsec;
+}
+
+/* Records a call which started at *started* and returns *result* */
+static lispval metrics_done(kno_prim_metric m,long long started,
+			    lispval result,size_t bytes_in,size_t bytes_out,
+			    size_t pixels)
+{
+  if (started == 0) return result;
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC,&now);
+  long long nsecs =
+    ((((long long)now.tv_sec)*1000000000LL)+now.tv_nsec)-started;
+  long long max = __atomic_load_n(&(m->max_nsecs),__ATOMIC_RELAXED);
+  METRIC_ADD(m->calls,1);
+  if (KNO_ABORTP(result)) METRIC_ADD(m->errors,1);
+  METRIC_ADD(m->total_nsecs,nsecs);
+  if (bytes_in) METRIC_ADD(m->bytes_in,bytes_in);
+  if (bytes_out) METRIC_ADD(m->bytes_out,bytes_out);
+  if (pixels) METRIC_ADD(m->pixels,pixels);
+  while ( (nsecs > max) &&
+	  (!(__atomic_compare_exchange_n
+	     (&(m->max_nsecs),&max,nsecs,0,
+	      __ATOMIC_RELAXED,__ATOMIC_RELAXED))) ) {}
+  return result;
+}
+
+static void metrics_store_double(lispval table,lispval key,double val)
+{
+  lispval v = kno_make_double(val);
+  kno_store(table,key,v);
+  kno_decref(v);
+}
+
+/* Returns a table mapping primitive names to their statistics,
+   optionally resetting them. */
+static lispval metrics_table(struct KNO_PRIM_METRIC *metrics,int n,
+			     int reset)
+{
+  lispval result = kno_make_hashtable(NULL,n*2);
+  int i = 0; while (i < n) {
+    kno_prim_metric m = &(metrics[i++]);
+    long long calls = (reset) ?
+      (__atomic_exchange_n(&(m->calls),0,__ATOMIC_RELAXED)) :
+      (__atomic_load_n(&(m->calls),__ATOMIC_RELAXED));
+#define METRIC_GET(field) \
+    ((reset) ? (__atomic_exchange_n(&(m->field),0,__ATOMIC_RELAXED)) : \
+     (__atomic_load_n(&(m->field),__ATOMIC_RELAXED)))
+    long long errors = METRIC_GET(errors);
+    long long total_nsecs = METRIC_GET(total_nsecs);
+    long long max_nsecs = METRIC_GET(max_nsecs);
+    long long bytes_in = METRIC_GET(bytes_in);
+    long long bytes_out = METRIC_GET(bytes_out);
+    long long pixels = METRIC_GET(pixels);
+#undef METRIC_GET
+    if (calls == 0) continue;
+    lispval entry = kno_empty_slotmap();
+    kno_store(entry,metric_calls_symbol,KNO_INT(calls));
+    kno_store(entry,metric_errors_symbol,KNO_INT(errors));
+    metrics_store_double(entry,metric_total_symbol,total_nsecs/1e9);
+    metrics_store_double(entry,metric_max_symbol,max_nsecs/1e9);
+    metrics_store_double(entry,metric_mean_symbol,(total_nsecs/1e9)/calls);
+    kno_store(entry,metric_bytes_in_symbol,KNO_INT(bytes_in));
+    kno_store(entry,metric_bytes_out_symbol,KNO_INT(bytes_out));
+    metrics_store_double(entry,metric_megapixels_symbol,pixels/1e6);
+    lispval key = kno_intern(m->name);
+    kno_store(result,key,entry);
+    kno_decref(entry);}
+  return result;
+}
+
+static void init_metrics_symbols()
+{
+  metric_calls_symbol = kno_intern("calls");
+  metric_errors_symbol = kno_intern("errors");
+  metric_total_symbol = kno_intern("total");
+  metric_max_symbol = kno_intern("max");
+  metric_mean_symbol = kno_intern("mean");
+  metric_bytes_in_symbol = kno_intern("bytes-in");
+  metric_bytes_out_symbol = kno_intern("bytes-out");
+  metric_megapixels_symbol = kno_intern("megapixels");
+}
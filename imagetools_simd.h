@@ -0,0 +1,154 @@
+/* -*- Mode: C; Character-encoding: utf-8; -*- */
+
+/* imagetools_simd.h
+   This implements the vector kernels used for 8-bit luma export by
+   the imagick module. Each kernel has a portable scalar version
+   and, on x86, SSE2 and AVX2 versions which compute exactly the same
+   results. init_simd_kernels() picks the best versions the CPU
+   supports, and set_simd_level() can select lower ones (for
+   benchmarking or comparing results).
+
+   Copyright (C) 2020-2022 beingmeta, LLC
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+
+#if ( defined(__x86_64__) || defined(__i386__) ) && defined(__SSE2__)
+#define IMAGETOOLS_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+/* BT.601 full range luma in 16-bit fixed point. LUMA_G is even, so
+   the SSE2 kernel can split it across two 16-bit multipliers. */
+#define LUMA_R 19595
+#define LUMA_G 38470
+#define LUMA_B 7471
+
+/* Computes the luma of n 8-bit pixels stored as RGBx (with a pad or
+   alpha byte) */
+static void rgbx8_luma_scalar(const unsigned char *restrict rgbx,
+			      unsigned char *restrict out,size_t n)
+{
+  size_t i;
+  for (i = 0; i < n; i++) {
+    unsigned int r = rgbx[i*4], g = rgbx[i*4+1], b = rgbx[i*4+2];
+    out[i] = (LUMA_R*r+LUMA_G*g+LUMA_B*b+32768)>>16;}
+}
+
+#if IMAGETOOLS_X86_SIMD
+
+/* Returns the unrounded luma of the two pixels in px (eight 16-bit
+   channels) in 32-bit lanes 0 and 2 */
+static inline __m128i luma_pair_sse2(__m128i px)
+{
+  const __m128i c1 = _mm_setr_epi16(LUMA_R,LUMA_G/2,LUMA_B,0,
+				    LUMA_R,LUMA_G/2,LUMA_B,0);
+  const __m128i c2 = _mm_setr_epi16(0,LUMA_G/2,0,0,0,LUMA_G/2,0,0);
+  __m128i sums = _mm_add_epi32(_mm_madd_epi16(px,c1),_mm_madd_epi16(px,c2));
+  return _mm_add_epi32(sums,_mm_srli_epi64(sums,32));
+}
+
+/* Returns the luma of the four pixels in v, in 32-bit lanes */
+static inline __m128i luma4_sse2(__m128i v)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i round = _mm_set1_epi32(32768);
+  __m128i lo = luma_pair_sse2(_mm_unpacklo_epi8(v,zero));
+  __m128i hi = luma_pair_sse2(_mm_unpackhi_epi8(v,zero));
+  lo = _mm_shuffle_epi32(lo,_MM_SHUFFLE(3,1,2,0));
+  hi = _mm_shuffle_epi32(hi,_MM_SHUFFLE(3,1,2,0));
+  return _mm_srli_epi32(_mm_add_epi32(_mm_unpacklo_epi64(lo,hi),round),16);
+}
+
+static void rgbx8_luma_sse2(const unsigned char *restrict rgbx,
+			    unsigned char *restrict out,size_t n)
+{
+  size_t i = 0;
+  while (i+8 <= n) {
+    __m128i a = luma4_sse2(_mm_loadu_si128((__m128i *)(rgbx+i*4)));
+    __m128i b = luma4_sse2(_mm_loadu_si128((__m128i *)(rgbx+i*4+16)));
+    __m128i words = _mm_packs_epi32(a,b);
+    _mm_storel_epi64((__m128i *)(out+i),_mm_packus_epi16(words,words));
+    i += 8;}
+  rgbx8_luma_scalar(rgbx+i*4,out+i,n-i);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i luma8_avx2(__m256i px)
+{
+  const __m256i mask = _mm256_set1_epi32(0xFF);
+  __m256i r = _mm256_and_si256(px,mask);
+  __m256i g = _mm256_and_si256(_mm256_srli_epi32(px,8),mask);
+  __m256i b = _mm256_and_si256(_mm256_srli_epi32(px,16),mask);
+  __m256i sum = _mm256_add_epi32
+    (_mm256_add_epi32(_mm256_mullo_epi32(r,_mm256_set1_epi32(LUMA_R)),
+		      _mm256_mullo_epi32(g,_mm256_set1_epi32(LUMA_G))),
+     _mm256_add_epi32(_mm256_mullo_epi32(b,_mm256_set1_epi32(LUMA_B)),
+		      _mm256_set1_epi32(32768)));
+  return _mm256_srli_epi32(sum,16);
+}
+
+__attribute__((target("avx2")))
+static void rgbx8_luma_avx2(const unsigned char *restrict rgbx,
+			    unsigned char *restrict out,size_t n)
+{
+  size_t i = 0;
+  while (i+16 <= n) {
+    __m256i a = luma8_avx2(_mm256_loadu_si256((__m256i *)(rgbx+i*4)));
+    __m256i b = luma8_avx2(_mm256_loadu_si256((__m256i *)(rgbx+i*4+32)));
+    /* The packs work within 128-bit lanes, so put a's and b's
+       halves back in order before narrowing to bytes */
+    __m256i words = _mm256_permute4x64_epi64(_mm256_packs_epi32(a,b),
+					     _MM_SHUFFLE(3,1,2,0));
+    __m256i bytes = _mm256_packus_epi16(words,words);
+    _mm_storel_epi64((__m128i *)(out+i),_mm256_castsi256_si128(bytes));
+    _mm_storel_epi64((__m128i *)(out+i+8),
+		     _mm256_extracti128_si256(bytes,1));
+    i += 16;}
+  rgbx8_luma_sse2(rgbx+i*4,out+i,n-i);
+}
+
+#endif
+
+static void (*rgbx8_luma)(const unsigned char *restrict,
+			  unsigned char *restrict,size_t) = rgbx8_luma_scalar;
+static u8_string simd_kernels = "scalar";
+
+/* Kernel levels, in order: 0 is scalar, 1 SSE2 and 2 AVX2.
+   simd_max_level is the highest one the CPU supports. */
+static u8_string simd_level_names[] = { "scalar", "sse2", "avx2" };
+static int simd_max_level = 0;
+
+/* Switches to the kernels of level, which must be supported */
+static void set_simd_level(int level)
+{
+  switch (level) {
+#if IMAGETOOLS_X86_SIMD
+  case 2: rgbx8_luma = rgbx8_luma_avx2; break;
+  case 1: rgbx8_luma = rgbx8_luma_sse2; break;
+#endif
+  default: rgbx8_luma = rgbx8_luma_scalar; level = 0;}
+  simd_kernels = simd_level_names[level];
+}
+
+/* Returns the level called name, or -1 if it's unknown or the CPU
+   doesn't support it */
+static int simd_level(const char *name)
+{
+  int level = 0; while (level <= simd_max_level) {
+    if (strcasecmp(name,simd_level_names[level]) == 0) return level;
+    level++;}
+  return -1;
+}
+
+static void init_simd_kernels()
+{
+#if IMAGETOOLS_X86_SIMD
+  simd_max_level = 1;
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) simd_max_level = 2;
+#endif
+  set_simd_level(simd_max_level);
+}
@@ -10,6 +10,11 @@
 #define _FILEINFO __FILE__
 #endif
 
+/* For fopencookie() */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif
+
 /* This avoids potential conflicts with OpenMP */
 #define KNO_INLINE_REFCOUNTS 0
 
@@ -19,6 +24,7 @@
 #include "kno/numbers.h"
 #include "kno/sequences.h"
 #include "kno/texttools.h"
+#include "kno/streams.h"
 #include "kno/cprims.h"
 
 #include <libu8/libu8.h>
@@ -31,18 +37,161 @@
 #include <limits.h>
 #include <ctype.h>
 #include <math.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <utime.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <time.h>
+
+#include "imagetools_metrics.h"
+#include "imagetools_simd.h"
 
 u8_condition MagickWandError="ImageMagicWand error";
 kno_lisp_type kno_imagick_type;
 #define KNO_IMAGICK_TYPE 0x1c3e8812
+kno_lisp_type kno_imagick_lazy_type;
+#define KNO_IMAGICK_LAZY_TYPE 0x1c3e8813
+
+/* Defined with the lazy pipelines below */
+static lispval lazy_record(lispval lazyref,u8_string opname,
+			   int n_args,lispval *args,u8_context cxt);
+static lispval lazy_realize(lispval lazyref,u8_context cxt);
 
 KNO_EXPORT int kno_init_imagick(void) KNO_LIBINIT_FN;
 
+/* footprint is the pixel cache size (in bytes) accounted to this
+   wrapper, and shared is set for clones whose pixels haven't been
+   accounted yet. */
 typedef struct KNO_IMAGICK {
   KNO_CONS_HEADER;
-  MagickWand *wand;} KNO_IMAGICK;
+  MagickWand *wand;
+  size_t footprint;
+  int shared;} KNO_IMAGICK;
 typedef struct KNO_IMAGICK *kno_imagick;
 
+/* Call statistics, one entry per instrumented primitive. Primitives
+   which only report state (such as imagick/footprint, imagick/ready?
+   and imagick/async-stats) aren't instrumented; the async submitters
+   are, but only for the time taken to queue their jobs, while the
+   time spent waiting for them is counted by imagick/await. */
+
+enum IMAGICK_METRIC_ID {
+  IM_FILE_READ,
+  IM_PACKET_READ,
+  IM_STREAM_READ,
+  IM_PIXELS_READ,
+  IM_PROBE,
+  IM_FILE_WRITE,
+  IM_PACKET_WRITE,
+  IM_STREAM_WRITE,
+  IM_PIXELS_WRITE,
+  IM_FORMAT,
+  IM_FIT,
+  IM_RENDITIONS,
+  IM_CONVERT_FILE,
+  IM_TILE_PYRAMID,
+  IM_EXTEND,
+  IM_CHARCOAL,
+  IM_EMBOSS,
+  IM_BLUR,
+  IM_EDGE,
+  IM_CROP,
+  IM_FLIP,
+  IM_FLOP,
+  IM_EQUALIZE,
+  IM_DESPECKLE,
+  IM_ENHANCE,
+  IM_DESKEW,
+  IM_STATS,
+  IM_HISTOGRAM,
+  IM_TILE_STATS,
+  IM_DHASH,
+  IM_PHASH,
+  IM_ENCODE_TO_SIZE,
+  IM_APPLY,
+  IM_COLORSPACE,
+  IM_DERIVE,
+  IM_COMPOSITE,
+  IM_STAMP,
+  IM_SKEW_ANGLE,
+  IM_REALIZE,
+  IM_AWAIT,
+  IM_CLONE,
+  IM_INTERLACE,
+  IM_LAZY,
+  IM_ASYNC_DECODE,
+  IM_ASYNC_APPLY,
+  IM_ASYNC_ENCODE,
+  IM_ASYNC_DERIVE,
+  IM_N_METRICS};
+
+static struct KNO_PRIM_METRIC imagick_metrics[IM_N_METRICS]={
+  {"file->imagick"},
+  {"packet->imagick"},
+  {"stream->imagick"},
+  {"pixels->imagick"},
+  {"imagick/probe"},
+  {"imagick->file"},
+  {"imagick->packet"},
+  {"imagick->stream"},
+  {"imagick->pixels"},
+  {"imagick/format"},
+  {"imagick/fit"},
+  {"imagick/renditions"},
+  {"imagick/convert-file"},
+  {"imagick/tile-pyramid"},
+  {"imagick/extend"},
+  {"imagick/charcoal"},
+  {"imagick/emboss"},
+  {"imagick/blur"},
+  {"imagick/edge"},
+  {"imagick/crop"},
+  {"imagick/flip"},
+  {"imagick/flop"},
+  {"imagick/equalize"},
+  {"imagick/despeckle"},
+  {"imagick/enhance"},
+  {"imagick/deskew"},
+  {"imagick/stats"},
+  {"imagick/histogram"},
+  {"imagick/tile-stats"},
+  {"imagick/dhash"},
+  {"imagick/phash"},
+  {"imagick/encode-to-size"},
+  {"imagick/apply"},
+  {"imagick/colorspace"},
+  {"imagick/derive"},
+  {"imagick/composite"},
+  {"imagick/stamp"},
+  {"imagick/skew-angle"},
+  {"imagick/realize"},
+  {"imagick/await"},
+  {"imagick/clone"},
+  {"imagick/interlace"},
+  {"imagick/lazy"},
+  {"imagick/async-decode"},
+  {"imagick/async-apply"},
+  {"imagick/async-encode"},
+  {"imagick/async-derive"}};
+
+#define IMAGICK_DONE(which,result,in,out,pixels) \
+  (metrics_done(&(imagick_metrics[which]),started,result,in,out,pixels))
+
+/* Returns the number of pixels in the current image of wand */
+static size_t wand_pixels(MagickWand *wand)
+{
+  if (!(metrics_enabled)) return 0;
+  return MagickGetImageWidth(wand)*MagickGetImageHeight(wand);
+}
+
+static lispval format, resolution, size, width, height, interlace;
+static lispval line_interlace, plane_interlace, partition_interlace;
+static lispval name_symbol, filter_symbol, mode_symbol;
+static lispval frames_symbol, depth_symbol, colorspace_symbol;
+static lispval compression_symbol;
+
 /* Data for conversions */
 
 static struct CTYPEMAP {
@@ -128,275 +277,5386 @@ char *cspace2string(ColorspaceType cs)
   return NULL;
 }
 
+static ColorspaceType string2cspace(u8_string name)
+{
+  struct CSMAP *scan = csmap;
+  while (scan->cs!=UndefinedColorspace)
+    if (strcasecmp(name,scan->csname) == 0) return scan->cs;
+    else scan++;
+  return UndefinedColorspace;
+}
+
+
+void magickwand_atexit()
+{
+  MagickWandTerminus();
+}
+
+void grabmagickerr(u8_context cxt,MagickWand *wand)
+{
+  ExceptionType severity;
+  char *description = MagickGetException(wand,&severity);
+  if (errno) u8_graberrno(cxt,NULL);
+  u8_seterr(MagickWandError,cxt,u8_strdup(description));
+  MagickRelinquishMemory(description);
+  MagickClearException(wand);
+}
+
+/* Running independent wand operations in parallel */
+
+static int imagick_threads = 4;
+
+struct IMAGICK_TASKS {
+  int n_tasks, next_task;
+  void (*taskfn)(void *,int);
+  void *taskdata;
+  u8_mutex lock;};
+
+static void *imagick_task_loop(void *arg)
+{
+  struct IMAGICK_TASKS *tasks = (struct IMAGICK_TASKS *)arg;
+  while (1) {
+    int i;
+    u8_lock_mutex(&(tasks->lock));
+    i = tasks->next_task++;
+    u8_unlock_mutex(&(tasks->lock));
+    if (i >= tasks->n_tasks) break;
+    tasks->taskfn(tasks->taskdata,i);}
+  return NULL;
+}
+
+/* Calls taskfn on each of 0..n_tasks-1 using up to n_threads
+   threads (including the calling thread). The task functions
+   should only touch their own wands and must not call into Kno. */
+static void imagick_parallel(int n_tasks,int n_threads,
+			     void (*taskfn)(void *,int),void *taskdata)
+{
+  struct IMAGICK_TASKS tasks = { n_tasks, 0, taskfn, taskdata };
+  if (n_threads > n_tasks) n_threads = n_tasks;
+  if (n_threads <= 1) {
+    int i = 0; while (i < n_tasks) taskfn(taskdata,i++);
+    return;}
+  pthread_t *threads = u8_alloc_n(n_threads-1,pthread_t);
+  int i = 0, started = 0;
+  u8_init_mutex(&(tasks.lock));
+  while (i < n_threads-1) {
+    if (pthread_create(&(threads[i]),NULL,imagick_task_loop,&tasks) == 0)
+      started++;
+    i++;}
+  imagick_task_loop(&tasks);
+  i = 0; while (i < started) pthread_join(threads[i++],NULL);
+  u8_destroy_mutex(&(tasks.lock));
+  u8_free(threads);
+}
+
+/* Like grabmagickerr, but returns the message (to be freed with
+   u8_free) rather than setting the error, for use in task threads. */
+static char *copymagickerr(MagickWand *wand)
+{
+  ExceptionType severity;
+  char *description = MagickGetException(wand,&severity);
+  char *copy = u8_strdup(description);
+  MagickRelinquishMemory(description);
+  MagickClearException(wand);
+  return copy;
+}
+
+static int unparse_imagick(struct U8_OUTPUT *out,lispval x)
+{
+  struct KNO_IMAGICK *wrapper = (struct KNO_IMAGICK *)x;
+  if (wrapper->footprint)
+    u8_printf(out,"#<IMAGICK %lx %lldKB>",((unsigned long)(wrapper->wand)),
+	      ((long long)(wrapper->footprint/1024)));
+  else if (wrapper->shared)
+    u8_printf(out,"#<IMAGICK %lx shared>",((unsigned long)(wrapper->wand)));
+  else u8_printf(out,"#<IMAGICK %lx>",((unsigned long)(wrapper->wand)));
+  return 1;
+}
+
+/* Pixel memory accounting
+
+   Each wrapper records the size of the pixel cache held by its wand,
+   and imagick_pixel_bytes is the total over all live wrappers. When
+   IMAGICK:MAXPIXELMB is set, decoding fails once the total exceeds
+   it, rather than letting the process grow until it is killed.
+
+   A clone shares the pixel cache of its original until one of them
+   is modified, so it starts out shared and unaccounted, and is only
+   charged by the imagick_account() which follows its first change. */
+
+static long long imagick_pixel_bytes = 0;
+static int imagick_max_pixel_mb = 0;
+
+u8_condition ImagickMemoryLimit="IMAGICK:MAXPIXELMB exceeded";
+
+#define PIXEL_BYTES_ADD(delta) \
+  (__atomic_add_fetch(&imagick_pixel_bytes,delta,__ATOMIC_RELAXED))
+
+static size_t image_footprint(MagickWand *wand)
+{
+  size_t bytes_per_pixel = sizeof(PixelPacket);
+  if (MagickGetImageColorspace(wand) == CMYKColorspace)
+    bytes_per_pixel += sizeof(IndexPacket);
+  return MagickGetImageWidth(wand)*MagickGetImageHeight(wand)*
+    bytes_per_pixel;
+}
+
+/* Returns the pixel cache size of all the images in wand */
+static size_t wand_footprint(MagickWand *wand)
+{
+  size_t n_images = MagickGetNumberImages(wand);
+  if (n_images == 0) return 0;
+  else if (n_images == 1) return image_footprint(wand);
+  ssize_t current = MagickGetIteratorIndex(wand);
+  size_t total = 0, i = 0;
+  while (i < n_images) {
+    MagickSetIteratorIndex(wand,i++);
+    total += image_footprint(wand);}
+  MagickSetIteratorIndex(wand,current);
+  return total;
+}
+
+/* Updates the footprint of wrapper after its images have changed */
+static void imagick_account(struct KNO_IMAGICK *wrapper)
+{
+  size_t footprint = wand_footprint(wrapper->wand);
+  wrapper->shared = 0;
+  if (footprint != wrapper->footprint) {
+    PIXEL_BYTES_ADD(((long long)footprint)-((long long)wrapper->footprint));
+    wrapper->footprint = footprint;}
+}
+
+/* Drops the footprint accounted to wrapper, before its images are
+   cleared or destroyed */
+static void imagick_disown(struct KNO_IMAGICK *wrapper)
+{
+  size_t footprint = wrapper->footprint;
+  wrapper->footprint = 0;
+  if (footprint) PIXEL_BYTES_ADD(-((long long)footprint));
+}
+
+/* Fails if accounted pixel memory, plus another more bytes about to
+   be accounted, exceeds IMAGICK:MAXPIXELMB */
+static int imagick_check_room(size_t more,u8_context cxt)
+{
+  long long limit = ((long long)imagick_max_pixel_mb)*1024*1024;
+  if (limit <= 0) return 0;
+  long long used = __atomic_load_n(&imagick_pixel_bytes,__ATOMIC_RELAXED)+
+    ((long long)more);
+  if (used <= limit) return 0;
+  u8_seterr(ImagickMemoryLimit,cxt,
+	    u8_mkstring("%lldMB of pixels in use",used/(1024*1024)));
+  return -1;
+}
+
+/* Fails if accounted pixel memory exceeds IMAGICK:MAXPIXELMB */
+static int imagick_check_limit(u8_context cxt)
+{
+  return imagick_check_room(0,cxt);
+}
+
+/* Adds bytes to the accounted pixel memory unless that would exceed
+   IMAGICK:MAXPIXELMB, returning -1 (without signalling an error, so
+   that it can be used in task threads) if it would */
+static int imagick_reserve(size_t bytes)
+{
+  long long limit = ((long long)imagick_max_pixel_mb)*1024*1024;
+  long long used = PIXEL_BYTES_ADD((long long)bytes);
+  if ( (limit <= 0) || (used <= limit) ) return 0;
+  PIXEL_BYTES_ADD(-((long long)bytes));
+  return -1;
+}
+
+/* Pings the image file at path (with the jpeg:size hint, if any) and
+   fails if decoding it whole would exceed IMAGICK:MAXPIXELMB. Files
+   which can't be pinged are left for the read to report. */
+static int imagick_check_file_room(u8_string path,const char *hint,
+				   u8_context cxt)
+{
+  if (imagick_max_pixel_mb <= 0) return 0;
+  MagickWand *ping = NewMagickWand();
+  if (hint) MagickSetOption(ping,"jpeg:size",hint);
+  size_t bytes = 0;
+  if (MagickPingImage(ping,path) == MagickFalse)
+    MagickClearException(ping);
+  else bytes = wand_footprint(ping);
+  DestroyMagickWand(ping);
+  return imagick_check_room(bytes,cxt);
+}
+
+/* Pooling wrappers and wands
+
+   Wrappers are kept, together with their cleared wands, on per-thread
+   free lists, so that decoding doesn't need to allocate a new wand
+   and cons each time. */
+
+static int imagick_pool_max = 16;
+static long long pool_requests = 0, pool_reused = 0;
+static long long pool_returned = 0, pool_discarded = 0, pool_size = 0;
+
+struct IMAGICK_POOL {
+  int n_free, max_free;
+  struct KNO_IMAGICK **free;};
+
+static pthread_key_t imagick_pool_key;
+
+#define POOL_COUNT(var,delta) \
+  (__atomic_add_fetch(&(var),delta,__ATOMIC_RELAXED))
+
+static void free_imagick_pool(void *ptr)
+{
+  struct IMAGICK_POOL *pool = (struct IMAGICK_POOL *)ptr;
+  int i = 0; while (i < pool->n_free) {
+    struct KNO_IMAGICK *wrapper = pool->free[i++];
+    DestroyMagickWand(wrapper->wand);
+    u8_free(wrapper);}
+  POOL_COUNT(pool_size,-(pool->n_free));
+  u8_free(pool->free);
+  u8_free(pool);
+}
+
+static struct IMAGICK_POOL *get_imagick_pool()
+{
+  struct IMAGICK_POOL *pool = pthread_getspecific(imagick_pool_key);
+  if ( (pool == NULL) && (imagick_pool_max > 0) ) {
+    pool = u8_alloc(struct IMAGICK_POOL);
+    pool->n_free = 0;
+    pool->max_free = imagick_pool_max;
+    pool->free = u8_alloc_n(pool->max_free,struct KNO_IMAGICK *);
+    pthread_setspecific(imagick_pool_key,pool);}
+  return pool;
+}
+
+/* Returns a fresh wrapper with an empty wand */
+static struct KNO_IMAGICK *imagick_alloc()
+{
+  struct IMAGICK_POOL *pool = pthread_getspecific(imagick_pool_key);
+  struct KNO_IMAGICK *wrapper;
+  POOL_COUNT(pool_requests,1);
+  if ( (pool) && (pool->n_free > 0) ) {
+    wrapper = pool->free[--(pool->n_free)];
+    POOL_COUNT(pool_size,-1);
+    POOL_COUNT(pool_reused,1);}
+  else {
+    wrapper = u8_alloc(struct KNO_IMAGICK);
+    wrapper->wand = NewMagickWand();}
+  KNO_INIT_FRESH_CONS(wrapper,kno_imagick_type);
+  wrapper->footprint = 0;
+  wrapper->shared = 0;
+  return wrapper;
+}
+
+/* Returns a wrapper and its wand to the current
+   thread's pool, or frees them if the pool is full */
+static void imagick_release(struct KNO_IMAGICK *wrapper)
+{
+  struct IMAGICK_POOL *pool = get_imagick_pool();
+  imagick_disown(wrapper);
+  if ( (pool) && (pool->n_free >= pool->max_free) &&
+       (pool->max_free < imagick_pool_max) ) {
+    pool->max_free = imagick_pool_max;
+    pool->free = u8_realloc_n(pool->free,pool->max_free,
+			      struct KNO_IMAGICK *);}
+  if ( (pool) && (pool->n_free < imagick_pool_max) ) {
+    ClearMagickWand(wrapper->wand);
+    pool->free[pool->n_free++] = wrapper;
+    POOL_COUNT(pool_size,1);
+    POOL_COUNT(pool_returned,1);}
+  else {
+    DestroyMagickWand(wrapper->wand);
+    u8_free(wrapper);
+    POOL_COUNT(pool_discarded,1);}
+}
+
+static void recycle_imagick(struct KNO_RAW_CONS *c)
+{
+  struct KNO_IMAGICK *wrapper = (struct KNO_IMAGICK *)c;
+  if (KNO_STATIC_CONSP(c)) {
+    imagick_disown(wrapper);
+    DestroyMagickWand(wrapper->wand);}
+  else imagick_release(wrapper);
+}
+
+/* Wraps a wand which didn't come from imagick_alloc() */
+static lispval make_imagick(MagickWand *wand)
+{
+  struct KNO_IMAGICK *imagickref = u8_alloc(struct KNO_IMAGICK);
+  KNO_INIT_FRESH_CONS(imagickref,kno_imagick_type);
+  imagickref->wand = wand;
+  imagickref->footprint = 0;
+  imagickref->shared = 0;
+  imagick_account(imagickref);
+  return (lispval)imagickref;
+}
+/* Decoding options */
+
+static lispval autoorient_symbol, strip_symbol;
+
+#if (MagickLibVersion<0x689)
+/* Older versions lack MagickAutoOrientImage */
+static MagickBooleanType MagickAutoOrientImage(MagickWand *wand)
+{
+  MagickBooleanType ok = MagickTrue;
+  PixelWand *background = NULL;
+  switch (MagickGetImageOrientation(wand)) {
+  case TopRightOrientation:
+    ok = MagickFlopImage(wand); break;
+  case BottomRightOrientation:
+    background = NewPixelWand();
+    ok = MagickRotateImage(wand,background,180); break;
+  case BottomLeftOrientation:
+    ok = MagickFlipImage(wand); break;
+  case LeftTopOrientation:
+    ok = MagickTransposeImage(wand); break;
+  case RightTopOrientation:
+    background = NewPixelWand();
+    ok = MagickRotateImage(wand,background,90); break;
+  case RightBottomOrientation:
+    ok = MagickTransverseImage(wand); break;
+  case LeftBottomOrientation:
+    background = NewPixelWand();
+    ok = MagickRotateImage(wand,background,270); break;
+  default:
+    return MagickTrue;}
+  if (background) DestroyPixelWand(background);
+  if (ok == MagickFalse) return ok;
+  return MagickSetImageOrientation(wand,TopLeftOrientation);
+}
+#endif
+
+/* Applies the autoorient and strip options to each image just
+   read into wand, before anything else is done with them. */
+static int imagick_decode_opts(MagickWand *wand,lispval opts,u8_context cxt)
+{
+  if (KNO_VOIDP(opts)) return 0;
+  int autoorient = kno_testopt(opts,autoorient_symbol,KNO_VOID);
+  int strip = kno_testopt(opts,strip_symbol,KNO_VOID);
+  if (!( (autoorient) || (strip) )) return 0;
+  MagickResetIterator(wand);
+  while (MagickNextImage(wand) != MagickFalse) {
+    if ( (autoorient) && (MagickAutoOrientImage(wand) == MagickFalse) ) {
+      grabmagickerr(cxt,wand);
+      return -1;}
+    if ( (strip) && (MagickStripImage(wand) == MagickFalse) ) {
+      grabmagickerr(cxt,wand);
+      return -1;}}
+  MagickResetIterator(wand);
+  return 0;
+}
+
+/* Writes the ImageMagick scene selector (e.g. "0", "2-5" or "1,3,7")
+   for the frames option in opts into buf, returning 1 if there is
+   one, 0 if there isn't, and -1 (signalling an error) if the option
+   is invalid. */
+static int frame_selector(lispval opts,char *buf,size_t len,u8_context cxt)
+{
+  if (KNO_VOIDP(opts)) return 0;
+  lispval frames = kno_getopt(opts,frames_symbol,KNO_VOID);
+  int rv = 1;
+  if (KNO_VOIDP(frames))
+    rv = 0;
+  else if (KNO_UINTP(frames))
+    snprintf(buf,len,"%lld",(long long)KNO_FIX2INT(frames));
+  else if ( (KNO_PAIRP(frames)) && (KNO_UINTP(KNO_CAR(frames))) &&
+	    (KNO_UINTP(KNO_CDR(frames))) )
+    snprintf(buf,len,"%lld-%lld",(long long)KNO_FIX2INT(KNO_CAR(frames)),
+	     (long long)KNO_FIX2INT(KNO_CDR(frames)));
+  else if (KNO_VECTORP(frames)) {
+    int i = 0, n = KNO_VECTOR_LENGTH(frames);
+    size_t used = 0;
+    buf[0] = '\0';
+    while ( (i < n) && (rv > 0) ) {
+      lispval elt = KNO_VECTOR_REF(frames,i);
+      if (!(KNO_UINTP(elt))) rv = -1;
+      else {
+	int w = snprintf(buf+used,len-used,"%s%lld",(i) ? (",") : (""),
+			 (long long)KNO_FIX2INT(elt));
+	if ((w < 0) || (used+w >= len)) rv = -1;
+	else used += w;}
+      i++;}}
+  else rv = -1;
+  if (rv < 0) kno_type_error("frame selector",cxt,frames);
+  kno_decref(frames);
+  return rv;
+}
+
+DEFC_PRIM("file->imagick",file2imagick,
+	  KNO_MAX_ARGS(2)|KNO_MIN_ARGS(1),
+	  "Reads an image from *filename*. If *opts* specifies "
+	  "`autoorient`, the image is rotated to match its EXIF "
+	  "orientation and if it specifies `strip`, its profiles and "
+	  "comments are removed. To decode only some frames (or pages) "
+	  "of a multi-frame image, `frames` can be a frame number, a "
+	  "(*first* . *last*) pair or a vector of frame numbers.",
+	  {"filename",kno_string_type,KNO_VOID},
+	  {"opts",kno_any_type,KNO_VOID})
+
+
+lispval file2imagick(lispval filename,lispval opts)
+{
+  long long started = metrics_start();
+  MagickWand *wand;
+  MagickBooleanType retval;
+  char selector[128];
+  int selected = frame_selector(opts,selector,sizeof(selector),"file2imagick");
+  if (selected < 0) return IMAGICK_DONE(IM_FILE_READ,KNO_ERROR_VALUE,0,0,0);
+  struct KNO_IMAGICK *imagickref = imagick_alloc();
+  wand = imagickref->wand;
+  if (selected) {
+    u8_string path = u8_mkstring("%s[%s]",KNO_CSTRING(filename),selector);
+    retval = MagickReadImage(wand,path);
+    u8_free(path);}
+  else retval = MagickReadImage(wand,KNO_CSTRING(filename));
+  if (retval == MagickFalse) {
+    grabmagickerr("file2imagick",wand);
+    imagick_release(imagickref);
+    return IMAGICK_DONE(IM_FILE_READ,KNO_ERROR_VALUE,0,0,0);}
+  if (imagick_decode_opts(wand,opts,"file2imagick") < 0) {
+    imagick_release(imagickref);
+    return IMAGICK_DONE(IM_FILE_READ,KNO_ERROR_VALUE,0,0,0);}
+  imagick_account(imagickref);
+  if (imagick_check_limit("file2imagick") < 0) {
+    imagick_release(imagickref);
+    return IMAGICK_DONE(IM_FILE_READ,KNO_ERROR_VALUE,0,0,0);}
+  else {
+    U8_CLEAR_ERRNO();
+    return IMAGICK_DONE(IM_FILE_READ,(lispval)imagickref,
+			0,0,wand_pixels(wand));}
+}
+DEFC_PRIM("packet->imagick",packet2imagick,
+	  KNO_MAX_ARGS(2)|KNO_MIN_ARGS(1),
+	  "Decodes the image data in *packet*, taking the same *opts* "
+	  "as `file->imagick`.",
+	  {"packet",kno_packet_type,KNO_VOID},
+	  {"opts",kno_any_type,KNO_VOID})
+
+lispval packet2imagick(lispval packet,lispval opts)
+{
+  long long started = metrics_start();
+  MagickWand *wand;
+  MagickBooleanType retval;
+  char selector[128];
+  int selected = frame_selector(opts,selector+1,sizeof(selector)-2,
+				"packet2imagick");
+  if (selected < 0) return IMAGICK_DONE(IM_PACKET_READ,KNO_ERROR_VALUE,0,0,0);
+  struct KNO_IMAGICK *imagickref = imagick_alloc();
+  wand = imagickref->wand;
+  if (selected) {
+    /* Blob reads take the scene selection from the filename */
+    selector[0] = '[';
+    strcat(selector,"]");
+    MagickSetFilename(wand,selector);}
+  retval = MagickReadImageBlob
+    (imagickref->wand,KNO_PACKET_DATA(packet),KNO_PACKET_LENGTH(packet));
+  if (retval == MagickFalse) {
+    grabmagickerr("file2imagick",wand);
+    imagick_release(imagickref);
+    return IMAGICK_DONE(IM_PACKET_READ,KNO_ERROR_VALUE,0,0,0);}
+  if (imagick_decode_opts(wand,opts,"packet2imagick") < 0) {
+    imagick_release(imagickref);
+    return IMAGICK_DONE(IM_PACKET_READ,KNO_ERROR_VALUE,0,0,0);}
+  imagick_account(imagickref);
+  if (imagick_check_limit("packet2imagick") < 0) {
+    imagick_release(imagickref);
+    return IMAGICK_DONE(IM_PACKET_READ,KNO_ERROR_VALUE,0,0,0);}
+  else {
+    U8_CLEAR_ERRNO();
+    return IMAGICK_DONE(IM_PACKET_READ,(lispval)imagickref,
+			KNO_PACKET_LENGTH(packet),0,wand_pixels(wand));}
+}
+/* Returns a table describing the images read or pinged into wand */
+static lispval probe_table(MagickWand *wand)
+{
+  lispval result = kno_empty_slotmap();
+  MagickResetIterator(wand);
+  char *fmt = MagickGetImageFormat(wand);
+  if (fmt) {
+    lispval fmtval = kno_mkstring(fmt);
+    kno_store(result,format,fmtval);
+    kno_decref(fmtval);
+    MagickRelinquishMemory(fmt);}
+  kno_store(result,width,KNO_INT(MagickGetImageWidth(wand)));
+  kno_store(result,height,KNO_INT(MagickGetImageHeight(wand)));
+  kno_store(result,frames_symbol,KNO_INT(MagickGetNumberImages(wand)));
+  kno_store(result,depth_symbol,KNO_INT(MagickGetImageDepth(wand)));
+  char *csname = cspace2string(MagickGetImageColorspace(wand));
+  if (csname) kno_store(result,colorspace_symbol,kno_intern(csname));
+  char *ctname = ctype2string(MagickGetImageCompression(wand));
+  if (ctname) kno_store(result,compression_symbol,kno_intern(ctname));
+  return result;
+}
+
+DEFC_PRIM("imagick/probe",imagick_probe,
+	  KNO_MAX_ARGS(1)|KNO_MIN_ARGS(1),
+	  "Reads the header of the image in *arg* (a packet or a "
+	  "filename) without decoding its pixels and returns a table "
+	  "of its `format`, `width`, `height`, `frames`, `depth`, "
+	  "`colorspace` and `compression`.",
+	  {"arg",kno_any_type,KNO_VOID})
+
+lispval imagick_probe(lispval arg)
+{
+  long long started = metrics_start();
+  MagickBooleanType retval;
+  struct KNO_IMAGICK *temp = imagick_alloc();
+  MagickWand *wand = temp->wand;
+  if (KNO_PACKETP(arg))
+    retval = MagickPingImageBlob(wand,KNO_PACKET_DATA(arg),
+				 KNO_PACKET_LENGTH(arg));
+  else if (KNO_STRINGP(arg))
+    retval = MagickPingImage(wand,KNO_CSTRING(arg));
+  else {
+    imagick_release(temp);
+    kno_type_error(_("filename or packet"),"imagick_probe",arg);
+    return IMAGICK_DONE(IM_PROBE,KNO_ERROR_VALUE,0,0,0);}
+  if (retval == MagickFalse) {
+    grabmagickerr("imagick_probe",wand);
+    imagick_release(temp);
+    return IMAGICK_DONE(IM_PROBE,KNO_ERROR_VALUE,0,0,0);}
+  lispval result = probe_table(wand);
+  imagick_release(temp);
+  U8_CLEAR_ERRNO();
+  return IMAGICK_DONE(IM_PROBE,result,0,0,0);
+}
+/* Reading and writing Kno streams */
+
+/* Image formats we can recognize from their first bytes. Telling
+   ImageMagick the format up front keeps it from copying unseekable
+   input to a temporary file before decoding it. */
+static const char *sniff_format(const unsigned char *bytes,size_t len)
+{
+  if ( (len >= 3) && (bytes[0] == 0xFF) && (bytes[1] == 0xD8) &&
+       (bytes[2] == 0xFF) )
+    return "JPEG";
+  else if ( (len >= 8) && (memcmp(bytes,"\x89PNG\r\n\x1a\n",8) == 0) )
+    return "PNG";
+  else if ( (len >= 4) && (memcmp(bytes,"GIF8",4) == 0) )
+    return "GIF";
+  else if ( (len >= 12) && (memcmp(bytes,"RIFF",4) == 0) &&
+	    (memcmp(bytes+8,"WEBP",4) == 0) )
+    return "WEBP";
+  else if ( (len >= 2) && (memcmp(bytes,"BM",2) == 0) )
+    return "BMP";
+  else return NULL;
+}
+
+struct STREAM_COOKIE {
+  kno_stream stream;
+  size_t n_bytes;};
+
+static ssize_t stream_read_bytes(void *cookie,char *buf,size_t size)
+{
+  struct STREAM_COOKIE *sc = (struct STREAM_COOKIE *)cookie;
+  struct KNO_INBUF *in = kno_readbuf(sc->stream);
+  if (in->bufread >= in->buflim) {
+    if (kno_request_bytes(in,1) <= 0) return 0;}
+  size_t n_bytes = in->buflim-in->bufread;
+  if (n_bytes > size) n_bytes = size;
+  memcpy(buf,in->bufread,n_bytes);
+  in->bufread += n_bytes;
+  sc->n_bytes += n_bytes;
+  return n_bytes;
+}
+
+static ssize_t stream_write_bytes(void *cookie,const char *buf,size_t size)
+{
+  struct STREAM_COOKIE *sc = (struct STREAM_COOKIE *)cookie;
+  struct KNO_OUTBUF *out = kno_writebuf(sc->stream);
+  /* The stream's buffer flushes itself as it fills; the caller
+     flushes the rest once the stream is unlocked */
+  if (kno_write_bytes(out,(const unsigned char *)buf,size) < 0)
+    return -1;
+  sc->n_bytes += size;
+  return size;
+}
+
+#if defined(__GLIBC__)
+static FILE *stream_fopen(struct STREAM_COOKIE *sc,int output)
+{
+  cookie_io_functions_t iofns = { NULL, NULL, NULL, NULL };
+  if (output) iofns.write = stream_write_bytes;
+  else iofns.read = stream_read_bytes;
+  return fopencookie(sc,((output)?("wb"):("rb")),iofns);
+}
+#elif defined(__APPLE__) || defined(__FreeBSD__)
+static int stream_funread(void *cookie,char *buf,int size)
+{
+  return stream_read_bytes(cookie,buf,size);
+}
+static int stream_funwrite(void *cookie,const char *buf,int size)
+{
+  return stream_write_bytes(cookie,buf,size);
+}
+static FILE *stream_fopen(struct STREAM_COOKIE *sc,int output)
+{
+  if (output)
+    return funopen(sc,NULL,stream_funwrite,NULL,NULL);
+  else return funopen(sc,stream_funread,NULL,NULL,NULL);
+}
+#else
+static FILE *stream_fopen(struct STREAM_COOKIE *sc,int output)
+{
+  errno = ENOTSUP;
+  return NULL;
+}
+#endif
+
+static lispval ping_symbol;
+
+DEFC_PRIM("stream->imagick",stream2imagick,
+	  KNO_MAX_ARGS(2)|KNO_MIN_ARGS(1),
+	  "Decodes an image from the Kno input *stream* as its bytes "
+	  "arrive, rather than after reading the whole file. *opts* may "
+	  "give the `format` if it cannot be recognized from the first "
+	  "bytes, or specify `ping` to return the table produced by "
+	  "`imagick/probe` after reading just the image header. "
+	  "It also accepts the `autoorient`, `strip` and `frames` "
+	  "options of `file->imagick`.",
+	  {"stream",kno_stream_type,KNO_VOID},
+	  {"opts",kno_any_type,KNO_VOID})
+static lispval stream2imagick(lispval stream_arg,lispval opts)
+{
+  long long started = metrics_start();
+  kno_stream stream = (kno_stream) stream_arg;
+  lispval fmt = kno_getopt(opts,format,KNO_VOID);
+  int ping = kno_testopt(opts,ping_symbol,KNO_VOID);
+  const char *fmtname = NULL;
+  char fmtbuf[200], selector[128];
+  int selected = frame_selector(opts,selector,sizeof(selector),
+				"stream2imagick");
+  if (selected < 0) {
+    kno_decref(fmt);
+    return IMAGICK_DONE(IM_STREAM_READ,KNO_ERROR_VALUE,0,0,0);}
+  kno_lock_stream(stream);
+  if (KNO_STRINGP(fmt))
+    fmtname = KNO_CSTRING(fmt);
+  else if (KNO_SYMBOLP(fmt))
+    fmtname = KNO_SYMBOL_NAME(fmt);
+  else {
+    /* Peek at the first bytes without consuming them */
+    struct KNO_INBUF *in = kno_readbuf(stream);
+    kno_request_bytes(in,12);
+    fmtname = sniff_format(in->bufread,in->buflim-in->bufread);}
+  struct STREAM_COOKIE cookie = { stream, 0 };
+  FILE *f = stream_fopen(&cookie,0);
+  if (f == NULL) {
+    kno_unlock_stream(stream);
+    kno_decref(fmt);
+    u8_graberrno("stream2imagick",NULL);
+    return IMAGICK_DONE(IM_STREAM_READ,KNO_ERROR_VALUE,0,0,0);}
+  struct KNO_IMAGICK *imagickref = imagick_alloc();
+  MagickWand *wand = imagickref->wand;
+  if ( (fmtname) || (selected) ) {
+    snprintf(fmtbuf,sizeof(fmtbuf),"%s%s%s%s%s",
+	     (fmtname) ? (fmtname) : (""),(fmtname) ? (":") : (""),
+	     (selected) ? ("[") : (""),(selected) ? (selector) : (""),
+	     (selected) ? ("]") : (""));
+    MagickSetFilename(wand,fmtbuf);}
+  MagickBooleanType retval = (ping) ? (MagickPingImageFile(wand,f)) :
+    (MagickReadImageFile(wand,f));
+  fclose(f);
+  kno_unlock_stream(stream);
+  kno_decref(fmt);
+  if (retval == MagickFalse) {
+    grabmagickerr("stream2imagick",wand);
+    imagick_release(imagickref);
+    return IMAGICK_DONE(IM_STREAM_READ,KNO_ERROR_VALUE,0,0,0);}
+  U8_CLEAR_ERRNO();
+  if (ping) {
+    lispval result = probe_table(wand);
+    imagick_release(imagickref);
+    return IMAGICK_DONE(IM_STREAM_READ,result,0,0,0);}
+  if (imagick_decode_opts(wand,opts,"stream2imagick") < 0) {
+    imagick_release(imagickref);
+    return IMAGICK_DONE(IM_STREAM_READ,KNO_ERROR_VALUE,0,0,0);}
+  imagick_account(imagickref);
+  if (imagick_check_limit("stream2imagick") < 0) {
+    imagick_release(imagickref);
+    return IMAGICK_DONE(IM_STREAM_READ,KNO_ERROR_VALUE,0,0,0);}
+  else return IMAGICK_DONE(IM_STREAM_READ,(lispval)imagickref,
+			     0,0,wand_pixels(wand));
+}
+DEFC_PRIM("imagick->stream",imagick2stream,
+	  KNO_MAX_ARGS(3)|KNO_MIN_ARGS(2),
+	  "Encodes *imagickref* (in *format*, if provided, without "
+	  "changing the format of *imagickref*) directly to the Kno output *stream*, writing the "
+	  "encoded bytes through the stream's buffer as they are "
+	  "produced rather than building the whole encoding in memory, "
+	  "and flushing the stream at the end. Returns the number of "
+	  "bytes written.",
+	  {"imagickref",KNO_IMAGICK_TYPE,KNO_VOID},
+	  {"stream",kno_stream_type,KNO_VOID},
+	  {"format",kno_string_type,KNO_VOID})
+static lispval imagick2stream(lispval imagickref,lispval stream_arg,
+			      lispval format_arg)
+{
+  long long started = metrics_start();
+  struct KNO_IMAGICK *wrapper=
+    kno_consptr(struct KNO_IMAGICK *,imagickref,kno_imagick_type);
+  kno_stream stream = (kno_stream) stream_arg;
+  MagickWand *wand = wrapper->wand, *encoder = NULL;
+  long long n_pixels = wand_pixels(wand);
+  /* As with imagick->file, the format goes on a clone, so that it
+     doesn't stick to the caller's image */
+  if (KNO_STRINGP(format_arg)) {
+    wand = encoder = CloneMagickWand(wand);
+    if (MagickSetImageFormat(wand,KNO_CSTRING(format_arg)) == MagickFalse) {
+      grabmagickerr("imagick2stream",wand);
+      DestroyMagickWand(encoder);
+      return IMAGICK_DONE(IM_STREAM_WRITE,KNO_ERROR_VALUE,0,0,0);}}
+  kno_lock_stream(stream);
+  struct STREAM_COOKIE cookie = { stream, 0 };
+  FILE *f = stream_fopen(&cookie,1);
+  if (f == NULL) {
+    kno_unlock_stream(stream);
+    u8_graberrno("imagick2stream",NULL);
+    if (encoder) DestroyMagickWand(encoder);
+    return IMAGICK_DONE(IM_STREAM_WRITE,KNO_ERROR_VALUE,0,0,0);}
+  setvbuf(f,NULL,_IOFBF,65536);
+  MagickResetIterator(wand);
+  MagickBooleanType retval = MagickWriteImageFile(wand,f);
+  int closed = fclose(f);
+  kno_unlock_stream(stream);
+  if (retval == MagickFalse) grabmagickerr("imagick2stream",wand);
+  if (encoder) DestroyMagickWand(encoder);
+  if (retval == MagickFalse)
+    return IMAGICK_DONE(IM_STREAM_WRITE,KNO_ERROR_VALUE,0,0,0);
+  else if ( (closed) || (kno_flush_stream(stream) < 0) ) {
+    u8_graberrno("imagick2stream",NULL);
+    return IMAGICK_DONE(IM_STREAM_WRITE,KNO_ERROR_VALUE,0,0,0);}
+  U8_CLEAR_ERRNO();
+  return IMAGICK_DONE(IM_STREAM_WRITE,KNO_INT(cookie.n_bytes),
+		      0,cookie.n_bytes,n_pixels);
+}
+/* Encoding options */
+
+static lispval quality_symbol, options_symbol, progressive_symbol;
+static lispval sampling_symbol;
+
+static CompressionType string2ctype(u8_string name)
+{
+  struct CTYPEMAP *scan = compression_types;
+  while (scan->ct!=UndefinedCompression)
+    if (strcasecmp(name,scan->cname) == 0) return scan->ct;
+    else scan++;
+  return UndefinedCompression;
+}
+
+/* Converts an option value into the string MagickSetOption expects,
+   using buf for numbers. Returns NULL if val isn't a valid value. */
+static u8_string option_string(lispval val,char *buf,size_t len)
+{
+  if (KNO_STRINGP(val)) return KNO_CSTRING(val);
+  else if (KNO_SYMBOLP(val)) return KNO_SYMBOL_NAME(val);
+  else if (KNO_FIXNUMP(val)) {
+    snprintf(buf,len,"%lld",(long long)KNO_FIX2INT(val));
+    return buf;}
+  else if (KNO_FLONUMP(val)) {
+    snprintf(buf,len,"%g",KNO_FLONUM(val));
+    return buf;}
+  else if (KNO_TRUEP(val)) return "true";
+  else if (KNO_FALSEP(val)) return "false";
+  else return NULL;
+}
+
+/* JPEG chroma subsampling, as the usual J:a:b names */
+static u8_string sampling_factor(u8_string name)
+{
+  if (strcmp(name,"4:4:4") == 0) return "1x1";
+  else if (strcmp(name,"4:2:2") == 0) return "2x1";
+  else if (strcmp(name,"4:2:0") == 0) return "2x2";
+  else if (strcmp(name,"4:1:1") == 0) return "4x1";
+  else return name;
+}
+
+/* Encoder settings parsed from opts:
+    quality      compression quality (1-100; for PNG, the tens digit is
+                 the zlib level and the ones digit the filter)
+    compression  one of the names in compression_types
+    progressive  progressive/interlaced output (for JPEG, PNG and GIF)
+    sampling     JPEG chroma subsampling, e.g. "4:2:0" or "2x2"
+    options      a table of format-specific settings passed to
+                 MagickSetOption, e.g. webp:method or png:compression-level
+   Once parsed, they can be applied to wands from task threads. */
+struct ENCODE_SETTINGS {
+  int quality;
+  CompressionType ct;
+  int progressive;
+  u8_string sampling;
+  int n_options;
+  u8_string *options;}; /* alternating keys and values */
+
+static void free_encode_settings(struct ENCODE_SETTINGS *settings)
+{
+  int i = 0; while (i < settings->n_options*2)
+    u8_free(settings->options[i++]);
+  if (settings->options) u8_free(settings->options);
+  if (settings->sampling) u8_free(settings->sampling);
+  memset(settings,0,sizeof(struct ENCODE_SETTINGS));
+  settings->quality = -1;
+}
+
+/* Parses the encoder settings in opts, returning -1 (signalling an
+   error) if any are invalid */
+static int parse_encode_opts(lispval opts,struct ENCODE_SETTINGS *settings,
+			     u8_context cxt)
+{
+  memset(settings,0,sizeof(struct ENCODE_SETTINGS));
+  settings->quality = -1;
+  settings->ct = UndefinedCompression;
+  if ( (KNO_VOIDP(opts)) || (KNO_FALSEP(opts)) || (KNO_DEFAULTP(opts)) )
+    return 0;
+  lispval quality = kno_getopt(opts,quality_symbol,KNO_VOID);
+  lispval compression = kno_getopt(opts,compression_symbol,KNO_VOID);
+  lispval sampling = kno_getopt(opts,sampling_symbol,KNO_VOID);
+  lispval options = kno_getopt(opts,options_symbol,KNO_VOID);
+  int rv = 0;
+  settings->progressive = kno_testopt(opts,progressive_symbol,KNO_VOID);
+  if (KNO_VOIDP(quality)) {}
+  else if ( (KNO_UINTP(quality)) && (KNO_FIX2INT(quality) >= 1) &&
+	    (KNO_FIX2INT(quality) <= 100) )
+    settings->quality = KNO_FIX2INT(quality);
+  else {
+    kno_type_error("quality (1-100)",cxt,quality);
+    rv = -1; goto cleanup;}
+  if (KNO_VOIDP(compression)) {}
+  else if ( (KNO_STRINGP(compression)) || (KNO_SYMBOLP(compression)) ) {
+    settings->ct = string2ctype
+      ((KNO_STRINGP(compression)) ? (KNO_CSTRING(compression)) :
+       (KNO_SYMBOL_NAME(compression)));
+    if (settings->ct == UndefinedCompression) {
+      kno_type_error("compression type",cxt,compression);
+      rv = -1; goto cleanup;}}
+  else {
+    kno_type_error("compression type",cxt,compression);
+    rv = -1; goto cleanup;}
+  if (KNO_STRINGP(sampling))
+    settings->sampling = u8_strdup(sampling_factor(KNO_CSTRING(sampling)));
+  else if (!(KNO_VOIDP(sampling))) {
+    kno_type_error("sampling factor",cxt,sampling);
+    rv = -1; goto cleanup;}
+  if (KNO_TABLEP(options)) {
+    lispval keys = kno_getkeys(options);
+    int n = KNO_CHOICE_SIZE(keys);
+    settings->options = u8_alloc_n((n) ? (n*2) : (1),u8_string);
+    KNO_DO_CHOICES(key,keys) {
+      char keybuf[64], valbuf[64];
+      lispval val = kno_get(options,key,KNO_VOID);
+      u8_string keystring = option_string(key,keybuf,sizeof(keybuf));
+      u8_string valstring = option_string(val,valbuf,sizeof(valbuf));
+      if ( (keystring == NULL) || (valstring == NULL) ) {
+	kno_seterr("BadEncoderOption",cxt,keystring,val);
+	kno_decref(val);
+	KNO_STOP_DO_CHOICES;
+	rv = -1;
+	break;}
+      settings->options[settings->n_options*2] = u8_strdup(keystring);
+      settings->options[settings->n_options*2+1] = u8_strdup(valstring);
+      settings->n_options++;
+      kno_decref(val);}
+    KNO_END_DO_CHOICES;
+    kno_decref(keys);}
+  else if (!(KNO_VOIDP(options))) {
+    kno_type_error("options table",cxt,options);
+    rv = -1;}
+ cleanup:
+  kno_decref(quality); kno_decref(compression);
+  kno_decref(sampling); kno_decref(options);
+  if (rv < 0) free_encode_settings(settings);
+  return rv;
+}
+
+/* Applies settings to wand. They persist on the wand and so apply to
+   later encodings. */
+static void apply_encode_settings(MagickWand *wand,
+				  struct ENCODE_SETTINGS *settings)
+{
+  if (settings->quality >= 0)
+    MagickSetCompressionQuality(wand,settings->quality);
+  if (settings->ct != UndefinedCompression)
+    MagickSetCompression(wand,settings->ct);
+  if (settings->progressive)
+    MagickSetInterlaceScheme(wand,PlaneInterlace);
+  if (settings->sampling)
+    MagickSetOption(wand,"jpeg:sampling-factor",settings->sampling);
+  if ( (settings->quality >= 0) || (settings->ct != UndefinedCompression) ||
+       (settings->progressive) ) {
+    /* Some coders look at the image rather than the wand settings */
+    MagickResetIterator(wand);
+    while (MagickNextImage(wand) != MagickFalse) {
+      if (settings->quality >= 0)
+	MagickSetImageCompressionQuality(wand,settings->quality);
+      if (settings->ct != UndefinedCompression)
+	MagickSetImageCompression(wand,settings->ct);
+      if (settings->progressive)
+	MagickSetImageInterlaceScheme(wand,PlaneInterlace);}
+    MagickResetIterator(wand);}
+  int i = 0; while (i < settings->n_options) {
+    MagickSetOption(wand,settings->options[i*2],settings->options[i*2+1]);
+    i++;}
+}
+
+/* Applies the encoder settings in opts to wand */
+static int imagick_encode_opts(MagickWand *wand,lispval opts,u8_context cxt)
+{
+  struct ENCODE_SETTINGS settings;
+  if (parse_encode_opts(opts,&settings,cxt) < 0) return -1;
+  apply_encode_settings(wand,&settings);
+  free_encode_settings(&settings);
+  return 0;
+}
+
+DEFC_PRIM("imagick->file",imagick2file,
+	  KNO_MAX_ARGS(3)|KNO_MIN_ARGS(1),
+	  "Writes *imagickref* to *filename*, in the format implied by "
+	  "its suffix. *opts* may specify the encoder settings `quality`, "
+	  "`compression`, `progressive`, `sampling` and `options` "
+	  "(a table of ImageMagick format options), which only apply "
+	  "to this write. *imagickref* may also be an imagick-lazy "
+	  "object, which is realized first.",
+	  {"imagickref",kno_any_type,KNO_VOID},
+	  {"filename",kno_string_type,KNO_VOID},
+	  {"opts",kno_any_type,KNO_VOID})
+
+lispval imagick2file(lispval imagickref,lispval filename,lispval opts)
+{
+  long long started = metrics_start();
+  if (KNO_TYPEP(imagickref,kno_imagick_lazy_type)) {
+    lispval realized = lazy_realize(imagickref,"imagick2file");
+    if (KNO_ABORTP(realized)) return realized;
+    lispval result = imagick2file(realized,filename,opts);
+    kno_decref(realized);
+    if (KNO_ABORTP(result)) return result;
+    kno_decref(result);
+    return kno_incref(imagickref);}
+  else if (!(KNO_TYPEP(imagickref,kno_imagick_type))) {
+    kno_type_error("imagick","imagick2file",imagickref);
+    return IMAGICK_DONE(IM_FILE_WRITE,KNO_ERROR_VALUE,0,0,0);}
+  MagickBooleanType retval;
+  struct KNO_IMAGICK *wrapper=
+    kno_consptr(struct KNO_IMAGICK *,imagickref,kno_imagick_type);
+  MagickWand *wand = wrapper->wand, *encoder = NULL;
+  long long n_pixels = wand_pixels(wand);
+  /* Encoder settings go on a (copy-on-write) clone, so that they
+     don't stick to the caller's image */
+  if (!(KNO_VOIDP(opts))) {
+    wand = encoder = CloneMagickWand(wand);
+    if (imagick_encode_opts(wand,opts,"imagick2file") < 0) {
+      DestroyMagickWand(encoder);
+      return IMAGICK_DONE(IM_FILE_WRITE,KNO_ERROR_VALUE,0,0,0);}}
+  retval = MagickWriteImage(wand,KNO_CSTRING(filename));
+  if (retval == MagickFalse) grabmagickerr("imagick2file",wand);
+  if (encoder) DestroyMagickWand(encoder);
+  if (retval == MagickFalse)
+    return IMAGICK_DONE(IM_FILE_WRITE,KNO_ERROR_VALUE,0,0,0);
+  else {
+    U8_CLEAR_ERRNO();
+    return IMAGICK_DONE(IM_FILE_WRITE,kno_incref(imagickref),
+			0,0,n_pixels);}
+}
+DEFC_PRIM("imagick->packet",imagick2packet,
+	  KNO_MAX_ARGS(2)|KNO_MIN_ARGS(1),
+	  "Encodes *imagickref* in its current format, returning a "
+	  "packet. *opts* takes the encoder settings of `imagick->file`. "
+	  "*imagickref* may also be an imagick-lazy object, which is "
+	  "realized first.",
+	  {"imagickref",kno_any_type,KNO_VOID},
+	  {"opts",kno_any_type,KNO_VOID})
+
+lispval imagick2packet(lispval imagickref,lispval opts)
+{
+  long long started = metrics_start();
+  if (KNO_TYPEP(imagickref,kno_imagick_lazy_type)) {
+    lispval realized = lazy_realize(imagickref,"imagick2packet");
+    if (KNO_ABORTP(realized)) return realized;
+    lispval packet = imagick2packet(realized,opts);
+    kno_decref(realized);
+    return packet;}
+  else if (!(KNO_TYPEP(imagickref,kno_imagick_type))) {
+    kno_type_error("imagick","imagick2packet",imagickref);
+    return IMAGICK_DONE(IM_PACKET_WRITE,KNO_ERROR_VALUE,0,0,0);}
+  unsigned char *data = NULL; size_t n_bytes;
+  struct KNO_IMAGICK *wrapper=
+    kno_consptr(struct KNO_IMAGICK *,imagickref,kno_imagick_type);
+  MagickWand *wand = wrapper->wand, *encoder = NULL;
+  long long n_pixels = wand_pixels(wand);
+  if (!(KNO_VOIDP(opts))) {
+    wand = encoder = CloneMagickWand(wand);
+    if (imagick_encode_opts(wand,opts,"imagick2packet") < 0) {
+      DestroyMagickWand(encoder);
+      return IMAGICK_DONE(IM_PACKET_WRITE,KNO_ERROR_VALUE,0,0,0);}}
+  MagickResetIterator(wand);
+  data = MagickGetImageBlob(wand,&n_bytes);
+  if (data == NULL) grabmagickerr("imagick2packet",wand);
+  if (encoder) DestroyMagickWand(encoder);
+  if (data == NULL)
+    return IMAGICK_DONE(IM_PACKET_WRITE,KNO_ERROR_VALUE,0,0,0);
+  else {
+    lispval packet = kno_make_packet(NULL,n_bytes,data);
+    MagickRelinquishMemory(data);
+    U8_CLEAR_ERRNO();
+    return IMAGICK_DONE(IM_PACKET_WRITE,packet,0,n_bytes,n_pixels);}
+}
+DEFC_PRIM("imagick/clone",imagick2imagick,
+	  KNO_MAX_ARGS(1)|KNO_MIN_ARGS(1),
+	  "Returns a copy of *imagickref*. The copy shares the pixels "
+	  "of the original (within ImageMagick) until either is "
+	  "modified, and isn't counted against IMAGICK:MAXPIXELMB "
+	  "until it is first modified itself.",
+	  {"imagickref",KNO_IMAGICK_TYPE,KNO_VOID})
+
+lispval imagick2imagick(lispval imagickref)
+{
+  long long started = metrics_start();
+  struct KNO_IMAGICK *wrapper=
+    kno_consptr(struct KNO_IMAGICK *,imagickref,kno_imagick_type);
+  MagickWand *wand = CloneMagickWand(wrapper->wand);
+  if (wand == NULL) {
+    grabmagickerr("imagick2imagick",wrapper->wand);
+    return IMAGICK_DONE(IM_CLONE,KNO_ERROR_VALUE,0,0,0);}
+  struct KNO_IMAGICK *clone = u8_alloc(struct KNO_IMAGICK);
+  KNO_INIT_FRESH_CONS(clone,kno_imagick_type);
+  clone->wand = wand;
+  clone->footprint = 0;
+  clone->shared = 1;
+  U8_CLEAR_ERRNO();
+  return IMAGICK_DONE(IM_CLONE,(lispval)clone,0,0,wand_pixels(wand));
+}
+
+DEFC_PRIM("imagick/footprint",imagick_footprint,
+	  KNO_MAX_ARGS(1)|KNO_MIN_ARGS(0),
+	  "Returns the number of bytes of pixel memory held by "
+	  "*imagickref* or, if omitted, by all live imagick objects. "
+	  "Clones count for nothing until they are first modified, "
+	  "while ImageMagick still shares their pixels with the "
+	  "original.",
+	  {"imagickref",kno_any_type,KNO_VOID})
+static lispval imagick_footprint(lispval imagickref)
+{
+  if (KNO_VOIDP(imagickref))
+    return KNO_INT(__atomic_load_n(&imagick_pixel_bytes,__ATOMIC_RELAXED));
+  else if (!(KNO_TYPEP(imagickref,kno_imagick_type)))
+    return kno_type_error("imagick","imagick_footprint",imagickref);
+  struct KNO_IMAGICK *wrapper=
+    kno_consptr(struct KNO_IMAGICK *,imagickref,kno_imagick_type);
+  return KNO_INT(wrapper->footprint);
+}
+
+DEFC_PRIM("imagick/release!",imagick_release_prim,
+	  KNO_MAX_ARGS(1)|KNO_MIN_ARGS(1),
+	  "Discards the images of *imagickref* immediately, rather than "
+	  "when it is garbage collected, leaving it empty. Returns the "
+	  "number of bytes of pixel memory released.",
+	  {"imagickref",KNO_IMAGICK_TYPE,KNO_VOID})
+static lispval imagick_release_prim(lispval imagickref)
+{
+  struct KNO_IMAGICK *wrapper=
+    kno_consptr(struct KNO_IMAGICK *,imagickref,kno_imagick_type);
+  size_t released = wrapper->footprint;
+  imagick_disown(wrapper);
+  ClearMagickWand(wrapper->wand);
+  return KNO_INT(released);
+}
+
+/* Raw pixel access */
+
+static lispval char_symbol, short_symbol, float_symbol, double_symbol;
+static lispval luma_symbol, ycbcr_symbol;
+static lispval gray_symbol;
+
+/* Converts a channel map argument (a string like "RGBA" or a symbol
+   like rgb or gray) into the map string used by ImageMagick, writing
+   it into buf. Returns the number of channels or -1 on error. */
+static int get_pixel_map(lispval arg,char *buf,int buflen,u8_context cxt)
+{
+  const char *name;
+  if ( (KNO_VOIDP(arg)) || (KNO_DEFAULTP(arg)) ) name = "RGB";
+  else if (arg == gray_symbol) name = "I";
+  else if (KNO_SYMBOLP(arg)) name = KNO_SYMBOL_NAME(arg);
+  else if (KNO_STRINGP(arg)) name = KNO_CSTRING(arg);
+  else {
+    kno_type_error("pixel map",cxt,arg);
+    return -1;}
+  int i = 0; while ( (name[i]) && (i < buflen-1) ) {
+    int c = toupper(name[i]);
+    if (strchr("RGBAOCMYKIP",c) == NULL) {
+      kno_type_error("pixel map",cxt,arg);
+      return -1;}
+    buf[i++] = c;}
+  buf[i] = '\0';
+  if ( (i == 0) || (name[i]) ) {
+    kno_type_error("pixel map",cxt,arg);
+    return -1;}
+  return i;
+}
+
+static StorageType get_storage_type(lispval arg,u8_context cxt)
+{
+  if ( (KNO_VOIDP(arg)) || (KNO_DEFAULTP(arg)) || (arg == char_symbol) )
+    return CharPixel;
+  else if (arg == short_symbol) return ShortPixel;
+  else if (arg == float_symbol) return FloatPixel;
+  else if (arg == double_symbol) return DoublePixel;
+  else {
+    kno_type_error("pixel storage type",cxt,arg);
+    return UndefinedPixel;}
+}
+
+/* Fast sRGB conversions for pixel export
+
+   The luma and ycbcr maps export RGB (which ImageMagick does with a
+   specialized loop) and convert it here, using the BT.601 full range
+   (JFIF) coefficients in fixed point for the integer types. The
+   loops are simple enough for the compiler to vectorize, except for
+   8-bit luma, which uses the rgbx8_luma kernel of imagetools_simd.h. */
+
+#define Y_R 19595
+#define Y_G 38470
+#define Y_B 7471
+#define CB_R -11059
+#define CB_G -21709
+#define CB_B 32768
+#define CR_R 32768
+#define CR_G -27439
+#define CR_B -5329
+
+static void rgb8_convert(const unsigned char *restrict rgb,
+			 unsigned char *restrict out,size_t n,int ycbcr)
+{
+  size_t i;
+  if (ycbcr) {
+    for (i = 0; i < n; i++) {
+      int r = rgb[i*3], g = rgb[i*3+1], b = rgb[i*3+2];
+      out[i*3] = (Y_R*r+Y_G*g+Y_B*b+32768)>>16;
+      out[i*3+1] = (CB_R*r+CB_G*g+CB_B*b+(128<<16)+32767)>>16;
+      out[i*3+2] = (CR_R*r+CR_G*g+CR_B*b+(128<<16)+32767)>>16;}}
+  else for (i = 0; i < n; i++) {
+      int r = rgb[i*3], g = rgb[i*3+1], b = rgb[i*3+2];
+      out[i] = (Y_R*r+Y_G*g+Y_B*b+32768)>>16;}
+}
+
+static void rgb16_convert(const unsigned short *restrict rgb,
+			  unsigned short *restrict out,size_t n,int ycbcr)
+{
+  size_t i;
+  if (ycbcr) {
+    for (i = 0; i < n; i++) {
+      long long r = rgb[i*3], g = rgb[i*3+1], b = rgb[i*3+2];
+      out[i*3] = (Y_R*r+Y_G*g+Y_B*b+32768)>>16;
+      out[i*3+1] = (CB_R*r+CB_G*g+CB_B*b+(32768LL<<16)+32767)>>16;
+      out[i*3+2] = (CR_R*r+CR_G*g+CR_B*b+(32768LL<<16)+32767)>>16;}}
+  else for (i = 0; i < n; i++) {
+      long long r = rgb[i*3], g = rgb[i*3+1], b = rgb[i*3+2];
+      out[i] = (Y_R*r+Y_G*g+Y_B*b+32768)>>16;}
+}
+
+#define RGBFLOAT_CONVERT(name,type)					\
+  static void name(const type *restrict rgb,type *restrict out,		\
+		   size_t n,int ycbcr)					\
+  {									\
+    size_t i;								\
+    if (ycbcr) {							\
+      for (i = 0; i < n; i++) {						\
+	type r = rgb[i*3], g = rgb[i*3+1], b = rgb[i*3+2];		\
+	out[i*3] = 0.299*r+0.587*g+0.114*b;				\
+	out[i*3+1] = -0.168736*r-0.331264*g+0.5*b+0.5;			\
+	out[i*3+2] = 0.5*r-0.418688*g-0.081312*b+0.5;}}		\
+    else for (i = 0; i < n; i++)					\
+	   out[i] = 0.299*rgb[i*3]+0.587*rgb[i*3+1]+0.114*rgb[i*3+2];	\
+  }
+
+RGBFLOAT_CONVERT(rgbfloat_convert,float)
+RGBFLOAT_CONVERT(rgbdouble_convert,double)
+
+/* Exports the pixels of the current image of wand into out (which
+   has room for w*h*(ycbcr?3:1) elements of storage), converting from
+   sRGB in bands of rows to bound the temporary buffer. */
+static int export_converted(MagickWand *wand,size_t w,size_t h,
+			    StorageType storage,size_t elt_size,
+			    int ycbcr,unsigned char *out,u8_context cxt)
+{
+  if ( (w == 0) || (h == 0) ) return 0;
+  MagickWand *source = wand;
+  ColorspaceType cs = MagickGetImageColorspace(wand);
+  /* Linear RGB needs the sRGB transfer curve applied like any other
+     colorspace */
+  if (!( (cs == sRGBColorspace) || (cs == GRAYColorspace) )) {
+    source = MagickGetImage(wand);
+    if ( (source == NULL) ||
+	 (MagickTransformImageColorspace(source,sRGBColorspace) ==
+	  MagickFalse) ) {
+      grabmagickerr(cxt,(source) ? (source) : (wand));
+      if (source) DestroyMagickWand(source);
+      return -1;}}
+  size_t out_channels = (ycbcr) ? (3) : (1);
+  /* 8-bit luma is exported padded to 32 bits for the SIMD kernels */
+  int padded = ( (storage == CharPixel) && (!(ycbcr)) );
+  size_t in_channels = (padded) ? (4) : (3);
+  size_t band = (1024*1024)/(w*in_channels*elt_size);
+  if (band < 1) band = 1;
+  unsigned char *rgb =
+    u8_malloc(w*in_channels*elt_size*((band < h) ? (band) : (h)));
+  size_t y = 0;
+  int rv = 0;
+  while (y < h) {
+    size_t rows = ((y+band) > h) ? (h-y) : (band);
+    size_t n = w*rows;
+    unsigned char *dest = out+(y*w*out_channels*elt_size);
+    if (MagickExportImagePixels(source,0,y,w,rows,(padded)?("RGBP"):("RGB"),
+				storage,rgb) == MagickFalse) {
+      grabmagickerr(cxt,source);
+      rv = -1;
+      break;}
+    switch (storage) {
+    case CharPixel:
+      if (padded) rgbx8_luma(rgb,dest,n);
+      else rgb8_convert(rgb,dest,n,ycbcr);
+      break;
+    case ShortPixel:
+      rgb16_convert((unsigned short *)rgb,(unsigned short *)dest,n,ycbcr);
+      break;
+    case FloatPixel:
+      rgbfloat_convert((float *)rgb,(float *)dest,n,ycbcr); break;
+    default:
+      rgbdouble_convert((double *)rgb,(double *)dest,n,ycbcr);}
+    y += rows;}
+  u8_free(rgb);
+  if (source != wand) DestroyMagickWand(source);
+  return rv;
+}
+
+DEFC_PRIM("imagick->pixels",imagick2pixels,
+	  KNO_MAX_ARGS(3)|KNO_MIN_ARGS(1),
+	  "Returns the pixels of the current image of *imagickref* as "
+	  "a packed vector in row order with the channels given by "
+	  "*map* (e.g. \"RGB\", \"RGBA\" or `gray`, default RGB). "
+	  "The maps `luma` and `ycbcr` use a fast conversion from sRGB "
+	  "with BT.601 (JPEG) coefficients. "
+	  "*type* is one of `char` (a packet, the default), `short` "
+	  "(an int vector of 16-bit values from 0 to 65535), `float` "
+	  "or `double` (numeric vectors); float and double values "
+	  "range from 0 to 1.",
+	  {"imagickref",KNO_IMAGICK_TYPE,KNO_VOID},
+	  {"map",kno_any_type,KNO_VOID},
+	  {"type",kno_symbol_type,KNO_VOID})
+static lispval imagick2pixels(lispval imagickref,lispval map,lispval type)
+{
+  long long started = metrics_start();
+  struct KNO_IMAGICK *wrapper=
+    kno_consptr(struct KNO_IMAGICK *,imagickref,kno_imagick_type);
+  MagickWand *wand = wrapper->wand;
+  char mapbuf[16];
+  int converted = ( (map == luma_symbol) || (map == ycbcr_symbol) );
+  int n_channels = (map == luma_symbol) ? (1) :
+    (map == ycbcr_symbol) ? (3) :
+    (get_pixel_map(map,mapbuf,sizeof(mapbuf),"imagick2pixels"));
+  if (n_channels < 0)
+    return IMAGICK_DONE(IM_PIXELS_WRITE,KNO_ERROR_VALUE,0,0,0);
+  StorageType storage = get_storage_type(type,"imagick2pixels");
+  if (storage == UndefinedPixel)
+    return IMAGICK_DONE(IM_PIXELS_WRITE,KNO_ERROR_VALUE,0,0,0);
+  size_t w = MagickGetImageWidth(wand), h = MagickGetImageHeight(wand);
+  size_t n_values, n_bytes;
+  size_t elt_size = (storage == CharPixel) ? (1) :
+    (storage == ShortPixel) ? (sizeof(short)) :
+    (storage == FloatPixel) ? (sizeof(float)) :
+    (sizeof(double));
+  if ( (__builtin_mul_overflow(w,h,&n_values)) ||
+       (__builtin_mul_overflow(n_values,n_channels,&n_values)) ||
+       (n_values > INT_MAX) ||
+       (__builtin_mul_overflow(n_values,elt_size,&n_bytes)) ) {
+    u8_seterr(kno_MallocFailed,"imagick2pixels",
+	      u8_mkstring("%lldx%lld pixels",(long long)w,(long long)h));
+    return IMAGICK_DONE(IM_PIXELS_WRITE,KNO_ERROR_VALUE,0,0,0);}
+  unsigned char *buf = u8_malloc(n_bytes);
+  if (buf == NULL) {
+    u8_seterr(kno_MallocFailed,"imagick2pixels",NULL);
+    return IMAGICK_DONE(IM_PIXELS_WRITE,KNO_ERROR_VALUE,0,0,0);}
+  if (converted) {
+    if (export_converted(wand,w,h,storage,elt_size,(map == ycbcr_symbol),
+			 buf,"imagick2pixels") < 0) {
+      u8_free(buf);
+      return IMAGICK_DONE(IM_PIXELS_WRITE,KNO_ERROR_VALUE,0,0,0);}}
+  else if (MagickExportImagePixels(wand,0,0,w,h,mapbuf,storage,buf) ==
+	   MagickFalse) {
+    u8_free(buf);
+    grabmagickerr("imagick2pixels",wand);
+    return IMAGICK_DONE(IM_PIXELS_WRITE,KNO_ERROR_VALUE,0,0,0);}
+  lispval result;
+  switch (storage) {
+  case CharPixel:
+    /* The packet takes ownership of buf */
+    result = kno_init_packet(NULL,n_values,buf);
+    buf = NULL;
+    break;
+  case ShortPixel: {
+    /* The values are unsigned, so they don't fit in a short vector */
+    const unsigned short *shorts = (const unsigned short *)buf;
+    kno_int *ints = u8_alloc_n(n_values,kno_int);
+    size_t i = 0; while (i < n_values) {
+      ints[i] = shorts[i]; i++;}
+    result = kno_make_int_vector(n_values,ints);
+    u8_free(ints);
+    break;}
+  case FloatPixel:
+    result = kno_make_float_vector(n_values,(kno_float *)buf); break;
+  default:
+    result = kno_make_double_vector(n_values,(kno_double *)buf);}
+  if (buf) u8_free(buf);
+  U8_CLEAR_ERRNO();
+  return IMAGICK_DONE(IM_PIXELS_WRITE,result,0,0,w*h);
+}
+
+DEFC_PRIM("pixels->imagick",pixels2imagick,
+	  KNO_MAX_ARGS(4)|KNO_MIN_ARGS(3),
+	  "Creates a new imagick object of size *width* x *height* "
+	  "from *pixels*, which is either a packet of byte values or "
+	  "a numeric vector laid out as by `imagick->pixels` with the "
+	  "channels given by *map*. Int vectors hold 16-bit values "
+	  "from 0 to 65535 (short vectors are read as unsigned).",
+	  {"pixels",kno_any_type,KNO_VOID},
+	  {"width",kno_fixnum_type,KNO_VOID},
+	  {"height",kno_fixnum_type,KNO_VOID},
+	  {"map",kno_any_type,KNO_VOID})
+static lispval pixels2imagick(lispval pixels,lispval width,lispval height,
+			      lispval map)
+{
+  long long started = metrics_start();
+  char mapbuf[16];
+  int n_channels = get_pixel_map(map,mapbuf,sizeof(mapbuf),"pixels2imagick");
+  if (n_channels < 0)
+    return IMAGICK_DONE(IM_PIXELS_READ,KNO_ERROR_VALUE,0,0,0);
+  if (!( (KNO_UINTP(width)) && (KNO_FIX2INT(width) > 0) )) {
+    kno_type_error("positive fixnum","pixels2imagick",width);
+    return IMAGICK_DONE(IM_PIXELS_READ,KNO_ERROR_VALUE,0,0,0);}
+  else if (!( (KNO_UINTP(height)) && (KNO_FIX2INT(height) > 0) )) {
+    kno_type_error("positive fixnum","pixels2imagick",height);
+    return IMAGICK_DONE(IM_PIXELS_READ,KNO_ERROR_VALUE,0,0,0);}
+  size_t w = KNO_FIX2INT(width), h = KNO_FIX2INT(height);
+  size_t n_values, n_elts;
+  StorageType storage;
+  const void *data;
+  unsigned short *shorts = NULL;
+  if ( (__builtin_mul_overflow(w,h,&n_values)) ||
+       (__builtin_mul_overflow(n_values,n_channels,&n_values)) ) {
+    kno_err("PixelCountMismatch","pixels2imagick",mapbuf,pixels);
+    return IMAGICK_DONE(IM_PIXELS_READ,KNO_ERROR_VALUE,0,0,0);}
+  if (KNO_PACKETP(pixels)) {
+    storage = CharPixel;
+    n_elts = KNO_PACKET_LENGTH(pixels);
+    data = KNO_PACKET_DATA(pixels);}
+  else if (KNO_TYPEP(pixels,kno_numeric_vector_type)) {
+    n_elts = KNO_NUMVEC_LENGTH(pixels);
+    switch (KNO_NUMVEC_TYPE(pixels)) {
+    case kno_short_elt:
+      storage = ShortPixel; data = KNO_NUMVEC_SHORTS(pixels); break;
+    case kno_int_elt: {
+      if (n_elts != n_values) break;
+      const kno_int *ints = KNO_NUMVEC_INTS(pixels);
+      shorts = u8_alloc_n((n_elts) ? (n_elts) : (1),unsigned short);
+      size_t i = 0; while (i < n_elts) {
+	if ( (ints[i] < 0) || (ints[i] > 65535) ) {
+	  u8_free(shorts);
+	  kno_err(kno_RangeError,"pixels2imagick","16-bit pixel value",
+		  KNO_INT(ints[i]));
+	  return IMAGICK_DONE(IM_PIXELS_READ,KNO_ERROR_VALUE,0,0,0);}
+	shorts[i] = ints[i]; i++;}
+      storage = ShortPixel; data = shorts; break;}
+    case kno_float_elt:
+      storage = FloatPixel; data = KNO_NUMVEC_FLOATS(pixels); break;
+    case kno_double_elt:
+      storage = DoublePixel; data = KNO_NUMVEC_DOUBLES(pixels); break;
+    default:
+      kno_type_error("pixel vector","pixels2imagick",pixels);
+      return IMAGICK_DONE(IM_PIXELS_READ,KNO_ERROR_VALUE,0,0,0);}}
+  else {
+    kno_type_error("pixel vector","pixels2imagick",pixels);
+    return IMAGICK_DONE(IM_PIXELS_READ,KNO_ERROR_VALUE,0,0,0);}
+  if (n_elts != n_values) {
+    if (shorts) u8_free(shorts);
+    kno_err("PixelCountMismatch","pixels2imagick",mapbuf,pixels);
+    return IMAGICK_DONE(IM_PIXELS_READ,KNO_ERROR_VALUE,0,0,0);}
+  struct KNO_IMAGICK *imagickref = imagick_alloc();
+  MagickWand *wand = imagickref->wand;
+  MagickBooleanType ok = MagickConstituteImage(wand,w,h,mapbuf,storage,data);
+  if (shorts) u8_free(shorts);
+  if (ok == MagickFalse) {
+    grabmagickerr("pixels2imagick",wand);
+    imagick_release(imagickref);
+    return IMAGICK_DONE(IM_PIXELS_READ,KNO_ERROR_VALUE,0,0,0);}
+  imagick_account(imagickref);
+  if (imagick_check_limit("pixels2imagick") < 0) {
+    imagick_release(imagickref);
+    return IMAGICK_DONE(IM_PIXELS_READ,KNO_ERROR_VALUE,0,0,0);}
+  U8_CLEAR_ERRNO();
+  return IMAGICK_DONE(IM_PIXELS_READ,(lispval)imagickref,n_elts,0,w*h);
+}
+
+/* Region statistics */
+
+#define MAX_STATS_CHANNELS 16
+#define STATS_BAND_BYTES (1024*1024)
+
+typedef void (*region_rowfn)(void *state,size_t row,const float *pixels,
+			     size_t width,int n_channels);
+
+/* Gets a region from a vector #(x y width height), clipped to the
+   current image. A missing region covers the whole image. */
+static int get_region(lispval arg,MagickWand *wand,
+		      ssize_t *x,ssize_t *y,size_t *w,size_t *h,
+		      u8_context cxt)
+{
+  size_t iwidth = MagickGetImageWidth(wand);
+  size_t iheight = MagickGetImageHeight(wand);
+  if ( (KNO_VOIDP(arg)) || (KNO_FALSEP(arg)) || (KNO_DEFAULTP(arg)) ) {
+    *x = 0; *y = 0; *w = iwidth; *h = iheight;
+    return 1;}
+  else if ( (KNO_VECTORP(arg)) && (KNO_VECTOR_LENGTH(arg) == 4) &&
+	    (KNO_UINTP(KNO_VECTOR_REF(arg,0))) &&
+	    (KNO_UINTP(KNO_VECTOR_REF(arg,1))) &&
+	    (KNO_UINTP(KNO_VECTOR_REF(arg,2))) &&
+	    (KNO_UINTP(KNO_VECTOR_REF(arg,3))) ) {
+    size_t rx = KNO_FIX2INT(KNO_VECTOR_REF(arg,0));
+    size_t ry = KNO_FIX2INT(KNO_VECTOR_REF(arg,1));
+    size_t rw = KNO_FIX2INT(KNO_VECTOR_REF(arg,2));
+    size_t rh = KNO_FIX2INT(KNO_VECTOR_REF(arg,3));
+    if ( (rx >= iwidth) || (ry >= iheight) || (rw == 0) || (rh == 0) ) {
+      kno_seterr("EmptyRegion",cxt,NULL,arg);
+      return -1;}
+    if (rx+rw > iwidth) rw = iwidth-rx;
+    if (ry+rh > iheight) rh = iheight-ry;
+    *x = rx; *y = ry; *w = rw; *h = rh;
+    return 1;}
+  else {
+    kno_type_error("region #(x y width height)",cxt,arg);
+    return -1;}
+}
+
+/* Exports the region in bands of rows, calling rowfn on each row */
+static int scan_region(MagickWand *wand,ssize_t x,ssize_t y,size_t w,size_t h,
+		       const char *map,int n_channels,
+		       region_rowfn rowfn,void *state,u8_context cxt)
+{
+  size_t rowlen = w*n_channels;
+  size_t band = STATS_BAND_BYTES/(rowlen*sizeof(float));
+  if (band == 0) band = 1;
+  if (band > h) band = h;
+  float *buf = u8_alloc_n(band*rowlen,float);
+  size_t row = 0;
+  while (row < h) {
+    size_t n_rows = ((h-row) < band) ? (h-row) : (band);
+    if (MagickExportImagePixels(wand,x,y+row,w,n_rows,map,FloatPixel,buf)
+	== MagickFalse) {
+      u8_free(buf);
+      grabmagickerr(cxt,wand);
+      return -1;}
+    size_t i = 0; while (i < n_rows) {
+      rowfn(state,row+i,buf+(i*rowlen),w,n_channels);
+      i++;}
+    row += n_rows;}
+  u8_free(buf);
+  return 1;
+}
+
+struct CHANNEL_STATS {
+  double sum[MAX_STATS_CHANNELS], sumsq[MAX_STATS_CHANNELS];
+  float min[MAX_STATS_CHANNELS], max[MAX_STATS_CHANNELS];};
+
+static void stats_rowfn(void *state,size_t row,const float *pixels,
+			size_t width,int n_channels)
+{
+  struct CHANNEL_STATS *stats = state;
+  int c = 0; while (c < n_channels) {
+    const float *scan = pixels+c, *limit = pixels+width*n_channels;
+    double sum = 0, sumsq = 0;
+    float min = stats->min[c], max = stats->max[c];
+    while (scan < limit) {
+      float v = *scan;
+      sum += v; sumsq += v*v;
+      if (v < min) min = v;
+      if (v > max) max = v;
+      scan += n_channels;}
+    stats->sum[c] += sum; stats->sumsq[c] += sumsq;
+    stats->min[c] = min; stats->max[c] = max;
+    c++;}
+}
+
+static lispval mean_symbol, variance_symbol, min_symbol, max_symbol;
+static lispval count_symbol, columns_symbol, rows_symbol;
+
+DEFC_PRIM("imagick/stats",imagick_stats,
+	  KNO_MAX_ARGS(3)|KNO_MIN_ARGS(1),
+	  "Computes per-channel statistics over *region* (a vector "
+	  "#(x y width height), default the whole image) of the current "
+	  "image of *imagickref*, returning a table whose `mean`, "
+	  "`variance`, `min` and `max` slots are double vectors with "
+	  "one element per channel of *map* (default RGB). Values "
+	  "range from 0 to 1.",
+	  {"imagickref",KNO_IMAGICK_TYPE,KNO_VOID},
+	  {"region",kno_any_type,KNO_VOID},
+	  {"map",kno_any_type,KNO_VOID})
+static lispval imagick_stats(lispval imagickref,lispval region,lispval map)
+{
+  long long started = metrics_start();
+  struct KNO_IMAGICK *wrapper=
+    kno_consptr(struct KNO_IMAGICK *,imagickref,kno_imagick_type);
+  MagickWand *wand = wrapper->wand;
+  char mapbuf[MAX_STATS_CHANNELS+1];
+  ssize_t x, y; size_t w, h;
+  int n_channels = get_pixel_map(map,mapbuf,sizeof(mapbuf),"imagick_stats");
+  if (n_channels < 0) return IMAGICK_DONE(IM_STATS,KNO_ERROR_VALUE,0,0,0);
+  if (get_region(region,wand,&x,&y,&w,&h,"imagick_stats") < 0)
+    return IMAGICK_DONE(IM_STATS,KNO_ERROR_VALUE,0,0,0);
+  struct CHANNEL_STATS stats;
+  int c = 0; while (c < n_channels) {
+    stats.sum[c] = 0; stats.sumsq[c] = 0;
+    stats.min[c] = 1; stats.max[c] = 0;
+    c++;}
+  if (scan_region(wand,x,y,w,h,mapbuf,n_channels,
+		  stats_rowfn,&stats,"imagick_stats") < 0)
+    return IMAGICK_DONE(IM_STATS,KNO_ERROR_VALUE,0,0,0);
+  double n = ((double)w)*((double)h);
+  kno_double means[MAX_STATS_CHANNELS], variances[MAX_STATS_CHANNELS];
+  kno_double mins[MAX_STATS_CHANNELS], maxes[MAX_STATS_CHANNELS];
+  c = 0; while (c < n_channels) {
+    double mean = stats.sum[c]/n;
+    double variance = (stats.sumsq[c]/n)-(mean*mean);
+    means[c] = mean;
+    variances[c] = (variance < 0) ? (0) : (variance);
+    mins[c] = stats.min[c];
+    maxes[c] = stats.max[c];
+    c++;}
+  lispval result = kno_empty_slotmap();
+  lispval vec = kno_make_double_vector(n_channels,means);
+  kno_store(result,mean_symbol,vec); kno_decref(vec);
+  vec = kno_make_double_vector(n_channels,variances);
+  kno_store(result,variance_symbol,vec); kno_decref(vec);
+  vec = kno_make_double_vector(n_channels,mins);
+  kno_store(result,min_symbol,vec); kno_decref(vec);
+  vec = kno_make_double_vector(n_channels,maxes);
+  kno_store(result,max_symbol,vec); kno_decref(vec);
+  kno_store(result,count_symbol,KNO_INT(w*h));
+  U8_CLEAR_ERRNO();
+  return IMAGICK_DONE(IM_STATS,result,0,0,w*h);
+}
+
+struct HISTOGRAM_STATE { int n_bins; kno_int *counts;};
+
+static void histogram_rowfn(void *state,size_t row,const float *pixels,
+			    size_t width,int n_channels)
+{
+  struct HISTOGRAM_STATE *hist = state;
+  int n_bins = hist->n_bins;
+  int c = 0; while (c < n_channels) {
+    kno_int *counts = hist->counts+(c*n_bins);
+    const float *scan = pixels+c, *limit = pixels+width*n_channels;
+    while (scan < limit) {
+      int bin = (int)((*scan)*n_bins);
+      if (bin >= n_bins) bin = n_bins-1;
+      else if (bin < 0) bin = 0;
+      counts[bin]++;
+      scan += n_channels;}
+    c++;}
+}
+
+DEFC_PRIM("imagick/histogram",imagick_histogram,
+	  KNO_MAX_ARGS(4)|KNO_MIN_ARGS(1),
+	  "Computes a histogram with *bins* bins (default 256) for each "
+	  "channel of *map* (default RGB) over *region* (a vector "
+	  "#(x y width height), default the whole image). Returns an "
+	  "int vector holding the counts for each channel in turn.",
+	  {"imagickref",KNO_IMAGICK_TYPE,KNO_VOID},
+	  {"bins",kno_fixnum_type,KNO_INT(256)},
+	  {"region",kno_any_type,KNO_VOID},
+	  {"map",kno_any_type,KNO_VOID})
+static lispval imagick_histogram(lispval imagickref,lispval bins,
+				 lispval region,lispval map)
+{
+  long long started = metrics_start();
+  struct KNO_IMAGICK *wrapper=
+    kno_consptr(struct KNO_IMAGICK *,imagickref,kno_imagick_type);
+  MagickWand *wand = wrapper->wand;
+  char mapbuf[MAX_STATS_CHANNELS+1];
+  ssize_t x, y; size_t w, h;
+  if (!( (KNO_UINTP(bins)) && (KNO_FIX2INT(bins) > 0) &&
+	 (KNO_FIX2INT(bins) <= 65536) )) {
+    kno_type_error("bin count","imagick_histogram",bins);
+    return IMAGICK_DONE(IM_HISTOGRAM,KNO_ERROR_VALUE,0,0,0);}
+  int n_channels =
+    get_pixel_map(map,mapbuf,sizeof(mapbuf),"imagick_histogram");
+  if (n_channels < 0) return IMAGICK_DONE(IM_HISTOGRAM,KNO_ERROR_VALUE,0,0,0);
+  if (get_region(region,wand,&x,&y,&w,&h,"imagick_histogram") < 0)
+    return IMAGICK_DONE(IM_HISTOGRAM,KNO_ERROR_VALUE,0,0,0);
+  struct HISTOGRAM_STATE hist;
+  hist.n_bins = KNO_FIX2INT(bins);
+  hist.counts = u8_zalloc_n(hist.n_bins*n_channels,kno_int);
+  if (scan_region(wand,x,y,w,h,mapbuf,n_channels,
+		  histogram_rowfn,&hist,"imagick_histogram") < 0) {
+    u8_free(hist.counts);
+    return IMAGICK_DONE(IM_HISTOGRAM,KNO_ERROR_VALUE,0,0,0);}
+  lispval result = kno_make_int_vector(hist.n_bins*n_channels,hist.counts);
+  u8_free(hist.counts);
+  U8_CLEAR_ERRNO();
+  return IMAGICK_DONE(IM_HISTOGRAM,result,0,0,w*h);
+}
+
+struct TILE_STATE {
+  size_t tile_width, tile_height, columns;
+  int n_channels;
+  double *sums, *sumsqs;};
+
+static void tiles_rowfn(void *state,size_t row,const float *pixels,
+			size_t width,int n_channels)
+{
+  struct TILE_STATE *tiles = state;
+  size_t tile_row = row/tiles->tile_height;
+  size_t base = tile_row*tiles->columns*n_channels;
+  size_t col = 0; while (col < width) {
+    size_t tile = base+(col/tiles->tile_width)*n_channels;
+    const float *pixel = pixels+col*n_channels;
+    int c = 0; while (c < n_channels) {
+      float v = pixel[c];
+      tiles->sums[tile+c] += v;
+      tiles->sumsqs[tile+c] += v*v;
+      c++;}
+    col++;}
+}
+
+DEFC_PRIM("imagick/tile-stats",imagick_tile_stats,
+	  KNO_MAX_ARGS(5)|KNO_MIN_ARGS(3),
+	  "Divides *region* (default the whole image) into tiles of "
+	  "*tile_width* x *tile_height* and computes the mean and "
+	  "variance of each channel of *map* (default RGB) in each tile. "
+	  "Returns a table whose `mean` and `variance` slots are double "
+	  "vectors ordered by tile row, tile column and channel, along "
+	  "with the number of tile `columns` and `rows`.",
+	  {"imagickref",KNO_IMAGICK_TYPE,KNO_VOID},
+	  {"tile_width",kno_fixnum_type,KNO_VOID},
+	  {"tile_height",kno_fixnum_type,KNO_VOID},
+	  {"region",kno_any_type,KNO_VOID},
+	  {"map",kno_any_type,KNO_VOID})
+static lispval imagick_tile_stats(lispval imagickref,
+				  lispval tile_width,lispval tile_height,
+				  lispval region,lispval map)
+{
+  long long started = metrics_start();
+  struct KNO_IMAGICK *wrapper=
+    kno_consptr(struct KNO_IMAGICK *,imagickref,kno_imagick_type);
+  MagickWand *wand = wrapper->wand;
+  char mapbuf[MAX_STATS_CHANNELS+1];
+  ssize_t x, y; size_t w, h;
+  if (!( (KNO_UINTP(tile_width)) && (KNO_FIX2INT(tile_width) > 0) )) {
+    kno_type_error("tile width","imagick_tile_stats",tile_width);
+    return IMAGICK_DONE(IM_TILE_STATS,KNO_ERROR_VALUE,0,0,0);}
+  else if (!( (KNO_UINTP(tile_height)) && (KNO_FIX2INT(tile_height) > 0) )) {
+    kno_type_error("tile height","imagick_tile_stats",tile_height);
+    return IMAGICK_DONE(IM_TILE_STATS,KNO_ERROR_VALUE,0,0,0);}
+  int n_channels =
+    get_pixel_map(map,mapbuf,sizeof(mapbuf),"imagick_tile_stats");
+  if (n_channels < 0) return IMAGICK_DONE(IM_TILE_STATS,KNO_ERROR_VALUE,0,0,0);
+  if (get_region(region,wand,&x,&y,&w,&h,"imagick_tile_stats") < 0)
+    return IMAGICK_DONE(IM_TILE_STATS,KNO_ERROR_VALUE,0,0,0);
+  struct TILE_STATE tiles;
+  tiles.tile_width = KNO_FIX2INT(tile_width);
+  tiles.tile_height = KNO_FIX2INT(tile_height);
+  tiles.n_channels = n_channels;
+  tiles.columns = (w+tiles.tile_width-1)/tiles.tile_width;
+  size_t rows = (h+tiles.tile_height-1)/tiles.tile_height;
+  size_t n_values = tiles.columns*rows*n_channels;
+  tiles.sums = u8_zalloc_n(n_values,double);
+  tiles.sumsqs = u8_zalloc_n(n_values,double);
+  if (scan_region(wand,x,y,w,h,mapbuf,n_channels,
+		  tiles_rowfn,&tiles,"imagick_tile_stats") < 0) {
+    u8_free(tiles.sums); u8_free(tiles.sumsqs);
+    return IMAGICK_DONE(IM_TILE_STATS,KNO_ERROR_VALUE,0,0,0);}
+  size_t row = 0; while (row < rows) {
+    size_t th = ((row+1)*tiles.tile_height > h) ?
+      (h-row*tiles.tile_height) : (tiles.tile_height);
+    size_t col = 0; while (col < tiles.columns) {
+      size_t tw = ((col+1)*tiles.tile_width > w) ?
+	(w-col*tiles.tile_width) : (tiles.tile_width);
+      double n = ((double)tw)*((double)th);
+      size_t off = (row*tiles.columns+col)*n_channels;
+      int c = 0; while (c < n_channels) {
+	double mean = tiles.sums[off+c]/n;
+	double variance = (tiles.sumsqs[off+c]/n)-(mean*mean);
+	tiles.sums[off+c] = mean;
+	tiles.sumsqs[off+c] = (variance < 0) ? (0) : (variance);
+	c++;}
+      col++;}
+    row++;}
+  lispval result = kno_empty_slotmap();
+  lispval vec = kno_make_double_vector(n_values,tiles.sums);
+  kno_store(result,mean_symbol,vec); kno_decref(vec);
+  vec = kno_make_double_vector(n_values,tiles.sumsqs);
+  kno_store(result,variance_symbol,vec); kno_decref(vec);
+  kno_store(result,columns_symbol,KNO_INT(tiles.columns));
+  kno_store(result,rows_symbol,KNO_INT(rows));
+  u8_free(tiles.sums); u8_free(tiles.sumsqs);
+  U8_CLEAR_ERRNO();
+  return IMAGICK_DONE(IM_TILE_STATS,result,0,0,0);
+}
+
+/* Perceptual hashes */
+
+/* Fills pixels with the intensities of a w x h thumbnail of the
+   current image of wand */
+static int hash_thumbnail(MagickWand *wand,size_t w,size_t h,
+			  float *pixels,u8_context cxt)
+{
+  MagickWand *thumb = MagickGetImage(wand);
+  if (thumb == NULL) {
+    grabmagickerr(cxt,wand);
+    return -1;}
+  /* Scale large images down to about 4x the thumbnail first, so
+     that the filtered resize only reads a few pixels per output */
+  size_t sw = MagickGetImageWidth(thumb), sh = MagickGetImageHeight(thumb);
+  if ( ( (sw > w*8) || (sh > h*8) ) &&
+       (MagickScaleImage(thumb,(sw > w*4) ? (w*4) : (sw),
+			 (sh > h*4) ? (h*4) : (sh)) == MagickFalse) ) {
+    grabmagickerr(cxt,thumb);
+    DestroyMagickWand(thumb);
+    return -1;}
+  if ( (MagickResizeImage(thumb,w,h,TriangleFilter,1.0) == MagickFalse) ||
+       (MagickExportImagePixels(thumb,0,0,w,h,"I",FloatPixel,pixels)
+	== MagickFalse) ) {
+    grabmagickerr(cxt,thumb);
+    DestroyMagickWand(thumb);
+    return -1;}
+  DestroyMagickWand(thumb);
+  return 1;
+}
+
+static lispval hash2packet(unsigned long long hash)
+{
+  unsigned char bytes[8];
+  int i = 0; while (i < 8) {
+    bytes[i] = (hash>>(8*(7-i)))&0xFF;
+    i++;}
+  return kno_make_packet(NULL,8,bytes);
+}
+
+static unsigned long long bytes2hash(const unsigned char *bytes)
+{
+  unsigned long long hash = 0;
+  int i = 0; while (i < 8) hash = (hash<<8)|bytes[i++];
+  return hash;
+}
+
+static int get_hash(lispval arg,unsigned long long *hash,u8_context cxt)
+{
+  if ( (KNO_PACKETP(arg)) && (KNO_PACKET_LENGTH(arg) == 8) ) {
+    *hash = bytes2hash(KNO_PACKET_DATA(arg));
+    return 1;}
+  else {
+    kno_type_error("8-byte hash packet",cxt,arg);
+    return -1;}
+}
+
+DEFC_PRIM("imagick/dhash",imagick_dhash,
+	  KNO_MAX_ARGS(1)|KNO_MIN_ARGS(1),
+	  "Returns a 64-bit difference hash of the current image of "
+	  "*imagickref* as an 8-byte packet. Each bit compares the "
+	  "intensity of horizontally adjacent pixels of a 9x8 thumbnail.",
+	  {"imagickref",KNO_IMAGICK_TYPE,KNO_VOID})
+static lispval imagick_dhash(lispval imagickref)
+{
+  long long started = metrics_start();
+  struct KNO_IMAGICK *wrapper=
+    kno_consptr(struct KNO_IMAGICK *,imagickref,kno_imagick_type);
+  float pixels[9*8];
+  if (hash_thumbnail(wrapper->wand,9,8,pixels,"imagick_dhash") < 0)
+    return IMAGICK_DONE(IM_DHASH,KNO_ERROR_VALUE,0,0,0);
+  unsigned long long hash = 0;
+  int row = 0; while (row < 8) {
+    const float *scan = pixels+row*9;
+    int col = 0; while (col < 8) {
+      hash = (hash<<1)|(scan[col] < scan[col+1]);
+      col++;}
+    row++;}
+  U8_CLEAR_ERRNO();
+  return IMAGICK_DONE(IM_DHASH,hash2packet(hash),0,0,0);
+}
+
+#define PHASH_SIZE 32
+#define PHASH_COEFFS 8
+
+static float phash_cosines[PHASH_COEFFS][PHASH_SIZE];
+
+static void init_phash_cosines()
+{
+  int u = 0; while (u < PHASH_COEFFS) {
+    int x = 0; while (x < PHASH_SIZE) {
+      phash_cosines[u][x] = cos(((2*x+1)*u*M_PI)/(2.0*PHASH_SIZE));
+      x++;}
+    u++;}
+}
+
+static int compare_floats(const void *v1,const void *v2)
+{
+  float f1 = *((const float *)v1), f2 = *((const float *)v2);
+  return (f1 < f2) ? (-1) : (f1 > f2) ? (1) : (0);
+}
+
+DEFC_PRIM("imagick/phash",imagick_phash,
+	  KNO_MAX_ARGS(1)|KNO_MIN_ARGS(1),
+	  "Returns a 64-bit DCT-based perceptual hash of the current "
+	  "image of *imagickref* as an 8-byte packet. Each bit compares "
+	  "one of the 8x8 lowest-frequency DCT coefficients of a 32x32 "
+	  "grayscale thumbnail with their median.",
+	  {"imagickref",KNO_IMAGICK_TYPE,KNO_VOID})
+static lispval imagick_phash(lispval imagickref)
+{
+  long long started = metrics_start();
+  struct KNO_IMAGICK *wrapper=
+    kno_consptr(struct KNO_IMAGICK *,imagickref,kno_imagick_type);
+  float pixels[PHASH_SIZE*PHASH_SIZE];
+  float rows[PHASH_SIZE][PHASH_COEFFS];
+  float coeffs[PHASH_COEFFS*PHASH_COEFFS], sorted[PHASH_COEFFS*PHASH_COEFFS];
+  if (hash_thumbnail(wrapper->wand,PHASH_SIZE,PHASH_SIZE,pixels,
+		     "imagick_phash") < 0)
+    return IMAGICK_DONE(IM_PHASH,KNO_ERROR_VALUE,0,0,0);
+  /* Separable DCT, computing only the low frequencies we keep */
+  int y = 0; while (y < PHASH_SIZE) {
+    const float *row = pixels+y*PHASH_SIZE;
+    int u = 0; while (u < PHASH_COEFFS) {
+      const float *cosines = phash_cosines[u];
+      float sum = 0;
+      int x = 0; while (x < PHASH_SIZE) {
+	sum += row[x]*cosines[x];
+	x++;}
+      rows[y][u] = sum;
+      u++;}
+    y++;}
+  int v = 0; while (v < PHASH_COEFFS) {
+    const float *cosines = phash_cosines[v];
+    int u = 0; while (u < PHASH_COEFFS) {
+      float sum = 0;
+      y = 0; while (y < PHASH_SIZE) {
+	sum += rows[y][u]*cosines[y];
+	y++;}
+      coeffs[v*PHASH_COEFFS+u] = sum;
+      u++;}
+    v++;}
+  /* The DC term is ignored when computing the median */
+  memcpy(sorted,coeffs+1,sizeof(float)*(PHASH_COEFFS*PHASH_COEFFS-1));
+  qsort(sorted,PHASH_COEFFS*PHASH_COEFFS-1,sizeof(float),compare_floats);
+  float median = sorted[(PHASH_COEFFS*PHASH_COEFFS-1)/2];
+  unsigned long long hash = 0;
+  int i = 0; while (i < PHASH_COEFFS*PHASH_COEFFS) {
+    hash = (hash<<1)|((i > 0) && (coeffs[i] > median));
+    i++;}
+  U8_CLEAR_ERRNO();
+  return IMAGICK_DONE(IM_PHASH,hash2packet(hash),0,0,0);
+}
+
+DEFC_PRIM("imagick/hamming",imagick_hamming,
+	  KNO_MAX_ARGS(2)|KNO_MIN_ARGS(2),
+	  "Returns the number of bits which differ between the "
+	  "8-byte hashes *hash1* and *hash2*.",
+	  {"hash1",kno_packet_type,KNO_VOID},
+	  {"hash2",kno_packet_type,KNO_VOID})
+static lispval imagick_hamming(lispval hash1,lispval hash2)
+{
+  unsigned long long h1, h2;
+  if (get_hash(hash1,&h1,"imagick_hamming") < 0) return KNO_ERROR_VALUE;
+  if (get_hash(hash2,&h2,"imagick_hamming") < 0) return KNO_ERROR_VALUE;
+  return KNO_INT(__builtin_popcountll(h1^h2));
+}
+
+struct HASH_MATCH { size_t index; int distance; };
+
+static int compare_matches(const void *v1,const void *v2)
+{
+  const struct HASH_MATCH *m1 = v1, *m2 = v2;
+  if (m1->distance != m2->distance)
+    return m1->distance-m2->distance;
+  else return (m1->index < m2->index) ? (-1) : (m1->index > m2->index);
+}
+
+DEFC_PRIM("imagick/hash-search",imagick_hash_search,
+	  KNO_MAX_ARGS(4)|KNO_MIN_ARGS(2),
+	  "Searches *hashes*, a packet of 8-byte hashes laid end to end, "
+	  "for those within *maxdist* bits (default 8) of *hash*. "
+	  "Returns a vector of (*index* . *distance*) pairs, closest "
+	  "first, with at most *limit* entries if specified.",
+	  {"hash",kno_packet_type,KNO_VOID},
+	  {"hashes",kno_packet_type,KNO_VOID},
+	  {"maxdist",kno_fixnum_type,KNO_INT(8)},
+	  {"limit",kno_fixnum_type,KNO_VOID})
+static lispval imagick_hash_search(lispval hash,lispval hashes,
+				   lispval maxdist,lispval limit)
+{
+  unsigned long long probe;
+  if (get_hash(hash,&probe,"imagick_hash_search") < 0)
+    return KNO_ERROR_VALUE;
+  if ((KNO_PACKET_LENGTH(hashes))%8)
+    return kno_type_error("packed 8-byte hashes","imagick_hash_search",hashes);
+  if (!(KNO_UINTP(maxdist)))
+    return kno_type_error("uint","imagick_hash_search",maxdist);
+  int max = KNO_FIX2INT(maxdist);
+  size_t n_hashes = KNO_PACKET_LENGTH(hashes)/8;
+  const unsigned char *bytes = KNO_PACKET_DATA(hashes);
+  size_t n_matches = 0, max_matches = 64;
+  struct HASH_MATCH *matches = u8_alloc_n(max_matches,struct HASH_MATCH);
+  size_t i = 0; while (i < n_hashes) {
+    int distance = __builtin_popcountll(probe^bytes2hash(bytes+i*8));
+    if (distance <= max) {
+      if (n_matches == max_matches) {
+	max_matches = max_matches*2;
+	matches = u8_realloc_n(matches,max_matches,struct HASH_MATCH);}
+      matches[n_matches].index = i;
+      matches[n_matches].distance = distance;
+      n_matches++;}
+    i++;}
+  qsort(matches,n_matches,sizeof(struct HASH_MATCH),compare_matches);
+  if ( (KNO_UINTP(limit)) && (n_matches > KNO_FIX2INT(limit)) )
+    n_matches = KNO_FIX2INT(limit);
+  lispval *elts = u8_alloc_n(n_matches,lispval);
+  i = 0; while (i < n_matches) {
+    elts[i] = kno_conspair(KNO_INT(matches[i].index),
+			   KNO_INT(matches[i].distance));
+    i++;}
+  u8_free(matches);
+  return kno_wrap_vector(n_matches,elts);
+}
+
+static lispval pool_size_symbol, pool_max_symbol, pool_requests_symbol;
+static lispval pool_reused_symbol, pool_returned_symbol;
+static lispval pool_discarded_symbol, pool_reuse_rate_symbol;
+
+DEFC_PRIM("imagick/pool-stats",imagick_pool_stats,
+	  KNO_MAX_ARGS(0)|KNO_MIN_ARGS(0),
+	  "Returns a table describing the reuse of pooled wands, "
+	  "including the number currently pooled across all threads "
+	  "and the fraction of allocations satisfied from a pool.")
+static lispval imagick_pool_stats()
+{
+  long long requests = __atomic_load_n(&pool_requests,__ATOMIC_RELAXED);
+  long long reused = __atomic_load_n(&pool_reused,__ATOMIC_RELAXED);
+  lispval result = kno_empty_slotmap();
+  kno_store(result,pool_size_symbol,
+	    KNO_INT(__atomic_load_n(&pool_size,__ATOMIC_RELAXED)));
+  kno_store(result,pool_max_symbol,KNO_INT(imagick_pool_max));
+  kno_store(result,pool_requests_symbol,KNO_INT(requests));
+  kno_store(result,pool_reused_symbol,KNO_INT(reused));
+  kno_store(result,pool_returned_symbol,
+	    KNO_INT(__atomic_load_n(&pool_returned,__ATOMIC_RELAXED)));
+  kno_store(result,pool_discarded_symbol,
+	    KNO_INT(__atomic_load_n(&pool_discarded,__ATOMIC_RELAXED)));
+  lispval rate = kno_make_double
+    ((requests) ? (((double)reused)/((double)requests)) : (0.0));
+  kno_store(result,pool_reuse_rate_symbol,rate);
+  kno_decref(rate);
+  return result;
+}
+
+DEFC_PRIM("imagick/metrics",imagick_metrics_prim,
+	  KNO_MAX_ARGS(1)|KNO_MIN_ARGS(0),
+	  "Returns a table of call statistics for the imagick "
+	  "primitives, keyed by primitive name. If *reset* is true, "
+	  "the statistics are zeroed after being read.",
+	  {"reset",kno_any_type,KNO_FALSE})
+static lispval imagick_metrics_prim(lispval reset)
+{
+  return metrics_table(imagick_metrics,IM_N_METRICS,(!(KNO_FALSEP(reset))));
+}
+
+/* Getting properties */
+
+static lispval imagick_table_get(lispval imagickref,lispval field,lispval dflt)
+{
+  /* enum result_type {imbool,imint,imdouble,imsize,imbox,imtrans} rt; */
+  struct KNO_IMAGICK *wrapper=
+    kno_consptr(struct KNO_IMAGICK *,imagickref,kno_imagick_type);
+  MagickWand *wand = wrapper->wand;
+  if (KNO_EQ(field,format)) {
+    const char *fmt = MagickGetImageFormat(wand);
+    return kno_mkstring((char *)fmt);}
+#if (MagickLibVersion>0x670)
+  else if (KNO_EQ(field,resolution)) {
+    double x = 0, y = 0;
+    /* MagickBooleanType rv = */
+    MagickGetResolution(wand,&x,&y);
+    return kno_conspair(kno_make_double(x),kno_make_double(y));}
+#endif
+  else if (KNO_EQ(field,interlace)) {
+    InterlaceType it = MagickGetInterlaceScheme(wand);
+    if (it == NoInterlace)
+      return KNO_FALSE;
+    else if (it == LineInterlace)
+      return line_interlace;
+    else if (it == PlaneInterlace)
+      return plane_interlace;
+    else if (it == PartitionInterlace)
+      return partition_interlace;
+    else return KNO_EMPTY_CHOICE;}
+  else if (KNO_EQ(field,size)) {
+    size_t w = MagickGetImageWidth(wand);
+    size_t h = MagickGetImageHeight(wand);
+    return kno_conspair(KNO_INT(w),KNO_INT(h));}
+  else if (KNO_EQ(field,width)) {
+    size_t w = MagickGetImageWidth(wand);
+    return KNO_INT(w);}
+  else if (KNO_EQ(field,height)) {
+    size_t h = MagickGetImageHeight(wand);
+    return KNO_INT(h);}
+  else if (KNO_EQ(field,colorspace_symbol)) {
+    char *csname = cspace2string(MagickGetImageColorspace(wand));
+    if (csname) return kno_intern(csname);
+    else return KNO_EMPTY_CHOICE;}
+  else return KNO_VOID;
+}
+
+static FilterTypes default_filter = TriangleFilter;
+
+/* Filter names are interned once by init_symbols(), so that
+   resolving a symbol argument is usually just a pointer comparison,
+   with a case-insensitive match on the name as the fallback. */
+static struct FILTERMAP {
+  FilterTypes ft;
+  char *fname;
+  lispval fsym;} filter_types[]={
+  {TriangleFilter,"triangle",KNO_VOID},
+  {BoxFilter,"box",KNO_VOID},
+  {BlackmanFilter,"blackman",KNO_VOID},
+  {CatromFilter,"catrom",KNO_VOID},
+  {GaussianFilter,"gaussian",KNO_VOID},
+  {CubicFilter,"cubic",KNO_VOID},
+  {HanningFilter,"hanning",KNO_VOID},
+  {HermiteFilter,"hermite",KNO_VOID},
+  {LanczosFilter,"lanczos",KNO_VOID},
+  {MitchellFilter,"mitchell",KNO_VOID},
+  {PointFilter,"point",KNO_VOID},
+  {QuadraticFilter,"quadratic",KNO_VOID},
+  {SincFilter,"sinc",KNO_VOID},
+  {BesselFilter,"bessel",KNO_VOID},
+  {UndefinedFilter,NULL,KNO_VOID}};
+
+/* Stores the filter named by arg (or the default, if arg is omitted)
+   in *ft, returning 0 if arg doesn't name a filter */
+static int lookup_filter(lispval arg,FilterTypes *ft)
+{
+  struct FILTERMAP *scan = filter_types;
+  u8_string name = NULL;
+  if ((KNO_VOIDP(arg))||(KNO_FALSEP(arg))) {
+    *ft = default_filter;
+    return 1;}
+  else if (KNO_SYMBOLP(arg)) {
+    while (scan->fname)
+      if (scan->fsym == arg) {
+	*ft = scan->ft;
+	return 1;}
+      else scan++;
+    /* Symbols which aren't the interned lowercase names (for
+       instance, |Lanczos|) still match by name */
+    name = KNO_SYMBOL_NAME(arg);}
+  else if (KNO_STRINGP(arg))
+    name = KNO_CSTRING(arg);
+  if (name) {
+    scan = filter_types;
+    while (scan->fname)
+      if (strcasecmp(name,scan->fname) == 0) {
+	*ft = scan->ft;
+	return 1;}
+      else scan++;}
+  return 0;
+}
+
+static FilterTypes getfilter(lispval arg,u8_string cxt)
+{
+  FilterTypes ft;
+  if (lookup_filter(arg,&ft)) return ft;
+  u8_log(LOG_WARN,cxt,"Bad filter arg %q",arg);
+  return default_filter;
+}
+
+/* Resize modes, trading quality for speed:
+    resize    uses MagickResizeImage with the given filter
+    thumbnail uses MagickThumbnailImage, which also drops profiles
+    sample    picks the nearest pixel, with no filtering at all
+    scale     averages pixels, cheaper than filtering for reductions
+    twostage  samples down to twice the target size before filtering,
+              which is much cheaper for large reductions */
+
+enum RESIZE_MODE {
+  resize_mode, thumbnail_mode, sample_mode, scale_mode, twostage_mode };
+
+static struct RESIZEMAP {
+  enum RESIZE_MODE mode;
+  char *mname;
+  lispval msym;} resize_modes[]={
+  {resize_mode,"resize",KNO_VOID},
+  {thumbnail_mode,"thumbnail",KNO_VOID},
+  {sample_mode,"sample",KNO_VOID},
+  {scale_mode,"scale",KNO_VOID},
+  {twostage_mode,"twostage",KNO_VOID},
+  {resize_mode,NULL,KNO_VOID}};
+
+/* Reductions by more than this factor are sampled first in
+   twostage mode */
+#define TWOSTAGE_RATIO 3
+
+static int lookup_resize_mode(lispval arg)
+{
+  struct RESIZEMAP *scan = resize_modes;
+  while (scan->mname)
+    if (scan->msym == arg) return scan->mode;
+    else scan++;
+  return -1;
+}
+
+/* Returns the resize mode named by arg, or -1 (signalling an error) */
+static int getresizemode(lispval arg,u8_string cxt)
+{
+  if ((KNO_VOIDP(arg))||(KNO_FALSEP(arg)))
+    return resize_mode;
+  int mode = lookup_resize_mode(arg);
+  if (mode < 0) kno_type_error("resize mode",cxt,arg);
+  return mode;
+}
+
+static MagickBooleanType resize_wand(MagickWand *wand,
+				     size_t width,size_t height,
+				     enum RESIZE_MODE mode,
+				     FilterTypes filter,double blur)
+{
+  switch (mode) {
+  case thumbnail_mode:
+    return MagickThumbnailImage(wand,width,height);
+  case sample_mode:
+    return MagickSampleImage(wand,width,height);
+  case scale_mode:
+    return MagickScaleImage(wand,width,height);
+  case twostage_mode:
+    if ( (MagickGetImageWidth(wand) > (width*TWOSTAGE_RATIO)) &&
+	 (MagickGetImageHeight(wand) > (height*TWOSTAGE_RATIO)) &&
+	 (MagickSampleImage(wand,width*2,height*2) == MagickFalse) )
+      return MagickFalse;
+    /* Fall through */
+  default:
+    return MagickResizeImage(wand,width,height,filter,blur);}
+}
+
+
+DEFC_PRIM("imagick/format",imagick_format,
+	  KNO_MAX_ARGS(2)|KNO_MIN_ARGS(2),
+	  "**undocumented**",
+	  {"imagickref",KNO_IMAGICK_TYPE,KNO_VOID},
+	  {"format",kno_string_type,KNO_VOID})
+static lispval imagick_format(lispval imagickref,lispval format)
+{
+  long long started = metrics_start();
+  MagickBooleanType retval;
+  struct KNO_IMAGICK *wrapper=
+    kno_consptr(struct KNO_IMAGICK *,imagickref,kno_imagick_type);
+  MagickWand *wand = wrapper->wand;
+  retval = MagickSetImageFormat(wand,KNO_CSTRING(format));
+  if (retval == MagickFalse) {
+    grabmagickerr("imagick_format",wand);
+    return IMAGICK_DONE(IM_FORMAT,KNO_ERROR_VALUE,0,0,0);}
+  else return IMAGICK_DONE(IM_FORMAT,kno_incref(imagickref),
+			0,0,wand_pixels(wand));
+}
+
+DEFC_PRIM("imagick/colorspace",imagick_colorspace,
+	  KNO_MAX_ARGS(2)|KNO_MIN_ARGS(2),
+	  "Converts the pixels of every frame of *imagickref* into "
+	  "*colorspace*, a name from the colorspace table such as "
+	  "`sRGB`, `GRAY`, `CMYK`, `Lab` or `YCbCr`. Frames are "
+	  "converted in place, one at a time, so if converting a frame "
+	  "fails, the frames before it are left converted.",
+	  {"imagickref",KNO_IMAGICK_TYPE,KNO_VOID},
+	  {"colorspace",kno_any_type,KNO_VOID})
+static lispval imagick_colorspace(lispval imagickref,lispval cs_arg)
+{
+  long long started = metrics_start();
+  struct KNO_IMAGICK *wrapper=
+    kno_consptr(struct KNO_IMAGICK *,imagickref,kno_imagick_type);
+  ColorspaceType cs = (KNO_SYMBOLP(cs_arg)) ?
+    (string2cspace(KNO_SYMBOL_NAME(cs_arg))) :
+    (KNO_STRINGP(cs_arg)) ? (string2cspace(KNO_CSTRING(cs_arg))) :
+    (UndefinedColorspace);
+  if (cs == UndefinedColorspace) {
+    kno_type_error("colorspace","imagick_colorspace",cs_arg);
+    return IMAGICK_DONE(IM_COLORSPACE,KNO_ERROR_VALUE,0,0,0);}
+  MagickWand *wand = wrapper->wand;
+  MagickResetIterator(wand);
+  while (MagickNextImage(wand) != MagickFalse) {
+    if (MagickTransformImageColorspace(wand,cs) == MagickFalse) {
+      grabmagickerr("imagick_colorspace",wand);
+      return IMAGICK_DONE(IM_COLORSPACE,KNO_ERROR_VALUE,0,0,0);}}
+  MagickResetIterator(wand);
+  imagick_account(wrapper);
+  U8_CLEAR_ERRNO();
+  return IMAGICK_DONE(IM_COLORSPACE,kno_incref(imagickref),
+		      0,0,wand_pixels(wand));
+}
+
+
+/* Computes the largest size with the aspect ratio of iwidth x iheight
+   which fits within width x height. */
+static void fit_dimensions(size_t iwidth,size_t iheight,
+			   size_t width,size_t height,
+			   size_t *target_width,size_t *target_height)
+{
+  double xscale = ((double)width)/((double)iwidth);
+  double yscale = ((double)height)/((double)iheight);
+  double scale = ((xscale<yscale)?(xscale):(yscale));
+  *target_width = (int)floor(iwidth*scale);
+  *target_height = (int)floor(iheight*scale);
+  if (*target_width == 0) *target_width = 1;
+  if (*target_height == 0) *target_height = 1;
+}
+
+DEFC_PRIM("imagick/fit",imagick_fit,
+	  KNO_MAX_ARGS(6)|KNO_MIN_ARGS(3),
+	  "Resizes *imagickref* to fit within *width* x *height*, "
+	  "keeping its aspect ratio. *mode* (`resize`, `thumbnail`, "
+	  "`sample`, `scale` or `twostage`) trades quality for speed; "
+	  "*filter* and *blur* apply to the `resize` and `twostage` modes.",
+	  {"imagickref",kno_any_type,KNO_VOID},
+	  {"w_arg",kno_fixnum_type,KNO_VOID},
+	  {"h_arg",kno_fixnum_type,KNO_VOID},
+	  {"filter",kno_any_type,KNO_VOID},
+	  {"blur",kno_flonum_type,KNO_VOID},
+	  {"mode",kno_any_type,KNO_VOID})
+static lispval imagick_fit(lispval imagickref,lispval w_arg,lispval h_arg,
+			   lispval filter,lispval blur,lispval mode_arg)
+{
+  long long started = metrics_start();
+  if (!(KNO_UINTP(w_arg))) {
+    kno_type_error("uint","imagick_fit",w_arg);
+    return IMAGICK_DONE(IM_FIT,KNO_ERROR_VALUE,0,0,0);}
+  else if (!(KNO_UINTP(h_arg))) {
+    kno_type_error("uint","imagick_fit",h_arg);
+    return IMAGICK_DONE(IM_FIT,KNO_ERROR_VALUE,0,0,0);}
+  if (KNO_TYPEP(imagickref,kno_imagick_lazy_type)) {
+    /* Recorded ops only keep symbols they recognize as modes or
+       filters, so bad ones are caught here rather than when the
+       object is realized */
+    FilterTypes ft;
+    if (getresizemode(mode_arg,"imagick_fit") < 0)
+      return IMAGICK_DONE(IM_FIT,KNO_ERROR_VALUE,0,0,0);
+    else if (!(lookup_filter(filter,&ft))) {
+      kno_type_error("filter","imagick_fit",filter);
+      return IMAGICK_DONE(IM_FIT,KNO_ERROR_VALUE,0,0,0);}
+    lispval args[5] = { w_arg, h_arg, blur, filter, mode_arg };
+    return IMAGICK_DONE(IM_FIT,lazy_record(imagickref,"fit",5,args,
+					   "imagick_fit"),0,0,0);}
+  else if (!(KNO_TYPEP(imagickref,kno_imagick_type))) {
+    kno_type_error("imagick","imagick_fit",imagickref);
+    return IMAGICK_DONE(IM_FIT,KNO_ERROR_VALUE,0,0,0);}
+  MagickBooleanType retval;
+  struct KNO_IMAGICK *wrapper=
+    kno_consptr(struct KNO_IMAGICK *,imagickref,kno_imagick_type);
+  int mode = getresizemode(mode_arg,"imagick_fit");
+  if (mode < 0) return IMAGICK_DONE(IM_FIT,KNO_ERROR_VALUE,0,0,0);
+  MagickWand *wand = wrapper->wand;
+  int width = KNO_FIX2INT(w_arg), height = KNO_FIX2INT(h_arg);
+  size_t target_width, target_height;
+  fit_dimensions(MagickGetImageWidth(wand),MagickGetImageHeight(wand),
+		 width,height,&target_width,&target_height);
+  retval = resize_wand
+    (wand,target_width,target_height,mode,
+     getfilter(filter,"imagick_fit"),
+     ((KNO_VOIDP(blur))?(1.0):(KNO_FLONUM(blur))));
+  if (retval == MagickFalse) {
+    grabmagickerr("imagick_fit",wand);
+    return IMAGICK_DONE(IM_FIT,KNO_ERROR_VALUE,0,0,0);}
+  else {
+    imagick_account(wrapper);
+    U8_CLEAR_ERRNO();
+    return IMAGICK_DONE(IM_FIT,kno_incref(imagickref),
+			0,0,wand_pixels(wand));}
+}
+
+/* Operation lists
+
+   An operation list is a list of ops like (fit 200 200) or (flip),
+   which is parsed into an array of IMAGICK_OP structs so that it can
+   be applied to wands without calling back into Kno (and so from
+   task threads). */
+
+enum IMAGICK_OP_TYPE {
+  fit_op, resize_op, crop_op, flip_op, flop_op, rotate_op, blur_op,
+  equalize_op, despeckle_op, enhance_op, autoorient_op, strip_op };
+
+static struct OPMAP {
+  enum IMAGICK_OP_TYPE type;
+  char *opname;
+  int min_args, max_args;
+  lispval opsym;} imagick_ops[]={
+  {fit_op,"fit",2,3,KNO_VOID},
+  {resize_op,"resize",2,3,KNO_VOID},
+  {crop_op,"crop",2,4,KNO_VOID},
+  {flip_op,"flip",0,0,KNO_VOID},
+  {flop_op,"flop",0,0,KNO_VOID},
+  {rotate_op,"rotate",1,1,KNO_VOID},
+  {blur_op,"blur",2,2,KNO_VOID},
+  {equalize_op,"equalize",0,0,KNO_VOID},
+  {despeckle_op,"despeckle",0,0,KNO_VOID},
+  {enhance_op,"enhance",0,0,KNO_VOID},
+  {autoorient_op,"autoorient",0,0,KNO_VOID},
+  {strip_op,"strip",0,0,KNO_VOID},
+  {fit_op,NULL,0,0,KNO_VOID}};
+
+struct IMAGICK_OP {
+  enum IMAGICK_OP_TYPE type;
+  double args[4];
+  FilterTypes filter;
+  enum RESIZE_MODE mode;};
+
+/* Parses one op, returning -1 (signalling an error) if it's invalid */
+static int parse_op(lispval spec,struct IMAGICK_OP *op,u8_context cxt)
+{
+  if (!(KNO_PAIRP(spec))) spec = kno_make_list(1,kno_incref(spec));
+  else kno_incref(spec);
+  lispval head = KNO_CAR(spec), args = KNO_CDR(spec);
+  struct OPMAP *scan = imagick_ops;
+  while (scan->opname)
+    if (scan->opsym == head) break;
+    else scan++;
+  memset(op,0,sizeof(struct IMAGICK_OP));
+  op->filter = default_filter;
+  op->mode = resize_mode;
+  if (scan->opname == NULL) {
+    kno_seterr("BadImagickOp",cxt,NULL,spec);
+    kno_decref(spec);
+    return -1;}
+  op->type = scan->type;
+  /* Only numbers count as positional args; the filter and mode names
+     which may follow the size of a fit or resize can go anywhere
+     after it and don't count against max_args */
+  int n_args = 0;
+  KNO_DOLIST(arg,args) {
+    if ( (n_args >= 2) &&
+	 ( (op->type == fit_op) || (op->type == resize_op) ) &&
+	 ( (KNO_SYMBOLP(arg)) || (KNO_STRINGP(arg)) ) ) {
+      int mode = lookup_resize_mode(arg);
+      if (mode >= 0) op->mode = mode;
+      else op->filter = getfilter(arg,cxt);}
+    else if (n_args >= scan->max_args) {
+      n_args++; break;}
+    else if (KNO_FIXNUMP(arg))
+      op->args[n_args++] = KNO_FIX2INT(arg);
+    else if (KNO_FLONUMP(arg))
+      op->args[n_args++] = KNO_FLONUM(arg);
+    else {
+      kno_seterr("BadImagickOp",cxt,scan->opname,spec);
+      kno_decref(spec);
+      return -1;}}
+  if ( (n_args < scan->min_args) || (n_args > scan->max_args) ) {
+    kno_seterr("BadImagickOpArgs",cxt,scan->opname,spec);
+    kno_decref(spec);
+    return -1;}
+  /* Sizes must be whole and non-negative, and crop offsets whole,
+     all within int range, since apply_op() casts them to integers */
+  if ( (op->type == fit_op) || (op->type == resize_op) ||
+       (op->type == crop_op) ) {
+    int n_whole = (op->type == crop_op) ? (n_args) : (2), i = 0;
+    while (i < n_whole) {
+      double v = op->args[i], min = (i < 2) ? (0) : (-((double)INT_MAX));
+      if (!( (v == floor(v)) && (v >= min) && (v <= INT_MAX) )) {
+	kno_seterr("BadImagickOpArgs",cxt,scan->opname,spec);
+	kno_decref(spec);
+	return -1;}
+      i++;}}
+  kno_decref(spec);
+  return 1;
+}
+
+/* Parses an op list into a newly allocated array (or NULL, signalling
+   an error) and stores its length in *n_ops */
+static struct IMAGICK_OP *parse_ops(lispval ops,int *n_ops,u8_context cxt)
+{
+  int n = 0;
+  if (!( (KNO_PAIRP(ops)) || (KNO_NILP(ops)) )) {
+    kno_type_error("op list",cxt,ops);
+    return NULL;}
+  {KNO_DOLIST(spec,ops) n++;}
+  struct IMAGICK_OP *parsed = u8_alloc_n((n) ? (n) : (1),struct IMAGICK_OP);
+  int i = 0;
+  KNO_DOLIST(spec,ops) {
+    if (parse_op(spec,&(parsed[i]),cxt) < 0) {
+      u8_free(parsed);
+      return NULL;}
+    i++;}
+  *n_ops = n;
+  return parsed;
+}
+
+/* Applies op to the current image of wand */
+static MagickBooleanType apply_op(MagickWand *wand,struct IMAGICK_OP *op)
+{
+  switch (op->type) {
+  case fit_op: {
+    size_t w, h;
+    fit_dimensions(MagickGetImageWidth(wand),MagickGetImageHeight(wand),
+		   (size_t)op->args[0],(size_t)op->args[1],&w,&h);
+    return resize_wand(wand,w,h,op->mode,op->filter,
+		       (op->args[2]) ? (op->args[2]) : (1.0));}
+  case resize_op:
+    return resize_wand(wand,(size_t)op->args[0],(size_t)op->args[1],
+		       op->mode,op->filter,
+		       (op->args[2]) ? (op->args[2]) : (1.0));
+  case crop_op:
+    return MagickCropImage(wand,(size_t)op->args[0],(size_t)op->args[1],
+			   (ssize_t)op->args[2],(ssize_t)op->args[3]);
+  case flip_op:
+    return MagickFlipImage(wand);
+  case flop_op:
+    return MagickFlopImage(wand);
+  case rotate_op: {
+    PixelWand *background = NewPixelWand();
+    MagickBooleanType ok = MagickRotateImage(wand,background,op->args[0]);
+    DestroyPixelWand(background);
+    return ok;}
+  case blur_op:
+    return MagickGaussianBlurImage(wand,op->args[0],op->args[1]);
+  case equalize_op:
+    return MagickEqualizeImage(wand);
+  case despeckle_op:
+    return MagickDespeckleImage(wand);
+  case enhance_op:
+    return MagickEnhanceImage(wand);
+  case autoorient_op:
+    return MagickAutoOrientImage(wand);
+  case strip_op:
+    return MagickStripImage(wand);
+  default:
+    return MagickFalse;}
+}
+
+static MagickBooleanType apply_ops(MagickWand *wand,
+				   struct IMAGICK_OP *ops,int n_ops)
+{
+  int i = 0; while (i < n_ops) {
+    if (apply_op(wand,&(ops[i])) == MagickFalse)
+      return MagickFalse;
+    i++;}
+  return MagickTrue;
+}
+
+/* Lazy pipelines
+
+   imagick/lazy returns an imagick-lazy object which records the ops
+   applied to it by imagick/fit, imagick/crop, imagick/flip,
+   imagick/flop and imagick/apply instead of running them. When it is
+   realized (explicitly or by imagick->packet or imagick->file), each
+   run of geometric ops (fit, resize, crop, flip, flop and strip) is
+   reduced to at most one crop of the input, one resize, one mirror
+   and a strip:
+
+    * crops after resizes are mapped back onto the unresized image,
+      so that only the pixels which survive are resized;
+    * consecutive resizes collapse into the last one;
+    * flips and flops cancel in pairs, and a flip with a flop becomes
+      a single 180 degree rotation.
+
+   When the first run shrinks a JPEG, it is decoded directly at a
+   reduced scale (via jpeg:size). Crops mapped back through resizes
+   are rounded to whole pixels, so results can differ by a pixel from
+   running the same ops eagerly, and cropped images are repaged. */
+
+typedef struct KNO_IMAGICK_LAZY {
+  KNO_CONS_HEADER;
+  lispval source, opts;
+  /* Held while ops are appended or copied */
+  u8_mutex lock;
+  struct IMAGICK_OP *ops;
+  int n_ops, max_ops;} KNO_IMAGICK_LAZY;
+typedef struct KNO_IMAGICK_LAZY *kno_imagick_lazy;
+
+static int unparse_imagick_lazy(struct U8_OUTPUT *out,lispval x)
+{
+  struct KNO_IMAGICK_LAZY *lazy = (struct KNO_IMAGICK_LAZY *)x;
+  u8_printf(out,"#<IMAGICK-LAZY %lx %d ops>",(unsigned long)x,lazy->n_ops);
+  return 1;
+}
+
+static void recycle_imagick_lazy(struct KNO_RAW_CONS *c)
+{
+  struct KNO_IMAGICK_LAZY *lazy = (struct KNO_IMAGICK_LAZY *)c;
+  kno_decref(lazy->source);
+  kno_decref(lazy->opts);
+  if (lazy->ops) u8_free(lazy->ops);
+  u8_destroy_mutex(&(lazy->lock));
+  if (!(KNO_STATIC_CONSP(c))) u8_free(c);
+}
+
+static void lazy_append(struct KNO_IMAGICK_LAZY *lazy,
+			struct IMAGICK_OP *ops,int n)
+{
+  u8_lock_mutex(&(lazy->lock));
+  if (lazy->n_ops+n > lazy->max_ops) {
+    int max = (lazy->max_ops) ? (lazy->max_ops*2) : (8);
+    while (max < lazy->n_ops+n) max = max*2;
+    lazy->ops = (lazy->ops) ? (u8_realloc_n(lazy->ops,max,struct IMAGICK_OP)) :
+      (u8_alloc_n(max,struct IMAGICK_OP));
+    lazy->max_ops = max;}
+  memcpy(lazy->ops+lazy->n_ops,ops,n*sizeof(struct IMAGICK_OP));
+  lazy->n_ops += n;
+  u8_unlock_mutex(&(lazy->lock));
+}
+
+/* Copies the ops recorded so far into *opsp (to be freed with
+   u8_free), so that they can be run while more are recorded by
+   other threads, and returns their count */
+static int lazy_ops_copy(struct KNO_IMAGICK_LAZY *lazy,
+			 struct IMAGICK_OP **opsp)
+{
+  u8_lock_mutex(&(lazy->lock));
+  int n = lazy->n_ops;
+  struct IMAGICK_OP *ops = u8_alloc_n((n) ? (n) : (1),struct IMAGICK_OP);
+  if (n) memcpy(ops,lazy->ops,n*sizeof(struct IMAGICK_OP));
+  u8_unlock_mutex(&(lazy->lock));
+  *opsp = ops;
+  return n;
+}
+
+/* Records the op named opname with the given (possibly void) args,
+   as if it were the op (opname arg...) of imagick/apply, returning
+   lazyref */
+static lispval lazy_record(lispval lazyref,u8_string opname,
+			   int n_args,lispval *args,u8_context cxt)
+{
+  struct KNO_IMAGICK_LAZY *lazy=
+    kno_consptr(struct KNO_IMAGICK_LAZY *,lazyref,kno_imagick_lazy_type);
+  struct OPMAP *scan = imagick_ops;
+  while ( (scan->opname) && (strcmp(scan->opname,opname)) ) scan++;
+  lispval spec = KNO_NIL;
+  int i = n_args-1; while (i >= 0) {
+    lispval arg = args[i--];
+    if (!( (KNO_VOIDP(arg)) || (KNO_DEFAULTP(arg)) || (KNO_FALSEP(arg)) ))
+      spec = kno_conspair(kno_incref(arg),spec);}
+  spec = kno_conspair(scan->opsym,spec);
+  struct IMAGICK_OP op;
+  int rv = parse_op(spec,&op,cxt);
+  kno_decref(spec);
+  if (rv < 0) return KNO_ERROR_VALUE;
+  lazy_append(lazy,&op,1);
+  return kno_incref(lazyref);
+}
+
+/* The combined effect of a run of geometric ops: the crop (cx, cy,
+   cw, ch) of the run's input, resized to ow x oh, then mirrored */
+struct LAZY_PLAN {
+  double cx, cy, cw, ch;
+  size_t ow, oh;
+  int resized, flip, flop, strip;
+  FilterTypes filter;
+  enum RESIZE_MODE mode;
+  double blur;};
+
+/* Plans the run of geometric ops starting at ops[start] for an input
+   of w x h, returning the index of the first op not in the run. Crops
+   which would be empty end the run, to be run as they are. */
+static int plan_ops(struct IMAGICK_OP *ops,int start,int n,
+		    size_t w,size_t h,struct LAZY_PLAN *plan)
+{
+  plan->cx = plan->cy = 0;
+  plan->cw = w; plan->ch = h;
+  plan->ow = w; plan->oh = h;
+  plan->resized = plan->flip = plan->flop = plan->strip = 0;
+  plan->filter = default_filter;
+  plan->mode = resize_mode;
+  plan->blur = 1.0;
+  int i = start;
+  while (i < n) {
+    struct IMAGICK_OP *op = &(ops[i]);
+    switch (op->type) {
+    case fit_op: case resize_op: {
+      size_t nw, nh;
+      if (op->type == fit_op)
+	fit_dimensions(plan->ow,plan->oh,(size_t)op->args[0],
+		       (size_t)op->args[1],&nw,&nh);
+      else if ( (op->args[0] < 1) || (op->args[1] < 1) ) return i;
+      else {
+	nw = (size_t)op->args[0];
+	nh = (size_t)op->args[1];}
+      plan->ow = nw; plan->oh = nh;
+      plan->resized = 1;
+      plan->filter = op->filter;
+      plan->mode = op->mode;
+      plan->blur = (op->args[2]) ? (op->args[2]) : (1.0);
+      break;}
+    case crop_op: {
+      double x = op->args[2], y = op->args[3];
+      double cw = op->args[0], ch = op->args[1];
+      if (cw <= 0) cw = plan->ow-x;
+      if (ch <= 0) ch = plan->oh-y;
+      if (x < 0) {cw += x; x = 0;}
+      if (y < 0) {ch += y; y = 0;}
+      if (x+cw > plan->ow) cw = plan->ow-x;
+      if (y+ch > plan->oh) ch = plan->oh-y;
+      if ( (cw < 1) || (ch < 1) ) return i;
+      /* Undo the pending mirrors, then the pending resize */
+      if (plan->flop) x = plan->ow-(x+cw);
+      if (plan->flip) y = plan->oh-(y+ch);
+      double kx = plan->cw/plan->ow, ky = plan->ch/plan->oh;
+      plan->cx += x*kx; plan->cy += y*ky;
+      plan->cw = cw*kx; plan->ch = ch*ky;
+      plan->ow = (size_t)cw; plan->oh = (size_t)ch;
+      break;}
+    case flip_op:
+      plan->flip = !(plan->flip); break;
+    case flop_op:
+      plan->flop = !(plan->flop); break;
+    case strip_op:
+      plan->strip = 1; break;
+    default:
+      return i;}
+    i++;}
+  return i;
+}
+
+/* Runs plan on the current image of wand, which is the planned input
+   of w x h, possibly decoded at a smaller scale */
+static MagickBooleanType run_plan(MagickWand *wand,struct LAZY_PLAN *plan,
+				  size_t w,size_t h)
+{
+  size_t iw = MagickGetImageWidth(wand), ih = MagickGetImageHeight(wand);
+  double rx = ((double)iw)/w, ry = ((double)ih)/h;
+  ssize_t x = (ssize_t)floor(plan->cx*rx+0.5);
+  ssize_t y = (ssize_t)floor(plan->cy*ry+0.5);
+  size_t cw = (size_t)floor(plan->cw*rx+0.5);
+  size_t ch = (size_t)floor(plan->ch*ry+0.5);
+  if (cw < 1) cw = 1;
+  if (ch < 1) ch = 1;
+  if (x+cw > iw) x = iw-cw;
+  if (y+ch > ih) y = ih-ch;
+  if ( (x != 0) || (y != 0) || (cw != iw) || (ch != ih) ) {
+    if ( (MagickCropImage(wand,cw,ch,x,y) == MagickFalse) ||
+	 (MagickSetImagePage(wand,cw,ch,0,0) == MagickFalse) )
+      return MagickFalse;}
+  if ( (plan->ow != cw) || (plan->oh != ch) ) {
+    if (resize_wand(wand,plan->ow,plan->oh,plan->mode,plan->filter,
+		    plan->blur) == MagickFalse)
+      return MagickFalse;}
+  if ( (plan->flip) && (plan->flop) ) {
+    PixelWand *background = NewPixelWand();
+    MagickBooleanType ok = MagickRotateImage(wand,background,180);
+    DestroyPixelWand(background);
+    if (ok == MagickFalse) return ok;}
+  else if ( (plan->flip) && (MagickFlipImage(wand) == MagickFalse) )
+    return MagickFalse;
+  else if ( (plan->flop) && (MagickFlopImage(wand) == MagickFalse) )
+    return MagickFalse;
+  if ( (plan->strip) && (MagickStripImage(wand) == MagickFalse) )
+    return MagickFalse;
+  return MagickTrue;
+}
+
+/* Applies ops to the current image of wand, planning each run of
+   geometric ops. The first run is planned for an input of w x h (the
+   undecimated size) when w is non-zero. */
+static MagickBooleanType run_lazy_ops(MagickWand *wand,
+				      struct IMAGICK_OP *ops,int n,
+				      size_t w,size_t h)
+{
+  int i = 0;
+  while (i < n) {
+    struct LAZY_PLAN plan;
+    size_t iw = (w) ? (w) : (MagickGetImageWidth(wand));
+    size_t ih = (h) ? (h) : (MagickGetImageHeight(wand));
+    int end = plan_ops(ops,i,n,iw,ih,&plan);
+    w = h = 0;
+    if (end > i) {
+      if (run_plan(wand,&plan,iw,ih) == MagickFalse) return MagickFalse;
+      i = end;}
+    else if (apply_op(wand,&(ops[i++])) == MagickFalse)
+      return MagickFalse;}
+  return MagickTrue;
+}
+
+/* Returns the jpeg:size hint for decoding the source of lazy before
+   running ops, or 0 if it shouldn't be decimated. *w and *h are set
+   to its full size. */
+static int lazy_decode_hint(struct KNO_IMAGICK_LAZY *lazy,
+			    struct IMAGICK_OP *ops,int n_ops,char *buf,
+			    size_t len,size_t *w,size_t *h)
+{
+  if ( (n_ops == 0) ||
+       (kno_testopt(lazy->opts,autoorient_symbol,KNO_VOID)) ||
+       (kno_testopt(lazy->opts,frames_symbol,KNO_VOID)) )
+    return 0;
+  MagickWand *ping = NewMagickWand();
+  MagickBooleanType ok = (KNO_PACKETP(lazy->source)) ?
+    (MagickPingImageBlob(ping,KNO_PACKET_DATA(lazy->source),
+			 KNO_PACKET_LENGTH(lazy->source))) :
+    (MagickPingImage(ping,KNO_CSTRING(lazy->source)));
+  int rv = 0;
+  if ( (ok) && (MagickGetNumberImages(ping) == 1) ) {
+    MagickResetIterator(ping);
+    MagickNextImage(ping);
+    char *fmt = MagickGetImageFormat(ping);
+    *w = MagickGetImageWidth(ping);
+    *h = MagickGetImageHeight(ping);
+    struct LAZY_PLAN plan;
+    if ( (fmt) &&
+	 ( (strcasecmp(fmt,"JPEG") == 0) || (strcasecmp(fmt,"JPG") == 0) ) &&
+	 (plan_ops(ops,0,n_ops,*w,*h,&plan) > 0) &&
+	 (plan.resized) ) {
+      /* The smallest whole image from which the crop still has
+	 enough pixels for the resize */
+      size_t hw = (size_t)ceil((*w)*(plan.ow/plan.cw));
+      size_t hh = (size_t)ceil((*h)*(plan.oh/plan.ch));
+      if ( (hw < *w) && (hh < *h) ) {
+	snprintf(buf,len,"%lux%lu",(unsigned long)hw,(unsigned long)hh);
+	rv = 1;}}
+    if (fmt) MagickRelinquishMemory(fmt);}
+  else MagickClearException(ping);
+  DestroyMagickWand(ping);
+  return rv;
+}
+
+/* Decodes (or copies) the source of lazyref and runs its ops,
+   returning an imagick object */
+static lispval lazy_realize(lispval lazyref,u8_context cxt)
+{
+  long long started = metrics_start();
+  struct KNO_IMAGICK_LAZY *lazy=
+    kno_consptr(struct KNO_IMAGICK_LAZY *,lazyref,kno_imagick_lazy_type);
+  struct KNO_IMAGICK *wrapper;
+  struct IMAGICK_OP *ops = NULL;
+  int n_ops = lazy_ops_copy(lazy,&ops);
+  size_t w = 0, h = 0;
+  if (KNO_TYPEP(lazy->source,kno_imagick_type))
+    wrapper = (struct KNO_IMAGICK *)imagick2imagick(lazy->source);
+  else {
+    char hint[64], selector[128];
+    int hinted = lazy_decode_hint(lazy,ops,n_ops,hint,sizeof(hint),&w,&h);
+    int selected = frame_selector(lazy->opts,selector+1,sizeof(selector)-2,
+				  cxt);
+    if (selected < 0) {
+      u8_free(ops);
+      return IMAGICK_DONE(IM_REALIZE,KNO_ERROR_VALUE,0,0,0);}
+    wrapper = imagick_alloc();
+    MagickWand *wand = wrapper->wand;
+    MagickBooleanType ok;
+    if (hinted) MagickSetOption(wand,"jpeg:size",hint);
+    if (KNO_PACKETP(lazy->source)) {
+      if (selected) {
+	selector[0] = '[';
+	strcat(selector,"]");
+	MagickSetFilename(wand,selector);}
+      ok = MagickReadImageBlob(wand,KNO_PACKET_DATA(lazy->source),
+			       KNO_PACKET_LENGTH(lazy->source));}
+    else if (selected) {
+      u8_string path = u8_mkstring("%s[%s]",KNO_CSTRING(lazy->source),
+				   selector+1);
+      ok = MagickReadImage(wand,path);
+      u8_free(path);}
+    else ok = MagickReadImage(wand,KNO_CSTRING(lazy->source));
+    if (hinted) MagickDeleteOption(wand,"jpeg:size");
+    else w = h = 0;
+    if (ok == MagickFalse) {
+      grabmagickerr(cxt,wand);
+      imagick_release(wrapper);
+      u8_free(ops);
+      return IMAGICK_DONE(IM_REALIZE,KNO_ERROR_VALUE,0,0,0);}
+    if (imagick_decode_opts(wand,lazy->opts,cxt) < 0) {
+      imagick_release(wrapper);
+      u8_free(ops);
+      return IMAGICK_DONE(IM_REALIZE,KNO_ERROR_VALUE,0,0,0);}
+    imagick_account(wrapper);
+    if (imagick_check_limit(cxt) < 0) {
+      imagick_release(wrapper);
+      u8_free(ops);
+      return IMAGICK_DONE(IM_REALIZE,KNO_ERROR_VALUE,0,0,0);}}
+  if (n_ops) {
+    MagickWand *wand = wrapper->wand;
+    MagickResetIterator(wand);
+    while (MagickNextImage(wand) != MagickFalse) {
+      if (run_lazy_ops(wand,ops,n_ops,w,h) == MagickFalse) {
+	grabmagickerr(cxt,wand);
+	kno_decref((lispval)wrapper);
+	u8_free(ops);
+	return IMAGICK_DONE(IM_REALIZE,KNO_ERROR_VALUE,0,0,0);}}
+    MagickResetIterator(wand);
+    imagick_account(wrapper);}
+  u8_free(ops);
+  U8_CLEAR_ERRNO();
+  return IMAGICK_DONE(IM_REALIZE,(lispval)wrapper,
+		      (KNO_PACKETP(lazy->source)) ?
+		      (KNO_PACKET_LENGTH(lazy->source)) : (0),
+		      0,wand_pixels(wrapper->wand));
+}
+
+DEFC_PRIM("imagick/lazy",imagick_lazy,
+	  KNO_MAX_ARGS(2)|KNO_MIN_ARGS(1),
+	  "Returns an imagick-lazy object for *source* (a packet, a "
+	  "filename or an imagick object). The ops applied to it by "
+	  "`imagick/fit`, `imagick/crop`, `imagick/flip`, `imagick/flop` "
+	  "and `imagick/apply` are recorded and only run, after being "
+	  "optimized, when it is passed to `imagick/realize`, "
+	  "`imagick->packet` or `imagick->file`. *opts* takes the "
+	  "decoding options of `file->imagick`.",
+	  {"source",kno_any_type,KNO_VOID},
+	  {"opts",kno_any_type,KNO_VOID})
+static lispval imagick_lazy(lispval source,lispval opts)
+{
+  long long started = metrics_start();
+  if (!( (KNO_PACKETP(source)) || (KNO_STRINGP(source)) ||
+	 (KNO_TYPEP(source,kno_imagick_type)) )) {
+    kno_type_error("image source","imagick_lazy",source);
+    return IMAGICK_DONE(IM_LAZY,KNO_ERROR_VALUE,0,0,0);}
+  struct KNO_IMAGICK_LAZY *lazy = u8_alloc(struct KNO_IMAGICK_LAZY);
+  KNO_INIT_FRESH_CONS(lazy,kno_imagick_lazy_type);
+  lazy->source = kno_incref(source);
+  lazy->opts = kno_incref(opts);
+  u8_init_mutex(&(lazy->lock));
+  lazy->ops = NULL;
+  lazy->n_ops = lazy->max_ops = 0;
+  return IMAGICK_DONE(IM_LAZY,(lispval)lazy,0,0,0);
+}
+
+DEFC_PRIM("imagick/realize",imagick_realize,
+	  KNO_MAX_ARGS(1)|KNO_MIN_ARGS(1),
+	  "Runs the ops recorded by the imagick-lazy object *lazy*, "
+	  "returning an imagick object. The lazy object itself is "
+	  "unchanged and can be realized again.",
+	  {"lazy",KNO_IMAGICK_LAZY_TYPE,KNO_VOID})
+static lispval imagick_realize(lispval lazy)
+{
+  return lazy_realize(lazy,"imagick_realize");
+}
+
+/* Frames */
+
+DEFC_PRIM("imagick/frame-count",imagick_frame_count,
+	  KNO_MAX_ARGS(1)|KNO_MIN_ARGS(1),
+	  "Returns the number of frames (or pages) in *imagickref*",
+	  {"imagickref",KNO_IMAGICK_TYPE,KNO_VOID})
+static lispval imagick_frame_count(lispval imagickref)
+{
+  struct KNO_IMAGICK *wrapper=
+    kno_consptr(struct KNO_IMAGICK *,imagickref,kno_imagick_type);
+  return KNO_INT(MagickGetNumberImages(wrapper->wand));
+}
+
+DEFC_PRIM("imagick/frame",imagick_frame,
+	  KNO_MAX_ARGS(2)|KNO_MIN_ARGS(2),
+	  "Returns a new imagick object containing just frame *n* "
+	  "of *imagickref*, so that the frames of a multi-page "
+	  "image can be processed one at a time.",
+	  {"imagickref",KNO_IMAGICK_TYPE,KNO_VOID},
+	  {"n",kno_fixnum_type,KNO_VOID})
+static lispval imagick_frame(lispval imagickref,lispval n)
+{
+  struct KNO_IMAGICK *wrapper=
+    kno_consptr(struct KNO_IMAGICK *,imagickref,kno_imagick_type);
+  MagickWand *wand = wrapper->wand;
+  if (!( (KNO_UINTP(n)) &&
+	 (KNO_FIX2INT(n) < MagickGetNumberImages(wand)) ))
+    return kno_err(kno_RangeError,"imagick_frame",NULL,n);
+  ssize_t current = MagickGetIteratorIndex(wand);
+  MagickSetIteratorIndex(wand,KNO_FIX2INT(n));
+  MagickWand *frame = MagickGetImage(wand);
+  MagickSetIteratorIndex(wand,current);
+  if (frame == NULL) {
+    grabmagickerr("imagick_frame",wand);
+    return KNO_ERROR_VALUE;}
+  U8_CLEAR_ERRNO();
+  return make_imagick(frame);
+}
+
+struct FRAME_TASKS {
+  MagickWand **frames;
+  char **errmsgs;
+  struct IMAGICK_OP *ops;
+  int n_ops;};
+
+static void apply_frame_ops(void *data,int i)
+{
+  struct FRAME_TASKS *tasks = (struct FRAME_TASKS *)data;
+  if (apply_ops(tasks->frames[i],tasks->ops,tasks->n_ops) == MagickFalse)
+    tasks->errmsgs[i] = copymagickerr(tasks->frames[i]);
+}
+
+DEFC_PRIM("imagick/apply",imagick_apply,
+	  KNO_MAX_ARGS(3)|KNO_MIN_ARGS(2),
+	  "Applies the operations in the list *ops* to every frame of "
+	  "*imagickref*, processing up to *threads* frames in parallel. "
+	  "Each op is a list starting with one of `fit`, `resize` (both "
+	  "*width* *height* and optional *blur*, *filter* and *mode*), "
+	  "`crop` (*width* *height* *x* *y*), `flip`, `flop`, `rotate` "
+	  "(*degrees*), `blur` (*radius* *sigma*), `equalize`, "
+	  "`despeckle`, `enhance`, `autoorient` or `strip`. If "
+	  "*imagickref* is an imagick-lazy object, the ops are recorded.",
+	  {"imagickref",kno_any_type,KNO_VOID},
+	  {"ops",kno_any_type,KNO_VOID},
+	  {"threads",kno_fixnum_type,KNO_VOID})
+static lispval imagick_apply(lispval imagickref,lispval ops,lispval threads)
+{
+  long long started = metrics_start();
+  if (!( (KNO_TYPEP(imagickref,kno_imagick_type)) ||
+	 (KNO_TYPEP(imagickref,kno_imagick_lazy_type)) )) {
+    kno_type_error("imagick","imagick_apply",imagickref);
+    return IMAGICK_DONE(IM_APPLY,KNO_ERROR_VALUE,0,0,0);}
+  int n_ops = 0;
+  struct IMAGICK_OP *parsed = parse_ops(ops,&n_ops,"imagick_apply");
+  if (parsed == NULL) return IMAGICK_DONE(IM_APPLY,KNO_ERROR_VALUE,0,0,0);
+  if (KNO_TYPEP(imagickref,kno_imagick_lazy_type)) {
+    lazy_append((struct KNO_IMAGICK_LAZY *)imagickref,parsed,n_ops);
+    u8_free(parsed);
+    return kno_incref(imagickref);}
+  struct KNO_IMAGICK *wrapper=
+    kno_consptr(struct KNO_IMAGICK *,imagickref,kno_imagick_type);
+  int n_threads = (KNO_UINTP(threads)) ? (KNO_FIX2INT(threads)) :
+    (imagick_threads);
+  MagickWand *wand = wrapper->wand;
+  size_t n_frames = MagickGetNumberImages(wand);
+  if ( (n_frames <= 1) || (n_threads <= 1) ) {
+    /* Work through the frames in place */
+    MagickResetIterator(wand);
+    while (MagickNextImage(wand) != MagickFalse) {
+      if (apply_ops(wand,parsed,n_ops) == MagickFalse) {
+	grabmagickerr("imagick_apply",wand);
+	u8_free(parsed);
+	imagick_account(wrapper);
+	return IMAGICK_DONE(IM_APPLY,KNO_ERROR_VALUE,0,0,0);}}
+    MagickResetIterator(wand);}
+  else {
+    /* Split the frames into separate wands, process them in
+       parallel and then reassemble them in order */
+    struct FRAME_TASKS tasks;
+    tasks.frames = u8_alloc_n(n_frames,MagickWand *);
+    tasks.errmsgs = u8_alloc_n(n_frames,char *);
+    tasks.ops = parsed;
+    tasks.n_ops = n_ops;
+    size_t i = 0; while (i < n_frames) {
+      MagickSetIteratorIndex(wand,i);
+      tasks.frames[i] = MagickGetImage(wand);
+      tasks.errmsgs[i] = NULL;
+      i++;}
+    imagick_parallel(n_frames,n_threads,apply_frame_ops,&tasks);
+    char *errmsg = NULL;
+    i = 0; while (i < n_frames) {
+      if (tasks.errmsgs[i]) {
+	if (errmsg) u8_free(tasks.errmsgs[i]);
+	else errmsg = tasks.errmsgs[i];}
+      i++;}
+    if (errmsg == NULL) {
+      /* Replace the frames of the original wand, so that it keeps
+	 its own settings (format, encoder options and so on) */
+      MagickResetIterator(wand);
+      while ( (MagickGetNumberImages(wand) > 0) &&
+	      (MagickRemoveImage(wand) != MagickFalse) ) {}
+      i = 0; while (i < n_frames)
+	MagickAddImage(wand,tasks.frames[i++]);
+      MagickResetIterator(wand);}
+    i = 0; while (i < n_frames)
+      DestroyMagickWand(tasks.frames[i++]);
+    u8_free(tasks.frames);
+    u8_free(tasks.errmsgs);
+    if (errmsg) {
+      u8_free(parsed);
+      u8_seterr(MagickWandError,"imagick_apply",errmsg);
+      return IMAGICK_DONE(IM_APPLY,KNO_ERROR_VALUE,0,0,0);}}
+  u8_free(parsed);
+  imagick_account(wrapper);
+  U8_CLEAR_ERRNO();
+  return IMAGICK_DONE(IM_APPLY,kno_incref(imagickref),
+		      0,0,wand_pixels(wand));
+}
+
+/* Renditions */
+
+struct RENDITION {
+  lispval key;
+  size_t width, height;
+  FilterTypes filter;
+  enum RESIZE_MODE mode;
+  u8_string format;
+  lispval opts; /* Borrowed from the spec */
+  MagickWand *wand;
+  /* A copy of wand carrying the encoder opts, so that they aren't
+     inherited by the smaller renditions derived from wand */
+  MagickWand *encoder;
+  unsigned char *data;
+  size_t n_bytes;
+  char *errmsg;};
+
+static void encode_rendition(void *data,int i)
+{
+  struct RENDITION *r = ((struct RENDITION *)data)+i;
+  MagickWand *wand = (r->encoder) ? (r->encoder) : (r->wand);
+  r->data = MagickGetImageBlob(wand,&(r->n_bytes));
+  if (r->data == NULL) r->errmsg = copymagickerr(wand);
+}
+
+static int parse_rendition(lispval spec,struct RENDITION *r)
+{
+  lispval key = KNO_VOID;
+  size_t w = 0, h = 0;
+  memset(r,0,sizeof(struct RENDITION));
+  r->opts = KNO_VOID;
+  r->filter = default_filter;
+  if (KNO_PAIRP(spec)) {
+    lispval w_arg = KNO_CAR(spec), h_arg = KNO_CDR(spec);
+    if ( (KNO_UINTP(w_arg)) && (KNO_UINTP(h_arg)) ) {
+      w = KNO_FIX2INT(w_arg); h = KNO_FIX2INT(h_arg);}
+    key = kno_incref(spec);}
+  else if (KNO_TABLEP(spec)) {
+    lispval w_arg = kno_getopt(spec,width,KNO_VOID);
+    lispval h_arg = kno_getopt(spec,height,KNO_VOID);
+    lispval format_arg = kno_getopt(spec,format,KNO_VOID);
+    lispval filter_arg = kno_getopt(spec,filter_symbol,KNO_VOID);
+    lispval mode_arg = kno_getopt(spec,mode_symbol,KNO_VOID);
+    if ( (KNO_UINTP(w_arg)) && (KNO_UINTP(h_arg)) ) {
+      w = KNO_FIX2INT(w_arg); h = KNO_FIX2INT(h_arg);}
+    if (KNO_STRINGP(format_arg))
+      r->format = u8_strdup(KNO_CSTRING(format_arg));
+    else if (KNO_SYMBOLP(format_arg))
+      r->format = u8_strdup(KNO_SYMBOL_NAME(format_arg));
+    r->filter = getfilter(filter_arg,"imagick_renditions");
+    int mode = getresizemode(mode_arg,"imagick_renditions");
+    kno_decref(w_arg); kno_decref(h_arg);
+    kno_decref(format_arg); kno_decref(filter_arg); kno_decref(mode_arg);
+    if (mode < 0) {
+      if (r->format) u8_free(r->format);
+      return -1;}
+    r->mode = mode;
+    r->opts = spec;
+    key = kno_getopt(spec,name_symbol,KNO_VOID);
+    if (KNO_VOIDP(key)) key = kno_incref(spec);}
+  if ( (w == 0) || (h == 0) ) {
+    kno_decref(key);
+    if (r->format) u8_free(r->format);
+    kno_type_error("rendition size","imagick_renditions",spec);
+    return -1;}
+  r->key = key;
+  r->width = w;
+  r->height = h;
+  return 1;
+}
+
+static void free_renditions(struct RENDITION *renditions,int n)
+{
+  int i = 0; while (i < n) {
+    struct RENDITION *r = &(renditions[i++]);
+    if (r->wand) DestroyMagickWand(r->wand);
+    if (r->encoder) DestroyMagickWand(r->encoder);
+    if (r->data) MagickRelinquishMemory(r->data);
+    if (r->format) u8_free(r->format);
+    if (r->errmsg) u8_free(r->errmsg);
+    kno_decref(r->key);}
+  u8_free(renditions);
+}
+
+static int compare_renditions(const void *v1,const void *v2)
+{
+  const struct RENDITION *r1 = v1, *r2 = v2;
+  size_t a1 = r1->width*r1->height, a2 = r2->width*r2->height;
+  if (a1 > a2) return -1;
+  else if (a1 < a2) return 1;
+  else return 0;
+}
+
+DEFC_PRIM("imagick/renditions",imagick_renditions,
+	  KNO_MAX_ARGS(3)|KNO_MIN_ARGS(2),
+	  "Generates several resized encodings of the current image "
+	  "of *imagickref*, returning a table of packets. Each of *specs* "
+	  "is either a (*width* . *height*) pair or a table with "
+	  "`width`, `height` and optional `format`, `filter`, `mode` "
+	  "(as for `imagick/fit`), `name` and encoder settings (as for "
+	  "`imagick->file`); the result is keyed by `name` or by the spec itself. "
+	  "Each rendition is derived from the next larger one and the "
+	  "encodings run on up to *threads* threads.",
+	  {"imagickref",KNO_IMAGICK_TYPE,KNO_VOID},
+	  {"specs",kno_any_type,KNO_VOID},
+	  {"threads",kno_fixnum_type,KNO_VOID})
+static lispval imagick_renditions(lispval imagickref,lispval specs,
+				  lispval threads)
+{
+  long long started = metrics_start();
+  struct KNO_IMAGICK *wrapper=
+    kno_consptr(struct KNO_IMAGICK *,imagickref,kno_imagick_type);
+  int n_threads = (KNO_UINTP(threads)) ? (KNO_FIX2INT(threads)) :
+    (imagick_threads);
+  int n = 0, i = 0;
+  struct RENDITION *renditions;
+  if (KNO_VECTORP(specs)) {
+    int len = KNO_VECTOR_LENGTH(specs);
+    renditions = u8_alloc_n(len,struct RENDITION);
+    while (i < len) {
+      if (parse_rendition(KNO_VECTOR_REF(specs,i),&(renditions[n])) < 0) {
+	free_renditions(renditions,n);
+	return IMAGICK_DONE(IM_RENDITIONS,KNO_ERROR_VALUE,0,0,0);}
+      n++; i++;}}
+  else if ( (KNO_PAIRP(specs)) || (KNO_NILP(specs)) ) {
+    int len = 0;
+    {KNO_DOLIST(spec,specs) len++;}
+    renditions = u8_alloc_n(len,struct RENDITION);
+    {KNO_DOLIST(spec,specs) {
+	if (parse_rendition(spec,&(renditions[n])) < 0) {
+	  free_renditions(renditions,n);
+	  return IMAGICK_DONE(IM_RENDITIONS,KNO_ERROR_VALUE,0,0,0);}
+	n++;}}}
+  else {
+    kno_type_error("rendition specs","imagick_renditions",specs);
+    return IMAGICK_DONE(IM_RENDITIONS,KNO_ERROR_VALUE,0,0,0);}
+
+  MagickWand *base = MagickGetImage(wrapper->wand);
+  if (base == NULL) {
+    grabmagickerr("imagick_renditions",wrapper->wand);
+    free_renditions(renditions,n);
+    return IMAGICK_DONE(IM_RENDITIONS,KNO_ERROR_VALUE,0,0,0);}
+  size_t iwidth = MagickGetImageWidth(base);
+  size_t iheight = MagickGetImageHeight(base);
+  char *base_format = MagickGetImageFormat(base);
+  i = 0; while (i < n) {
+    struct RENDITION *r = &(renditions[i++]);
+    fit_dimensions(iwidth,iheight,r->width,r->height,
+		   &(r->width),&(r->height));}
+  qsort(renditions,n,sizeof(struct RENDITION),compare_renditions);
+
+  /* Each rendition is resized from the next larger one */
+  MagickWand *prev = base;
+  i = 0; while (i < n) {
+    struct RENDITION *r = &(renditions[i]);
+    MagickWand *source = prev;
+    if ( (MagickGetImageWidth(prev) < r->width) ||
+	 (MagickGetImageHeight(prev) < r->height) )
+      source = base;
+    r->wand = CloneMagickWand(source);
+    if ( (resize_wand(r->wand,r->width,r->height,r->mode,r->filter,1.0)
+	  == MagickFalse) ||
+	 (MagickSetImageFormat
+	  (r->wand,((r->format)?(r->format):(base_format))) == MagickFalse) ) {
+      grabmagickerr("imagick_renditions",r->wand);
+      MagickRelinquishMemory(base_format);
+      DestroyMagickWand(base);
+      free_renditions(renditions,n);
+      return IMAGICK_DONE(IM_RENDITIONS,KNO_ERROR_VALUE,0,0,0);}
+    if (KNO_TABLEP(r->opts)) {
+      r->encoder = CloneMagickWand(r->wand);
+      if (imagick_encode_opts(r->encoder,r->opts,"imagick_renditions") < 0) {
+	MagickRelinquishMemory(base_format);
+	DestroyMagickWand(base);
+	free_renditions(renditions,n);
+	return IMAGICK_DONE(IM_RENDITIONS,KNO_ERROR_VALUE,0,0,0);}}
+    prev = r->wand;
+    i++;}
+  MagickRelinquishMemory(base_format);
+  DestroyMagickWand(base);
+
+  imagick_parallel(n,n_threads,encode_rendition,renditions);
+
+  lispval result = kno_make_hashtable(NULL,n*2);
+  i = 0; while (i < n) {
+    struct RENDITION *r = &(renditions[i++]);
+    if (r->data == NULL) {
+      u8_seterr(MagickWandError,"imagick_renditions",r->errmsg);
+      r->errmsg = NULL;
+      kno_decref(result);
+      free_renditions(renditions,n);
+      return IMAGICK_DONE(IM_RENDITIONS,KNO_ERROR_VALUE,0,0,0);}
+    lispval packet = kno_make_packet(NULL,r->n_bytes,r->data);
+    kno_store(result,r->key,packet);
+    kno_decref(packet);}
+  free_renditions(renditions,n);
+  U8_CLEAR_ERRNO();
+  return IMAGICK_DONE(IM_RENDITIONS,result,0,0,0);
+}
+
+/* Encoding to a size budget */
+
+static lispval minquality_symbol, maxquality_symbol, tolerance_symbol;
+static lispval threads_symbol, packet_symbol, bytes_symbol, trials_symbol;
+
+struct QUALITY_TRIAL {
+  MagickWand *wand;
+  size_t quality;
+  unsigned char *data;
+  size_t n_bytes;
+  char *errmsg;};
+
+static void set_wand_quality(MagickWand *wand,size_t quality)
+{
+  MagickSetCompressionQuality(wand,quality);
+  MagickResetIterator(wand);
+  while (MagickNextImage(wand) != MagickFalse)
+    MagickSetImageCompressionQuality(wand,quality);
+  MagickResetIterator(wand);
+}
+
+static void run_quality_trial(void *data,int i)
+{
+  struct QUALITY_TRIAL *t = ((struct QUALITY_TRIAL *)data)+i;
+  if (t->data) {
+    MagickRelinquishMemory(t->data);
+    t->data = NULL;}
+  set_wand_quality(t->wand,t->quality);
+  t->data = MagickGetImageBlob(t->wand,&(t->n_bytes));
+  if (t->data == NULL) t->errmsg = copymagickerr(t->wand);
+}
+
+static void free_quality_trials(struct QUALITY_TRIAL *trials,int n)
+{
+  int i = 0; while (i < n) {
+    struct QUALITY_TRIAL *t = &(trials[i++]);
+    if (t->wand) DestroyMagickWand(t->wand);
+    if (t->data) MagickRelinquishMemory(t->data);
+    if (t->errmsg) u8_free(t->errmsg);}
+  u8_free(trials);
+}
+
+static int getquality(lispval opts,lispval sym,int dflt,u8_context cxt)
+{
+  lispval v = kno_getopt(opts,sym,KNO_VOID);
+  if (KNO_VOIDP(v)) return dflt;
+  else if ( (KNO_UINTP(v)) && (KNO_FIX2INT(v) >= 1) &&
+	    (KNO_FIX2INT(v) <= 100) )
+    return KNO_FIX2INT(v);
+  kno_type_error("quality (1-100)",cxt,v);
+  kno_decref(v);
+  return -1;
+}
+
+DEFC_PRIM("imagick/encode-to-size",imagick_encode_to_size,
+	  KNO_MAX_ARGS(3)|KNO_MIN_ARGS(2),
+	  "Encodes *imagickref* at the highest quality whose output "
+	  "fits in *maxbytes*, searching between the `minquality` and "
+	  "`maxquality` *opts* (default 5 and 95), signalling a range "
+	  "error if `minquality` is above `maxquality`. The search stops "
+	  "early once a result is within `tolerance` (default 0.05) of "
+	  "the budget. With `threads` > 1, that many trial encodings run "
+	  "in parallel each round. *opts* may also give a `format` and "
+	  "the encoder settings of `imagick->file`. Returns a table "
+	  "with `packet`, `quality`, `bytes` and `trials`, or #f if "
+	  "even the lowest quality doesn't fit.",
+	  {"imagickref",KNO_IMAGICK_TYPE,KNO_VOID},
+	  {"maxbytes",kno_fixnum_type,KNO_VOID},
+	  {"opts",kno_any_type,KNO_VOID})
+static lispval imagick_encode_to_size(lispval imagickref,lispval maxbytes,
+				      lispval opts)
+{
+  long long started = metrics_start();
+  struct KNO_IMAGICK *wrapper=
+    kno_consptr(struct KNO_IMAGICK *,imagickref,kno_imagick_type);
+  if (!( (KNO_UINTP(maxbytes)) && (KNO_FIX2INT(maxbytes) > 0) )) {
+    kno_type_error("byte budget","imagick_encode_to_size",maxbytes);
+    return IMAGICK_DONE(IM_ENCODE_TO_SIZE,KNO_ERROR_VALUE,0,0,0);}
+  size_t budget = KNO_FIX2INT(maxbytes);
+  int lo = getquality(opts,minquality_symbol,5,"imagick_encode_to_size");
+  if (lo < 0) return IMAGICK_DONE(IM_ENCODE_TO_SIZE,KNO_ERROR_VALUE,0,0,0);
+  int hi = getquality(opts,maxquality_symbol,95,"imagick_encode_to_size");
+  if (hi < 0) return IMAGICK_DONE(IM_ENCODE_TO_SIZE,KNO_ERROR_VALUE,0,0,0);
+  if (lo > hi) {
+    u8_seterr(kno_RangeError,"imagick_encode_to_size",
+	      u8_mkstring("minquality %d > maxquality %d",lo,hi));
+    return IMAGICK_DONE(IM_ENCODE_TO_SIZE,KNO_ERROR_VALUE,0,0,0);}
+  lispval tolerance_arg = kno_getopt(opts,tolerance_symbol,KNO_VOID);
+  double tolerance = (KNO_FLONUMP(tolerance_arg)) ?
+    (KNO_FLONUM(tolerance_arg)) : (0.05);
+  kno_decref(tolerance_arg);
+  lispval threads_arg = kno_getopt(opts,threads_symbol,KNO_VOID);
+  int n_slots = (KNO_UINTP(threads_arg)) ? (KNO_FIX2INT(threads_arg)) : (1);
+  if (n_slots < 1) n_slots = 1;
+  else if (n_slots > imagick_threads) n_slots = imagick_threads;
+  if (n_slots > (hi-lo+1)) n_slots = hi-lo+1;
+  if (n_slots < 1) n_slots = 1;
+
+  MagickWand *work = CloneMagickWand(wrapper->wand);
+  lispval format_arg = kno_getopt(opts,format,KNO_VOID);
+  if ( (KNO_STRINGP(format_arg)) &&
+       (MagickSetImageFormat(work,KNO_CSTRING(format_arg)) == MagickFalse) ) {
+    grabmagickerr("imagick_encode_to_size",work);
+    kno_decref(format_arg);
+    DestroyMagickWand(work);
+    return IMAGICK_DONE(IM_ENCODE_TO_SIZE,KNO_ERROR_VALUE,0,0,0);}
+  kno_decref(format_arg);
+  if (imagick_encode_opts(work,opts,"imagick_encode_to_size") < 0) {
+    DestroyMagickWand(work);
+    return IMAGICK_DONE(IM_ENCODE_TO_SIZE,KNO_ERROR_VALUE,0,0,0);}
+
+  struct QUALITY_TRIAL *trials = u8_alloc_n(n_slots,struct QUALITY_TRIAL);
+  memset(trials,0,sizeof(struct QUALITY_TRIAL)*n_slots);
+  int i = 0; while (i < n_slots) {
+    trials[i].wand = (i == 0) ? (work) : (CloneMagickWand(work));
+    i++;}
+
+  unsigned char *best = NULL;
+  size_t best_bytes = 0, best_quality = 0;
+  int n_trials = 0;
+  while (lo <= hi) {
+    int span = hi-lo+1, n = (n_slots < span) ? (n_slots) : (span);
+    /* Spread the trials evenly through [lo,hi] */
+    i = 0; while (i < n) {
+      trials[i].quality = lo+(((i+1)*span)/(n+1));
+      i++;}
+    imagick_parallel(n,n,run_quality_trial,trials);
+    n_trials += n;
+    int fit = -1;
+    i = 0; while (i < n) {
+      struct QUALITY_TRIAL *t = &(trials[i]);
+      if (t->data == NULL) {
+	u8_seterr(MagickWandError,"imagick_encode_to_size",t->errmsg);
+	t->errmsg = NULL;
+	if (best) MagickRelinquishMemory(best);
+	free_quality_trials(trials,n_slots);
+	return IMAGICK_DONE(IM_ENCODE_TO_SIZE,KNO_ERROR_VALUE,0,0,0);}
+      if (t->n_bytes <= budget) fit = i;
+      i++;}
+    if (fit >= 0) {
+      struct QUALITY_TRIAL *t = &(trials[fit]);
+      if (best) MagickRelinquishMemory(best);
+      best = t->data; t->data = NULL;
+      best_bytes = t->n_bytes;
+      best_quality = t->quality;
+      lo = t->quality+1;}
+    if (fit+1 < n) hi = trials[fit+1].quality-1;
+    if ( (best) && (best_bytes >= (budget*(1-tolerance))) ) break;}
+  free_quality_trials(trials,n_slots);
+
+  if (best == NULL)
+    return IMAGICK_DONE(IM_ENCODE_TO_SIZE,KNO_FALSE,0,0,0);
+  lispval result = kno_empty_slotmap();
+  lispval packet = kno_make_packet(NULL,best_bytes,best);
+  MagickRelinquishMemory(best);
+  kno_store(result,packet_symbol,packet);
+  kno_store(result,quality_symbol,KNO_INT(best_quality));
+  kno_store(result,bytes_symbol,KNO_INT(best_bytes));
+  kno_store(result,trials_symbol,KNO_INT(n_trials));
+  kno_decref(packet);
+  U8_CLEAR_ERRNO();
+  return IMAGICK_DONE(IM_ENCODE_TO_SIZE,result,
+		      0,best_bytes,wand_pixels(wrapper->wand));
+}
+
+/* Compositing */
+
+static lispval gravity_symbol, operator_symbol, opacity_symbol;
+static lispval x_symbol, y_symbol;
+
+static struct COMPOSEMAP {
+  CompositeOperator op;
+  char *opname;} composite_ops[]={
+  {OverCompositeOp,"Over"},
+  {AtopCompositeOp,"Atop"},
+  {InCompositeOp,"In"},
+  {OutCompositeOp,"Out"},
+  {XorCompositeOp,"Xor"},
+  {CopyCompositeOp,"Copy"},
+  {ReplaceCompositeOp,"Replace"},
+  {DstOverCompositeOp,"DstOver"},
+  {DstInCompositeOp,"DstIn"},
+  {DstOutCompositeOp,"DstOut"},
+  {MultiplyCompositeOp,"Multiply"},
+  {ScreenCompositeOp,"Screen"},
+  {OverlayCompositeOp,"Overlay"},
+  {DarkenCompositeOp,"Darken"},
+  {LightenCompositeOp,"Lighten"},
+  {ColorBurnCompositeOp,"ColorBurn"},
+  {ColorDodgeCompositeOp,"ColorDodge"},
+  {HardLightCompositeOp,"HardLight"},
+  {SoftLightCompositeOp,"SoftLight"},
+  {DifferenceCompositeOp,"Difference"},
+  {ExclusionCompositeOp,"Exclusion"},
+  {PlusCompositeOp,"Plus"},
+  {MinusDstCompositeOp,"Minus"},
+  {DissolveCompositeOp,"Dissolve"},
+  {CopyOpacityCompositeOp,"CopyOpacity"},
+  {UndefinedCompositeOp,NULL}};
+
+static struct GRAVITYMAP {
+  GravityType gravity;
+  char *gname;} gravities[]={
+  {NorthWestGravity,"NorthWest"},
+  {NorthGravity,"North"},
+  {NorthEastGravity,"NorthEast"},
+  {WestGravity,"West"},
+  {CenterGravity,"Center"},
+  {EastGravity,"East"},
+  {SouthWestGravity,"SouthWest"},
+  {SouthGravity,"South"},
+  {SouthEastGravity,"SouthEast"},
+  {UndefinedGravity,NULL}};
+
+struct COMPOSITE_SPEC {
+  CompositeOperator op;
+  GravityType gravity;
+  ssize_t x, y;
+  double opacity;};
+
+static u8_string symbolic_name(lispval arg)
+{
+  if (KNO_STRINGP(arg)) return KNO_CSTRING(arg);
+  else if (KNO_SYMBOLP(arg)) return KNO_SYMBOL_NAME(arg);
+  else return NULL;
+}
+
+/* Parses the `operator`, `gravity`, `x`, `y` and `opacity` options,
+   returning -1 (signalling an error) if any are invalid */
+static int parse_composite_opts(lispval opts,struct COMPOSITE_SPEC *spec,
+				u8_context cxt)
+{
+  lispval op_arg = kno_getopt(opts,operator_symbol,KNO_VOID);
+  lispval gravity_arg = kno_getopt(opts,gravity_symbol,KNO_VOID);
+  lispval x_arg = kno_getopt(opts,x_symbol,KNO_INT(0));
+  lispval y_arg = kno_getopt(opts,y_symbol,KNO_INT(0));
+  lispval opacity_arg = kno_getopt(opts,opacity_symbol,KNO_VOID);
+  int rv = 0;
+  spec->op = OverCompositeOp;
+  spec->gravity = NorthWestGravity;
+  spec->opacity = 1.0;
+  if (!(KNO_VOIDP(op_arg))) {
+    u8_string name = symbolic_name(op_arg);
+    struct COMPOSEMAP *scan = composite_ops;
+    while ( (name) && (scan->opname) )
+      if (strcasecmp(name,scan->opname) == 0) break;
+      else scan++;
+    if ( (name == NULL) || (scan->opname == NULL) ) {
+      kno_type_error("composite operator",cxt,op_arg);
+      rv = -1; goto cleanup;}
+    spec->op = scan->op;}
+  if (!(KNO_VOIDP(gravity_arg))) {
+    u8_string name = symbolic_name(gravity_arg);
+    struct GRAVITYMAP *scan = gravities;
+    while ( (name) && (scan->gname) )
+      if (strcasecmp(name,scan->gname) == 0) break;
+      else scan++;
+    if ( (name == NULL) || (scan->gname == NULL) ) {
+      kno_type_error("gravity",cxt,gravity_arg);
+      rv = -1; goto cleanup;}
+    spec->gravity = scan->gravity;}
+  if ( (!(KNO_FIXNUMP(x_arg))) || (!(KNO_FIXNUMP(y_arg))) ) {
+    kno_type_error("offset",cxt,(KNO_FIXNUMP(x_arg)) ? (y_arg) : (x_arg));
+    rv = -1; goto cleanup;}
+  spec->x = KNO_FIX2INT(x_arg);
+  spec->y = KNO_FIX2INT(y_arg);
+  if (KNO_VOIDP(opacity_arg)) {}
+  else if ( (KNO_FLONUMP(opacity_arg)) && (KNO_FLONUM(opacity_arg) >= 0) &&
+	    (KNO_FLONUM(opacity_arg) <= 1) )
+    spec->opacity = KNO_FLONUM(opacity_arg);
+  else if ( (KNO_FIXNUMP(opacity_arg)) &&
+	    ( (KNO_FIX2INT(opacity_arg) == 0) ||
+	      (KNO_FIX2INT(opacity_arg) == 1) ) )
+    spec->opacity = KNO_FIX2INT(opacity_arg);
+  else {
+    kno_type_error("opacity (0.0-1.0)",cxt,opacity_arg);
+    rv = -1;}
+ cleanup:
+  kno_decref(op_arg); kno_decref(gravity_arg);
+  kno_decref(x_arg); kno_decref(y_arg); kno_decref(opacity_arg);
+  return rv;
+}
+
+/* Returns a copy of the current image of wand ready to be composited
+   repeatedly, with the opacity of spec already applied to its alpha
+   channel. */
+static MagickWand *prepare_overlay(MagickWand *wand,
+				   struct COMPOSITE_SPEC *spec,
+				   u8_context cxt)
+{
+  MagickWand *overlay = MagickGetImage(wand);
+  if (overlay == NULL) {
+    grabmagickerr(cxt,wand);
+    return NULL;}
+  if ( (spec->opacity < 1.0) &&
+       ( (MagickSetImageAlphaChannel(overlay,SetAlphaChannel) == MagickFalse) ||
+	 (MagickEvaluateImageChannel(overlay,AlphaChannel,
+				     MultiplyEvaluateOperator,
+				     spec->opacity) == MagickFalse) ) ) {
+    grabmagickerr(cxt,overlay);
+    DestroyMagickWand(overlay);
+    return NULL;}
+  return overlay;
+}
+
+/* Composites overlay onto every frame of wand. This only reads
+   overlay, so one overlay can be used from several threads. */
+static MagickBooleanType composite_wand(MagickWand *wand,MagickWand *overlay,
+					struct COMPOSITE_SPEC *spec)
+{
+  ssize_t ow = MagickGetImageWidth(overlay);
+  ssize_t oh = MagickGetImageHeight(overlay);
+  MagickResetIterator(wand);
+  while (MagickNextImage(wand) != MagickFalse) {
+    ssize_t w = MagickGetImageWidth(wand), h = MagickGetImageHeight(wand);
+    ssize_t x = spec->x, y = spec->y;
+    /* Offsets are measured inward from the gravity's edges */
+    switch (spec->gravity) {
+    case NorthGravity: case CenterGravity: case SouthGravity:
+      x = ((w-ow)/2)+spec->x; break;
+    case NorthEastGravity: case EastGravity: case SouthEastGravity:
+      x = w-ow-spec->x; break;
+    default: break;}
+    switch (spec->gravity) {
+    case WestGravity: case CenterGravity: case EastGravity:
+      y = ((h-oh)/2)+spec->y; break;
+    case SouthWestGravity: case SouthGravity: case SouthEastGravity:
+      y = h-oh-spec->y; break;
+    default: break;}
+    if (MagickCompositeImage(wand,overlay,spec->op,x,y) == MagickFalse)
+      return MagickFalse;}
+  MagickResetIterator(wand);
+  return MagickTrue;
+}
+
+DEFC_PRIM("imagick/composite",imagick_composite,
+	  KNO_MAX_ARGS(3)|KNO_MIN_ARGS(2),
+	  "Composites the current image of *overlay* onto every frame "
+	  "of *imagickref*. *opts* may give the `operator` (e.g. Over, "
+	  "Multiply, Screen or Dissolve; default Over), a `gravity` "
+	  "(e.g. NorthWest, Center or SouthEast), `x` and `y` offsets "
+	  "measured inward from the gravity's edges, and an `opacity` "
+	  "(0.0-1.0) for the overlay.",
+	  {"imagickref",KNO_IMAGICK_TYPE,KNO_VOID},
+	  {"overlay",KNO_IMAGICK_TYPE,KNO_VOID},
+	  {"opts",kno_any_type,KNO_VOID})
+static lispval imagick_composite(lispval imagickref,lispval overlayref,
+				 lispval opts)
+{
+  long long started = metrics_start();
+  struct COMPOSITE_SPEC spec;
+  struct KNO_IMAGICK *wrapper=
+    kno_consptr(struct KNO_IMAGICK *,imagickref,kno_imagick_type);
+  struct KNO_IMAGICK *overlay_wrapper=
+    kno_consptr(struct KNO_IMAGICK *,overlayref,kno_imagick_type);
+  if (parse_composite_opts(opts,&spec,"imagick_composite") < 0)
+    return IMAGICK_DONE(IM_COMPOSITE,KNO_ERROR_VALUE,0,0,0);
+  MagickWand *overlay =
+    prepare_overlay(overlay_wrapper->wand,&spec,"imagick_composite");
+  if (overlay == NULL)
+    return IMAGICK_DONE(IM_COMPOSITE,KNO_ERROR_VALUE,0,0,0);
+  MagickWand *wand = wrapper->wand;
+  if (composite_wand(wand,overlay,&spec) == MagickFalse) {
+    grabmagickerr("imagick_composite",wand);
+    DestroyMagickWand(overlay);
+    return IMAGICK_DONE(IM_COMPOSITE,KNO_ERROR_VALUE,0,0,0);}
+  DestroyMagickWand(overlay);
+  imagick_account(wrapper);
+  U8_CLEAR_ERRNO();
+  return IMAGICK_DONE(IM_COMPOSITE,kno_incref(imagickref),
+		      0,0,wand_pixels(wand));
+}
+
+struct STAMP_TASKS {
+  MagickWand **wands;
+  char **errmsgs;
+  MagickWand *overlay;
+  struct COMPOSITE_SPEC *spec;};
+
+static void stamp_image(void *data,int i)
+{
+  struct STAMP_TASKS *tasks = (struct STAMP_TASKS *)data;
+  if (composite_wand(tasks->wands[i],tasks->overlay,tasks->spec) ==
+      MagickFalse)
+    tasks->errmsgs[i] = copymagickerr(tasks->wands[i]);
+}
+
+static int compare_pointers(const void *a,const void *b)
+{
+  uintptr_t x = (uintptr_t)(*((void **)a)), y = (uintptr_t)(*((void **)b));
+  return (x < y) ? (-1) : (x > y) ? (1) : (0);
+}
+
+DEFC_PRIM("imagick/stamp",imagick_stamp,
+	  KNO_MAX_ARGS(3)|KNO_MIN_ARGS(2),
+	  "Composites *overlay* onto each of the (distinct) imagick "
+	  "objects in the vector or list *images*, as `imagick/composite` "
+	  "would with *opts*. The overlay is prepared once and the "
+	  "images are stamped in parallel, using up to the `threads` "
+	  "option (default IMAGICK:THREADS) threads. Returns *images*.",
+	  {"overlay",KNO_IMAGICK_TYPE,KNO_VOID},
+	  {"images",kno_any_type,KNO_VOID},
+	  {"opts",kno_any_type,KNO_VOID})
+static lispval imagick_stamp(lispval overlayref,lispval images,lispval opts)
+{
+  long long started = metrics_start();
+  struct COMPOSITE_SPEC spec;
+  struct KNO_IMAGICK *overlay_wrapper=
+    kno_consptr(struct KNO_IMAGICK *,overlayref,kno_imagick_type);
+  int n = 0, i = 0;
+  struct KNO_IMAGICK **wrappers;
+  if (KNO_VECTORP(images)) {
+    n = KNO_VECTOR_LENGTH(images);
+    wrappers = u8_alloc_n((n) ? (n) : (1),struct KNO_IMAGICK *);
+    while (i < n) {
+      lispval image = KNO_VECTOR_REF(images,i);
+      if (!(KNO_TYPEP(image,kno_imagick_type))) {
+	u8_free(wrappers);
+	kno_type_error("imagick","imagick_stamp",image);
+	return IMAGICK_DONE(IM_STAMP,KNO_ERROR_VALUE,0,0,0);}
+      wrappers[i++] = (struct KNO_IMAGICK *)image;}}
+  else if ( (KNO_PAIRP(images)) || (KNO_NILP(images)) ) {
+    {KNO_DOLIST(image,images) n++;}
+    wrappers = u8_alloc_n((n) ? (n) : (1),struct KNO_IMAGICK *);
+    KNO_DOLIST(image,images) {
+      if (!(KNO_TYPEP(image,kno_imagick_type))) {
+	u8_free(wrappers);
+	kno_type_error("imagick","imagick_stamp",image);
+	return IMAGICK_DONE(IM_STAMP,KNO_ERROR_VALUE,0,0,0);}
+      wrappers[i++] = (struct KNO_IMAGICK *)image;}}
+  else {
+    kno_type_error("vector or list of images","imagick_stamp",images);
+    return IMAGICK_DONE(IM_STAMP,KNO_ERROR_VALUE,0,0,0);}
+  /* Stamping the same wand from two threads would race */
+  struct KNO_IMAGICK **sorted = u8_alloc_n((n) ? (n) : (1),
+					   struct KNO_IMAGICK *);
+  memcpy(sorted,wrappers,n*sizeof(struct KNO_IMAGICK *));
+  qsort(sorted,n,sizeof(struct KNO_IMAGICK *),compare_pointers);
+  i = 1; while (i < n) {
+    if (sorted[i] == sorted[i-1]) {
+      kno_err("DuplicateImage","imagick_stamp",NULL,(lispval)(sorted[i]));
+      u8_free(sorted); u8_free(wrappers);
+      return IMAGICK_DONE(IM_STAMP,KNO_ERROR_VALUE,0,0,0);}
+    i++;}
+  u8_free(sorted);
+
+  if (parse_composite_opts(opts,&spec,"imagick_stamp") < 0) {
+    u8_free(wrappers);
+    return IMAGICK_DONE(IM_STAMP,KNO_ERROR_VALUE,0,0,0);}
+  lispval threads_arg = kno_getopt(opts,threads_symbol,KNO_VOID);
+  int n_threads = (KNO_UINTP(threads_arg)) ? (KNO_FIX2INT(threads_arg)) :
+    (imagick_threads);
+  kno_decref(threads_arg);
+  MagickWand *overlay =
+    prepare_overlay(overlay_wrapper->wand,&spec,"imagick_stamp");
+  if (overlay == NULL) {
+    u8_free(wrappers);
+    return IMAGICK_DONE(IM_STAMP,KNO_ERROR_VALUE,0,0,0);}
+
+  struct STAMP_TASKS tasks;
+  tasks.wands = u8_alloc_n((n) ? (n) : (1),MagickWand *);
+  tasks.errmsgs = u8_alloc_n((n) ? (n) : (1),char *);
+  tasks.overlay = overlay;
+  tasks.spec = &spec;
+  i = 0; while (i < n) {
+    tasks.wands[i] = wrappers[i]->wand;
+    tasks.errmsgs[i] = NULL;
+    i++;}
+  imagick_parallel(n,n_threads,stamp_image,&tasks);
+  DestroyMagickWand(overlay);
+
+  char *errmsg = NULL;
+  size_t pixels = 0;
+  i = 0; while (i < n) {
+    if (tasks.errmsgs[i]) {
+      if (errmsg) u8_free(tasks.errmsgs[i]);
+      else errmsg = tasks.errmsgs[i];}
+    else pixels += wand_pixels(tasks.wands[i]);
+    imagick_account(wrappers[i]);
+    i++;}
+  u8_free(tasks.wands);
+  u8_free(tasks.errmsgs);
+  u8_free(wrappers);
+  if (errmsg) {
+    u8_seterr(MagickWandError,"imagick_stamp",errmsg);
+    return IMAGICK_DONE(IM_STAMP,KNO_ERROR_VALUE,0,0,0);}
+  U8_CLEAR_ERRNO();
+  return IMAGICK_DONE(IM_STAMP,kno_incref(images),0,0,pixels);
+}
+
+/* Derived image cache
+
+   imagick/derive decodes a source packet, applies an op list and
+   encodes the result. Its results are cached under a key combining
+   the SHA-256 of the source with a canonical serialization of the
+   parsed ops and the encoder settings, so that repeated requests skip
+   decoding and transforming entirely. The memory tier holds up to
+   IMAGICK:CACHEMB megabytes; when IMAGICK:CACHEDIR is set, results
+   are also stored there (as one file per key) up to IMAGICK:CACHEDISKMB
+   megabytes. Both tiers evict the least recently used results. */
+
+#define DERIVE_BUCKETS 4096
+#define DIGEST_LEN 32
+
+struct DERIVED {
+  unsigned char key[DIGEST_LEN];
+  lispval packet;
+  size_t n_bytes;
+  struct DERIVED *bucket_next, *lru_prev, *lru_next;};
+
+static struct DERIVED *derived_buckets[DERIVE_BUCKETS];
+static struct DERIVED *derived_newest = NULL, *derived_oldest = NULL;
+static size_t derived_bytes = 0, derived_count = 0;
+static u8_mutex derived_lock;
+
+static int derive_cache_mb = 64;
+static int derive_disk_mb = 1024;
+static u8_string derive_cache_dir = NULL;
+/* Held while IMAGICK:CACHEDIR is being read or replaced */
+static u8_mutex derive_cache_dir_lock;
+
+/* -1 until the disk tier has been measured */
+static long long derived_disk_bytes = -1;
+static u8_mutex derived_disk_lock;
+
+static long long derive_memory_hits = 0, derive_disk_hits = 0;
+static long long derive_misses = 0, derive_evictions = 0;
+
+/* Returns a copy of IMAGICK:CACHEDIR (to be freed with u8_free), or
+   NULL if there's no disk tier */
+static u8_string derive_cache_dir_copy()
+{
+  u8_lock_mutex(&derive_cache_dir_lock);
+  u8_string dir = (derive_cache_dir) ? (u8_strdup(derive_cache_dir)) :
+    (NULL);
+  u8_unlock_mutex(&derive_cache_dir_lock);
+  return dir;
+}
+
+static lispval cache_dir_config_get(lispval var,void *data)
+{
+  u8_lock_mutex(&derive_cache_dir_lock);
+  lispval value = kno_sconfig_get(var,data);
+  u8_unlock_mutex(&derive_cache_dir_lock);
+  return value;
+}
+
+static int cache_dir_config_set(lispval var,lispval val,void *data)
+{
+  u8_lock_mutex(&derive_cache_dir_lock);
+  int rv = kno_sconfig_set(var,val,data);
+  u8_unlock_mutex(&derive_cache_dir_lock);
+  return rv;
+}
+
+/* IMAGICK:SIMD can be set to any level the CPU supports */
+static int simd_config_set(lispval var,lispval val,void *data)
+{
+  const char *name = (KNO_STRINGP(val)) ? (KNO_CSTRING(val)) :
+    (KNO_SYMBOLP(val)) ? (KNO_SYMBOL_NAME(val)) : (NULL);
+  int level = (name) ? (simd_level(name)) : (-1);
+  if (level < 0) {
+    kno_type_error("supported SIMD level","simd_config_set",val);
+    return -1;}
+  set_simd_level(level);
+  return 1;
+}
+
+static lispval cache_symbol, memory_hits_symbol, disk_hits_symbol;
+static lispval misses_symbol, evictions_symbol, entries_symbol;
+static lispval disk_bytes_symbol;
+
+static u8_string opname(enum IMAGICK_OP_TYPE type)
+{
+  struct OPMAP *scan = imagick_ops;
+  while (scan->opname)
+    if (scan->type == type) return scan->opname;
+    else scan++;
+  return "?";
+}
+
+static int compare_strings(const void *a,const void *b)
+{
+  return strcmp(*((char **)a),*((char **)b));
+}
+
+/* Writes a canonical form of the encoder settings in opts to out,
+   with the keys of the options table in sorted order. Returns -1
+   (signalling an error) if they're invalid. */
+static int encode_opts_key(struct U8_OUTPUT *out,lispval opts,u8_context cxt)
+{
+  if ( (KNO_VOIDP(opts)) || (KNO_FALSEP(opts)) || (KNO_DEFAULTP(opts)) )
+    return 0;
+  char buf[64];
+  lispval fmt = kno_getopt(opts,format,KNO_VOID);
+  lispval quality = kno_getopt(opts,quality_symbol,KNO_VOID);
+  lispval compression = kno_getopt(opts,compression_symbol,KNO_VOID);
+  lispval sampling = kno_getopt(opts,sampling_symbol,KNO_VOID);
+  lispval options = kno_getopt(opts,options_symbol,KNO_VOID);
+  int progressive = kno_testopt(opts,progressive_symbol,KNO_VOID);
+  int rv = 0;
+  if (KNO_STRINGP(fmt)) {
+    u8_string scan = KNO_CSTRING(fmt);
+    u8_putc(out,'F');
+    while (*scan) u8_putc(out,toupper(*scan++));
+    u8_putc(out,';');}
+  if (KNO_UINTP(quality))
+    u8_printf(out,"Q%lld;",(long long)KNO_FIX2INT(quality));
+  if ( (KNO_STRINGP(compression)) || (KNO_SYMBOLP(compression)) ) {
+    CompressionType ct = string2ctype
+      ((KNO_STRINGP(compression)) ? (KNO_CSTRING(compression)) :
+       (KNO_SYMBOL_NAME(compression)));
+    u8_printf(out,"C%d;",(int)ct);}
+  if (progressive) u8_puts(out,"P;");
+  if (KNO_STRINGP(sampling))
+    u8_printf(out,"S%s;",sampling_factor(KNO_CSTRING(sampling)));
+  if (KNO_TABLEP(options)) {
+    lispval keys = kno_getkeys(options);
+    int n = KNO_CHOICE_SIZE(keys), i = 0;
+    char **settings = u8_alloc_n((n) ? (n) : (1),char *);
+    KNO_DO_CHOICES(key,keys) {
+      char valbuf[64];
+      lispval val = kno_get(options,key,KNO_VOID);
+      u8_string keystring = option_string(key,buf,sizeof(buf));
+      u8_string valstring = option_string(val,valbuf,sizeof(valbuf));
+      if ( (keystring == NULL) || (valstring == NULL) ) {
+	kno_seterr("BadEncoderOption",cxt,keystring,val);
+	kno_decref(val);
+	KNO_STOP_DO_CHOICES;
+	rv = -1;
+	break;}
+      settings[i++] = u8_mkstring("%s=%s",keystring,valstring);
+      kno_decref(val);}
+    KNO_END_DO_CHOICES;
+    kno_decref(keys);
+    qsort(settings,i,sizeof(char *),compare_strings);
+    int j = 0; while (j < i) {
+      u8_printf(out,"O%s;",settings[j]);
+      u8_free(settings[j]);
+      j++;}
+    u8_free(settings);}
+  kno_decref(fmt); kno_decref(quality); kno_decref(compression);
+  kno_decref(sampling); kno_decref(options);
+  return rv;
+}
+
+static void hexdigest(unsigned char *digest,char *buf)
+{
+  int i = 0; while (i < DIGEST_LEN) {
+    sprintf(buf+i*2,"%02x",digest[i]);
+    i++;}
+}
+
+/* Computes the cache key for deriving ops from the source packet */
+static int derive_key(lispval source,struct IMAGICK_OP *ops,int n_ops,
+		      lispval opts,unsigned char *key,u8_context cxt)
+{
+  unsigned char source_digest[DIGEST_LEN];
+  char hex[DIGEST_LEN*2+1];
+  struct U8_OUTPUT out;
+  U8_INIT_OUTPUT(&out,256);
+  u8_sha256(KNO_PACKET_DATA(source),KNO_PACKET_LENGTH(source),
+	    source_digest);
+  hexdigest(source_digest,hex);
+  u8_puts(&out,hex);
+  int i = 0; while (i < n_ops) {
+    struct IMAGICK_OP *op = &(ops[i++]);
+    u8_printf(&out,"|%s(%.17g,%.17g,%.17g,%.17g;%d;%d)",
+	      opname(op->type),op->args[0],op->args[1],
+	      op->args[2],op->args[3],(int)op->filter,(int)op->mode);}
+  u8_putc(&out,'|');
+  if (encode_opts_key(&out,opts,cxt) < 0) {
+    u8_close_output(&out);
+    return -1;}
+  u8_sha256(out.u8_outbuf,out.u8_write-out.u8_outbuf,key);
+  u8_close_output(&out);
+  return 1;
+}
+
+/* The memory tier */
+
+static int derived_bucket(unsigned char *key)
+{
+  return ((key[0]<<8)|key[1])%DERIVE_BUCKETS;
+}
+
+static void derived_unlink(struct DERIVED *entry)
+{
+  if (entry->lru_prev) entry->lru_prev->lru_next = entry->lru_next;
+  else derived_newest = entry->lru_next;
+  if (entry->lru_next) entry->lru_next->lru_prev = entry->lru_prev;
+  else derived_oldest = entry->lru_prev;
+  entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void derived_push(struct DERIVED *entry)
+{
+  entry->lru_next = derived_newest;
+  if (derived_newest) derived_newest->lru_prev = entry;
+  derived_newest = entry;
+  if (derived_oldest == NULL) derived_oldest = entry;
+}
+
+/* Removes entry from the memory tier; called with derived_lock held */
+static void derived_drop(struct DERIVED *entry)
+{
+  struct DERIVED **scan = &(derived_buckets[derived_bucket(entry->key)]);
+  while (*scan)
+    if (*scan == entry) {
+      *scan = entry->bucket_next;
+      break;}
+    else scan = &((*scan)->bucket_next);
+  derived_unlink(entry);
+  derived_bytes -= entry->n_bytes;
+  derived_count--;
+  kno_decref(entry->packet);
+  u8_free(entry);
+}
+
+static lispval derived_get(unsigned char *key)
+{
+  lispval result = KNO_VOID;
+  u8_lock_mutex(&derived_lock);
+  struct DERIVED *scan = derived_buckets[derived_bucket(key)];
+  while (scan)
+    if (memcmp(scan->key,key,DIGEST_LEN) == 0) {
+      derived_unlink(scan);
+      derived_push(scan);
+      result = kno_incref(scan->packet);
+      break;}
+    else scan = scan->bucket_next;
+  u8_unlock_mutex(&derived_lock);
+  return result;
+}
+
+static void derived_put(unsigned char *key,lispval packet)
+{
+  size_t n_bytes = KNO_PACKET_LENGTH(packet);
+  size_t limit = ((size_t)derive_cache_mb)*1024*1024;
+  if (n_bytes > limit) return;
+  u8_lock_mutex(&derived_lock);
+  int bucket = derived_bucket(key);
+  struct DERIVED *scan = derived_buckets[bucket];
+  while (scan)
+    if (memcmp(scan->key,key,DIGEST_LEN) == 0) {
+      /* Another thread got here first */
+      u8_unlock_mutex(&derived_lock);
+      return;}
+    else scan = scan->bucket_next;
+  struct DERIVED *entry = u8_alloc(struct DERIVED);
+  memcpy(entry->key,key,DIGEST_LEN);
+  entry->packet = kno_incref(packet);
+  entry->n_bytes = n_bytes;
+  entry->lru_prev = entry->lru_next = NULL;
+  entry->bucket_next = derived_buckets[bucket];
+  derived_buckets[bucket] = entry;
+  derived_push(entry);
+  derived_bytes += n_bytes;
+  derived_count++;
+  while ( (derived_bytes > limit) && (derived_oldest) &&
+	  (derived_oldest != entry) ) {
+    derived_drop(derived_oldest);
+    METRIC_ADD(derive_evictions,1);}
+  u8_unlock_mutex(&derived_lock);
+}
+
+static void derived_clear()
+{
+  u8_lock_mutex(&derived_lock);
+  while (derived_oldest) derived_drop(derived_oldest);
+  u8_unlock_mutex(&derived_lock);
+}
+
+/* The disk tier, which keeps each result in DIR/xx/KEY, where xx is
+   the first two hex digits of the key. Reading a result touches its
+   file, so that eviction can remove the least recently used files by
+   modification time. */
+
+static void derived_path(u8_string dir,unsigned char *key,
+			 char *buf,size_t len)
+{
+  char hex[DIGEST_LEN*2+1];
+  hexdigest(key,hex);
+  snprintf(buf,len,"%s/%c%c/%s",dir,hex[0],hex[1],hex);
+}
+
+static lispval derived_disk_get(u8_string dir,unsigned char *key)
+{
+  char path[PATH_MAX];
+  struct stat info;
+  derived_path(dir,key,path,sizeof(path));
+  int fd = open(path,O_RDONLY);
+  if (fd < 0) return KNO_VOID;
+  if ( (fstat(fd,&info) < 0) || (info.st_size == 0) ) {
+    close(fd);
+    return KNO_VOID;}
+  unsigned char *data = u8_malloc(info.st_size);
+  ssize_t n_read = 0;
+  while (n_read < info.st_size) {
+    ssize_t delta = read(fd,data+n_read,info.st_size-n_read);
+    if (delta <= 0) break;
+    n_read += delta;}
+  close(fd);
+  if (n_read < info.st_size) {
+    u8_free(data);
+    return KNO_VOID;}
+  utime(path,NULL);
+  return kno_init_packet(NULL,n_read,data);
+}
+
+struct DISK_ENTRY {
+  char *path;
+  time_t mtime;
+  size_t size;};
+
+static int compare_disk_entries(const void *a,const void *b)
+{
+  const struct DISK_ENTRY *x = a, *y = b;
+  if (x->mtime < y->mtime) return -1;
+  else if (x->mtime > y->mtime) return 1;
+  else return 0;
+}
+
+/* Lists the cached files under dir, returning their count */
+static int derived_disk_scan(u8_string dir,struct DISK_ENTRY **entriesp)
+{
+  int n = 0, max = 256;
+  struct DISK_ENTRY *entries = u8_alloc_n(max,struct DISK_ENTRY);
+  DIR *top = opendir(dir);
+  struct dirent *sub;
+  while ( (top) && ((sub = readdir(top))) ) {
+    if ( (strlen(sub->d_name) != 2) || (!(isxdigit(sub->d_name[0]))) )
+      continue;
+    char subdir[PATH_MAX];
+    snprintf(subdir,sizeof(subdir),"%s/%s",dir,sub->d_name);
+    DIR *files = opendir(subdir);
+    struct dirent *file;
+    while ( (files) && ((file = readdir(files))) ) {
+      char path[PATH_MAX];
+      struct stat info;
+      if (strlen(file->d_name) != DIGEST_LEN*2) continue;
+      snprintf(path,sizeof(path),"%s/%s",subdir,file->d_name);
+      if ( (stat(path,&info) < 0) || (!(S_ISREG(info.st_mode))) )
+	continue;
+      if (n >= max) {
+	max = max*2;
+	entries = u8_realloc_n(entries,max,struct DISK_ENTRY);}
+      entries[n].path = u8_strdup(path);
+      entries[n].mtime = info.st_mtime;
+      entries[n].size = info.st_size;
+      n++;}
+    if (files) closedir(files);}
+  if (top) closedir(top);
+  *entriesp = entries;
+  return n;
+}
+
+/* Removes the least recently used files until the disk tier is
+   within 90% of its limit; called with derived_disk_lock held */
+static void derived_disk_evict(u8_string dir,long long limit)
+{
+  struct DISK_ENTRY *entries = NULL;
+  int n = derived_disk_scan(dir,&entries), i = 0;
+  long long total = 0;
+  while (i < n) total += entries[i++].size;
+  if (total > limit) {
+    qsort(entries,n,sizeof(struct DISK_ENTRY),compare_disk_entries);
+    i = 0; while ( (i < n) && (total > ((limit*9)/10)) ) {
+      if (unlink(entries[i].path) == 0) {
+	total -= entries[i].size;
+	METRIC_ADD(derive_evictions,1);}
+      i++;}}
+  i = 0; while (i < n) u8_free(entries[i++].path);
+  u8_free(entries);
+  derived_disk_bytes = total;
+}
+
+/* Reports the first failure to write the disk tier, which then
+   keeps trying quietly, so that a misconfigured IMAGICK:CACHEDIR is
+   noticed without flooding the log */
+static int derived_disk_reported = 0;
+
+static void derived_disk_failed(char *path,char *action)
+{
+  if (__atomic_exchange_n(&derived_disk_reported,1,__ATOMIC_RELAXED))
+    return;
+  u8_log(LOG_WARN,"imagick_derive",
+	 "Failed %s %s (%s), so results aren't being cached on disk",
+	 action,path,strerror(errno));
+}
+
+static void derived_disk_put(u8_string dir,unsigned char *key,
+			     lispval packet)
+{
+  char path[PATH_MAX], tmppath[PATH_MAX+32];
+  long long limit = ((long long)derive_disk_mb)*1024*1024;
+  size_t n_bytes = KNO_PACKET_LENGTH(packet);
+  if ( (limit <= 0) || (n_bytes > limit) ) return;
+  derived_path(dir,key,path,sizeof(path));
+  /* Create the subdirectory (and the cache directory itself) */
+  char *slash = strrchr(path,'/');
+  *slash = '\0';
+  int made = u8_mkdirs(path,0775);
+  *slash = '/';
+  if (made < 0) {
+    derived_disk_failed(path,"creating the directory of");
+    return;}
+  /* Write to a temporary file and rename it into place, so that
+     readers never see a partial result */
+  snprintf(tmppath,sizeof(tmppath),"%s.%ld.%lx",path,(long)getpid(),
+	   (unsigned long)pthread_self());
+  int fd = open(tmppath,O_WRONLY|O_CREAT|O_TRUNC,0664);
+  if (fd < 0) {
+    derived_disk_failed(path,"opening");
+    return;}
+  const unsigned char *data = KNO_PACKET_DATA(packet);
+  size_t written = 0;
+  while (written < n_bytes) {
+    ssize_t delta = write(fd,data+written,n_bytes-written);
+    if (delta <= 0) break;
+    written += delta;}
+  if ( (close(fd) < 0) || (written < n_bytes) ||
+       (rename(tmppath,path) < 0) ) {
+    derived_disk_failed(path,"writing");
+    unlink(tmppath);
+    return;}
+  u8_lock_mutex(&derived_disk_lock);
+  if (derived_disk_bytes < 0)
+    derived_disk_evict(dir,limit);
+  else {
+    derived_disk_bytes += n_bytes;
+    if (derived_disk_bytes > limit)
+      derived_disk_evict(dir,limit);}
+  u8_unlock_mutex(&derived_disk_lock);
+}
+
+/* Decodes source, applies ops to each frame and encodes the result.
+   The decoded pixels are accounted like those of any imagick object,
+   so that IMAGICK:MAXPIXELMB bounds derivations too. */
+static lispval derive_packet(lispval source,struct IMAGICK_OP *ops,
+			     int n_ops,lispval opts,size_t *pixels)
+{
+  struct KNO_IMAGICK *wrapper = imagick_alloc();
+  MagickWand *wand = wrapper->wand;
+  unsigned char *data = NULL; size_t n_bytes = 0;
+  lispval fmt = kno_getopt(opts,format,KNO_VOID);
+  if (MagickReadImageBlob(wand,KNO_PACKET_DATA(source),
+			  KNO_PACKET_LENGTH(source)) == MagickFalse)
+    goto magick_error;
+  imagick_account(wrapper);
+  if (imagick_check_limit("imagick_derive") < 0) goto error;
+  MagickResetIterator(wand);
+  while (MagickNextImage(wand) != MagickFalse)
+    if (apply_ops(wand,ops,n_ops) == MagickFalse) goto magick_error;
+  imagick_account(wrapper);
+  if ( (KNO_STRINGP(fmt)) &&
+       (MagickSetImageFormat(wand,KNO_CSTRING(fmt)) == MagickFalse) )
+    goto magick_error;
+  if (imagick_encode_opts(wand,opts,"imagick_derive") < 0) goto error;
+  MagickResetIterator(wand);
+  data = MagickGetImageBlob(wand,&n_bytes);
+  if (data == NULL) goto magick_error;
+  *pixels = wand_pixels(wand);
+  lispval packet = kno_make_packet(NULL,n_bytes,data);
+  MagickRelinquishMemory(data);
+  kno_decref(fmt);
+  imagick_release(wrapper);
+  return packet;
+ magick_error:
+  grabmagickerr("imagick_derive",wand);
+ error:
+  kno_decref(fmt);
+  imagick_release(wrapper);
+  return KNO_ERROR_VALUE;
+}
+
+DEFC_PRIM("imagick/derive",imagick_derive,
+	  KNO_MAX_ARGS(3)|KNO_MIN_ARGS(2),
+	  "Decodes the image in *packet*, applies the ops of "
+	  "`imagick/apply` to each frame and returns the encoded "
+	  "result as a packet. *opts* may give a `format` and the "
+	  "encoder settings of `imagick->file`. Results are cached "
+	  "by the content of *packet*, the ops and the encoder settings "
+	  "unless the `cache` option is #f.",
+	  {"packet",kno_packet_type,KNO_VOID},
+	  {"ops",kno_any_type,KNO_VOID},
+	  {"opts",kno_any_type,KNO_VOID})
+static lispval imagick_derive(lispval packet,lispval ops,lispval opts)
+{
+  long long started = metrics_start();
+  unsigned char key[DIGEST_LEN];
+  int n_ops = 0;
+  size_t pixels = 0;
+  struct IMAGICK_OP *parsed = parse_ops(ops,&n_ops,"imagick_derive");
+  if (parsed == NULL) return IMAGICK_DONE(IM_DERIVE,KNO_ERROR_VALUE,0,0,0);
+  lispval cache_opt = kno_getopt(opts,cache_symbol,KNO_TRUE);
+  int use_cache = (!(KNO_FALSEP(cache_opt)));
+  kno_decref(cache_opt);
+  u8_string dir = (use_cache) ? (derive_cache_dir_copy()) : (NULL);
+  if (use_cache) {
+    if (derive_key(packet,parsed,n_ops,opts,key,"imagick_derive") < 0) {
+      u8_free(parsed);
+      if (dir) u8_free(dir);
+      return IMAGICK_DONE(IM_DERIVE,KNO_ERROR_VALUE,0,0,0);}
+    lispval cached = derived_get(key);
+    if (!(KNO_VOIDP(cached))) {
+      METRIC_ADD(derive_memory_hits,1);
+      u8_free(parsed);
+      if (dir) u8_free(dir);
+      return IMAGICK_DONE(IM_DERIVE,cached,KNO_PACKET_LENGTH(packet),
+			  KNO_PACKET_LENGTH(cached),0);}
+    if (dir) {
+      cached = derived_disk_get(dir,key);
+      if (!(KNO_VOIDP(cached))) {
+	METRIC_ADD(derive_disk_hits,1);
+	derived_put(key,cached);
+	u8_free(parsed);
+	u8_free(dir);
+	return IMAGICK_DONE(IM_DERIVE,cached,KNO_PACKET_LENGTH(packet),
+			    KNO_PACKET_LENGTH(cached),0);}}
+    METRIC_ADD(derive_misses,1);}
+  lispval result = derive_packet(packet,parsed,n_ops,opts,&pixels);
+  u8_free(parsed);
+  if (KNO_ABORTP(result)) {
+    if (dir) u8_free(dir);
+    return IMAGICK_DONE(IM_DERIVE,result,0,0,0);}
+  if (use_cache) {
+    derived_put(key,result);
+    if (dir) derived_disk_put(dir,key,result);}
+  if (dir) u8_free(dir);
+  U8_CLEAR_ERRNO();
+  return IMAGICK_DONE(IM_DERIVE,result,KNO_PACKET_LENGTH(packet),
+		      KNO_PACKET_LENGTH(result),pixels);
+}
+
+DEFC_PRIM("imagick/derive-cache",imagick_derive_cache,
+	  KNO_MAX_ARGS(1)|KNO_MIN_ARGS(0),
+	  "Returns a table describing the `imagick/derive` cache. "
+	  "If *clear* is true, the memory tier is emptied (and, if "
+	  "*clear* is `disk`, so is the disk tier) after being described.",
+	  {"clear",kno_any_type,KNO_FALSE})
+static lispval imagick_derive_cache(lispval clear)
+{
+  lispval result = kno_empty_slotmap();
+  u8_lock_mutex(&derived_lock);
+  kno_store(result,entries_symbol,KNO_INT(derived_count));
+  kno_store(result,bytes_symbol,KNO_INT(derived_bytes));
+  u8_unlock_mutex(&derived_lock);
+  kno_store(result,memory_hits_symbol,
+	    KNO_INT(__atomic_load_n(&derive_memory_hits,__ATOMIC_RELAXED)));
+  kno_store(result,disk_hits_symbol,
+	    KNO_INT(__atomic_load_n(&derive_disk_hits,__ATOMIC_RELAXED)));
+  kno_store(result,misses_symbol,
+	    KNO_INT(__atomic_load_n(&derive_misses,__ATOMIC_RELAXED)));
+  kno_store(result,evictions_symbol,
+	    KNO_INT(__atomic_load_n(&derive_evictions,__ATOMIC_RELAXED)));
+  u8_string dir = derive_cache_dir_copy();
+  if (dir) {
+    u8_lock_mutex(&derived_disk_lock);
+    if (derived_disk_bytes >= 0)
+      kno_store(result,disk_bytes_symbol,KNO_INT(derived_disk_bytes));
+    u8_unlock_mutex(&derived_disk_lock);}
+  if (!(KNO_FALSEP(clear))) {
+    derived_clear();
+    if ( (dir) && (KNO_SYMBOLP(clear)) &&
+	 (strcasecmp(KNO_SYMBOL_NAME(clear),"disk") == 0) ) {
+      u8_lock_mutex(&derived_disk_lock);
+      derived_disk_evict(dir,0);
+      u8_unlock_mutex(&derived_disk_lock);}}
+  if (dir) u8_free(dir);
+  return result;
+}
+
+/* Asynchronous operations
+
+   The imagick/async-* primitives return an imagick-future at once and
+   do their work on a pool of up to IMAGICK:ASYNCTHREADS background
+   threads, so that the number of images being processed is capped
+   independently of the number of Kno threads. Everything which needs
+   Kno (parsing arguments, looking up the cache, making the result) is
+   done by the calling thread, either when the job is submitted or
+   when its future is awaited; the background threads only run
+   ImageMagick. */
+
+#define KNO_IMAGICK_FUTURE_TYPE 0x1c3e8814
+kno_lisp_type kno_imagick_future_type;
+
+enum IMAGICK_JOB_TYPE { decode_job, apply_job, encode_job, derive_job };
+
+enum IMAGICK_JOB_STATE { job_queued, job_running, job_done };
+
+struct IMAGICK_JOB {
+  enum IMAGICK_JOB_TYPE type;
+  enum IMAGICK_JOB_STATE state;
+  int refcount; /* the future and, until it's run, the queue */
+  unsigned char *input;
+  size_t input_len;
+  char selector[128];
+  int autoorient, strip;
+  MagickWand *wand;
+  struct IMAGICK_OP *ops;
+  int n_ops;
+  char *format;
+  struct ENCODE_SETTINGS encode;
+  unsigned char *output;
+  size_t output_len;
+  /* The pixel memory accounted for wand while the job holds it */
+  size_t reserved;
+  /* Set when the job fails, since errmsg may be NULL if ImageMagick
+     didn't report anything, and over_limit when it fails because of
+     IMAGICK:MAXPIXELMB */
+  int failed, over_limit;
+  char *errmsg;
+  u8_mutex lock;
+  u8_condvar done;
+  struct IMAGICK_JOB *next;};
+
+typedef struct KNO_IMAGICK_FUTURE {
+  KNO_CONS_HEADER;
+  struct IMAGICK_JOB *job;
+  lispval result;
+  int cache;
+  unsigned char key[DIGEST_LEN];} KNO_IMAGICK_FUTURE;
+typedef struct KNO_IMAGICK_FUTURE *kno_imagick_future;
+
+static int imagick_async_threads = 4;
+
+static struct IMAGICK_JOB *job_queue = NULL, *job_queue_end = NULL;
+static int async_workers = 0, async_running = 0, async_queued = 0;
+static long long async_completed = 0;
+static u8_mutex job_queue_lock;
+static u8_condvar job_queue_ready;
+
+static lispval queued_symbol, running_symbol, completed_symbol;
+static lispval workers_symbol;
+
+/* The number of background threads to keep, which is at least one so
+   that queued jobs always finish */
+static int async_thread_limit()
+{
+  int limit = imagick_async_threads;
+  return (limit > 0) ? (limit) : (1);
+}
+
+/* Changes the reservation of job to footprint bytes, returning -1 if
+   the increase doesn't fit within IMAGICK:MAXPIXELMB */
+static int job_reserve(struct IMAGICK_JOB *job,size_t footprint)
+{
+  if (footprint > job->reserved) {
+    if (imagick_reserve(footprint-job->reserved) < 0) return -1;}
+  else if (footprint < job->reserved)
+    PIXEL_BYTES_ADD(-((long long)(job->reserved-footprint)));
+  job->reserved = footprint;
+  return 0;
+}
+
+static void release_job(struct IMAGICK_JOB *job)
+{
+  if (__atomic_sub_fetch(&(job->refcount),1,__ATOMIC_ACQ_REL) > 0) return;
+  if (job->input) u8_free(job->input);
+  if (job->wand) DestroyMagickWand(job->wand);
+  job_reserve(job,0);
+  if (job->ops) u8_free(job->ops);
+  if (job->format) u8_free(job->format);
+  free_encode_settings(&(job->encode));
+  if (job->output) MagickRelinquishMemory(job->output);
+  if (job->errmsg) u8_free(job->errmsg);
+  u8_destroy_mutex(&(job->lock));
+  u8_destroy_condvar(&(job->done));
+  u8_free(job);
+}
+
+/* Runs job; this doesn't call into Kno. Decoded and modified images
+   are accounted (as job->reserved) like those of imagick objects, and
+   the job fails if they would exceed IMAGICK:MAXPIXELMB; inputs are
+   pinged first so that oversized ones aren't decoded at all. */
+static void run_job(struct IMAGICK_JOB *job)
+{
+  MagickWand *wand = job->wand;
+  if ( (job->type == decode_job) || (job->type == derive_job) ) {
+    wand = job->wand = NewMagickWand();
+    if (job->selector[0]) MagickSetFilename(wand,job->selector);
+    if (MagickPingImageBlob(wand,job->input,job->input_len) == MagickFalse)
+      goto failed;
+    if (job_reserve(job,wand_footprint(wand)) < 0) goto over_limit;
+    ClearMagickWand(wand);
+    if (job->selector[0]) MagickSetFilename(wand,job->selector);
+    if (MagickReadImageBlob(wand,job->input,job->input_len) == MagickFalse)
+      goto failed;
+    if (job_reserve(job,wand_footprint(wand)) < 0) goto over_limit;
+    u8_free(job->input);
+    job->input = NULL;
+    if ( (job->autoorient) || (job->strip) ) {
+      MagickResetIterator(wand);
+      while (MagickNextImage(wand) != MagickFalse) {
+	if ( (job->autoorient) &&
+	     (MagickAutoOrientImage(wand) == MagickFalse) )
+	  goto failed;
+	if ( (job->strip) && (MagickStripImage(wand) == MagickFalse) )
+	  goto failed;}}}
+  if ( (job->type == apply_job) || (job->type == derive_job) ) {
+    MagickResetIterator(wand);
+    while (MagickNextImage(wand) != MagickFalse)
+      if (apply_ops(wand,job->ops,job->n_ops) == MagickFalse) goto failed;
+    MagickResetIterator(wand);
+    if (job_reserve(job,wand_footprint(wand)) < 0) goto over_limit;}
+  if ( (job->type == encode_job) || (job->type == derive_job) ) {
+    if ( (job->format) &&
+	 (MagickSetImageFormat(wand,job->format) == MagickFalse) )
+      goto failed;
+    apply_encode_settings(wand,&(job->encode));
+    MagickResetIterator(wand);
+    job->output = MagickGetImageBlob(wand,&(job->output_len));
+    if (job->output == NULL) goto failed;
+    DestroyMagickWand(wand);
+    job->wand = NULL;
+    job_reserve(job,0);}
+  return;
+ failed:
+  job->failed = 1;
+  job->errmsg = copymagickerr(wand);
+  return;
+ over_limit:
+  job->failed = job->over_limit = 1;
+  job->errmsg = u8_mkstring("%lldMB of pixels in use",
+			    __atomic_load_n(&imagick_pixel_bytes,
+					    __ATOMIC_RELAXED)/(1024*1024));
+}
+
+static void *async_worker(void *ignored)
+{
+  while (1) {
+    u8_lock_mutex(&job_queue_lock);
+    while ( (job_queue == NULL) && (async_workers <= async_thread_limit()) )
+      u8_condvar_wait(&job_queue_ready,&job_queue_lock);
+    if (async_workers > async_thread_limit()) {
+      /* IMAGICK:ASYNCTHREADS has been lowered */
+      async_workers--;
+      u8_unlock_mutex(&job_queue_lock);
+      return NULL;}
+    struct IMAGICK_JOB *job = job_queue;
+    job_queue = job->next;
+    if (job_queue == NULL) job_queue_end = NULL;
+    async_queued--;
+    async_running++;
+    u8_unlock_mutex(&job_queue_lock);
+
+    u8_lock_mutex(&(job->lock));
+    job->state = job_running;
+    u8_unlock_mutex(&(job->lock));
+    run_job(job);
+    u8_lock_mutex(&(job->lock));
+    job->state = job_done;
+    u8_condvar_broadcast(&(job->done));
+    u8_unlock_mutex(&(job->lock));
+    release_job(job);
+
+    u8_lock_mutex(&job_queue_lock);
+    async_running--;
+    async_completed++;
+    u8_unlock_mutex(&job_queue_lock);}
+  return NULL;
+}
+
+static struct IMAGICK_JOB *new_job(enum IMAGICK_JOB_TYPE type)
+{
+  struct IMAGICK_JOB *job = u8_alloc(struct IMAGICK_JOB);
+  memset(job,0,sizeof(struct IMAGICK_JOB));
+  job->type = type;
+  job->state = job_queued;
+  job->refcount = 1;
+  job->encode.quality = -1;
+  job->encode.ct = UndefinedCompression;
+  u8_init_mutex(&(job->lock));
+  u8_init_condvar(&(job->done));
+  return job;
+}
+
+/* Queues job and returns a future for it */
+static lispval submit_job(struct IMAGICK_JOB *job)
+{
+  struct KNO_IMAGICK_FUTURE *future = u8_alloc(struct KNO_IMAGICK_FUTURE);
+  KNO_INIT_FRESH_CONS(future,kno_imagick_future_type);
+  future->job = job;
+  future->result = KNO_VOID;
+  future->cache = 0;
+  job->refcount++;
+  u8_lock_mutex(&job_queue_lock);
+  if (job_queue_end) job_queue_end->next = job;
+  else job_queue = job;
+  job_queue_end = job;
+  async_queued++;
+  while (async_workers < async_thread_limit()) {
+    pthread_t thread;
+    if (pthread_create(&thread,NULL,async_worker,NULL) != 0) break;
+    pthread_detach(thread);
+    async_workers++;}
+  u8_condvar_signal(&job_queue_ready);
+  u8_unlock_mutex(&job_queue_lock);
+  return (lispval)future;
+}
+
+/* Returns a future which is already resolved to result */
+static lispval resolved_future(lispval result)
+{
+  struct KNO_IMAGICK_FUTURE *future = u8_alloc(struct KNO_IMAGICK_FUTURE);
+  KNO_INIT_FRESH_CONS(future,kno_imagick_future_type);
+  future->job = NULL;
+  future->result = result;
+  future->cache = 0;
+  return (lispval)future;
+}
+
+static int unparse_imagick_future(struct U8_OUTPUT *out,lispval x)
+{
+  struct KNO_IMAGICK_FUTURE *future = (struct KNO_IMAGICK_FUTURE *)x;
+  struct IMAGICK_JOB *job = future->job;
+  u8_printf(out,"#<IMAGICK-FUTURE %lx %s>",(unsigned long)x,
+	    ( (job == NULL) || (job->state == job_done) ) ? ("done") :
+	    (job->state == job_running) ? ("running") : ("queued"));
+  return 1;
+}
+
+static void recycle_imagick_future(struct KNO_RAW_CONS *c)
+{
+  struct KNO_IMAGICK_FUTURE *future = (struct KNO_IMAGICK_FUTURE *)c;
+  if (future->job) release_job(future->job);
+  kno_decref(future->result);
+  if (!(KNO_STATIC_CONSP(c))) u8_free(c);
+}
+
+/* Makes the result of the finished job of future, which is kept
+   by the future; called with the job's lock held */
+static lispval future_result(struct KNO_IMAGICK_FUTURE *future)
+{
+  struct IMAGICK_JOB *job = future->job;
+  if (!(KNO_VOIDP(future->result)))
+    return kno_incref(future->result);
+  else if (job->failed) {
+    u8_seterr((job->over_limit) ? (ImagickMemoryLimit) : (MagickWandError),
+	      "imagick_await",
+	      (job->errmsg) ? (u8_strdup(job->errmsg)) : (NULL));
+    return KNO_ERROR_VALUE;}
+  else if (job->output) {
+    future->result = kno_make_packet(NULL,job->output_len,job->output);
+    MagickRelinquishMemory(job->output);
+    job->output = NULL;
+    if (future->cache) {
+      u8_string dir = derive_cache_dir_copy();
+      derived_put(future->key,future->result);
+      if (dir) {
+	derived_disk_put(dir,future->key,future->result);
+	u8_free(dir);}}}
+  else {
+    /* The job's reservation passes to the new imagick object */
+    job_reserve(job,0);
+    future->result = make_imagick(job->wand);
+    job->wand = NULL;}
+  return kno_incref(future->result);
+}
+
+static struct IMAGICK_JOB *decode_job_for(lispval packet,lispval opts,
+					  enum IMAGICK_JOB_TYPE type,
+					  u8_context cxt)
+{
+  /* Jobs aren't accounted until they're awaited, so this only stops
+     new decodes while the limit is already exceeded */
+  if (imagick_check_limit(cxt) < 0) return NULL;
+  struct IMAGICK_JOB *job = new_job(type);
+  int selected = frame_selector(opts,job->selector+1,
+				sizeof(job->selector)-2,cxt);
+  if (selected < 0) {
+    release_job(job);
+    return NULL;}
+  else if (selected) {
+    job->selector[0] = '[';
+    strcat(job->selector,"]");}
+  if (!(KNO_VOIDP(opts))) {
+    job->autoorient = kno_testopt(opts,autoorient_symbol,KNO_VOID);
+    job->strip = kno_testopt(opts,strip_symbol,KNO_VOID);}
+  job->input_len = KNO_PACKET_LENGTH(packet);
+  job->input = u8_malloc(job->input_len);
+  memcpy(job->input,KNO_PACKET_DATA(packet),job->input_len);
+  return job;
+}
+
+/* Sets up the format and encoder settings of job from opts */
+static int encode_job_opts(struct IMAGICK_JOB *job,lispval opts,
+			   u8_context cxt)
+{
+  if (parse_encode_opts(opts,&(job->encode),cxt) < 0) return -1;
+  lispval fmt = kno_getopt(opts,format,KNO_VOID);
+  if (KNO_STRINGP(fmt)) job->format = u8_strdup(KNO_CSTRING(fmt));
+  kno_decref(fmt);
+  return 0;
+}
+
+DEFC_PRIM("imagick/async-decode",imagick_async_decode,
+	  KNO_MAX_ARGS(2)|KNO_MIN_ARGS(1),
+	  "Decodes *packet* in the background, as `packet->imagick` "
+	  "would with *opts*, returning an imagick-future for the "
+	  "imagick object.",
+	  {"packet",kno_packet_type,KNO_VOID},
+	  {"opts",kno_any_type,KNO_VOID})
+static lispval imagick_async_decode(lispval packet,lispval opts)
+{
+  long long started = metrics_start();
+  struct IMAGICK_JOB *job =
+    decode_job_for(packet,opts,decode_job,"imagick_async_decode");
+  if (job == NULL)
+    return IMAGICK_DONE(IM_ASYNC_DECODE,KNO_ERROR_VALUE,0,0,0);
+  return IMAGICK_DONE(IM_ASYNC_DECODE,submit_job(job),
+		      KNO_PACKET_LENGTH(packet),0,0);
+}
+
+DEFC_PRIM("imagick/async-apply",imagick_async_apply,
+	  KNO_MAX_ARGS(2)|KNO_MIN_ARGS(2),
+	  "Applies the op list *ops* (as in `imagick/apply`) in the "
+	  "background to a copy of *imagickref*, returning an "
+	  "imagick-future for the new imagick object. *imagickref* "
+	  "itself is unchanged.",
+	  {"imagickref",KNO_IMAGICK_TYPE,KNO_VOID},
+	  {"ops",kno_any_type,KNO_VOID})
+static lispval imagick_async_apply(lispval imagickref,lispval ops)
+{
+  long long started = metrics_start();
+  struct KNO_IMAGICK *wrapper=
+    kno_consptr(struct KNO_IMAGICK *,imagickref,kno_imagick_type);
+  int n_ops = 0;
+  struct IMAGICK_OP *parsed = parse_ops(ops,&n_ops,"imagick_async_apply");
+  if (parsed == NULL)
+    return IMAGICK_DONE(IM_ASYNC_APPLY,KNO_ERROR_VALUE,0,0,0);
+  struct IMAGICK_JOB *job = new_job(apply_job);
+  job->ops = parsed;
+  job->n_ops = n_ops;
+  job->wand = CloneMagickWand(wrapper->wand);
+  return IMAGICK_DONE(IM_ASYNC_APPLY,submit_job(job),0,0,0);
+}
+
+DEFC_PRIM("imagick/async-encode",imagick_async_encode,
+	  KNO_MAX_ARGS(2)|KNO_MIN_ARGS(1),
+	  "Encodes *imagickref* in the background, returning an "
+	  "imagick-future for the packet. *opts* may give a `format` "
+	  "and the encoder settings of `imagick->file`.",
+	  {"imagickref",KNO_IMAGICK_TYPE,KNO_VOID},
+	  {"opts",kno_any_type,KNO_VOID})
+static lispval imagick_async_encode(lispval imagickref,lispval opts)
+{
+  long long started = metrics_start();
+  struct KNO_IMAGICK *wrapper=
+    kno_consptr(struct KNO_IMAGICK *,imagickref,kno_imagick_type);
+  struct IMAGICK_JOB *job = new_job(encode_job);
+  if (encode_job_opts(job,opts,"imagick_async_encode") < 0) {
+    release_job(job);
+    return IMAGICK_DONE(IM_ASYNC_ENCODE,KNO_ERROR_VALUE,0,0,0);}
+  job->wand = CloneMagickWand(wrapper->wand);
+  return IMAGICK_DONE(IM_ASYNC_ENCODE,submit_job(job),0,0,0);
+}
+
+DEFC_PRIM("imagick/async-derive",imagick_async_derive,
+	  KNO_MAX_ARGS(3)|KNO_MIN_ARGS(2),
+	  "Like `imagick/derive`, but returns an imagick-future for "
+	  "the packet, doing the work in the background unless the "
+	  "result is already cached.",
+	  {"packet",kno_packet_type,KNO_VOID},
+	  {"ops",kno_any_type,KNO_VOID},
+	  {"opts",kno_any_type,KNO_VOID})
+static lispval imagick_async_derive(lispval packet,lispval ops,lispval opts)
+{
+  long long started = metrics_start();
+  unsigned char key[DIGEST_LEN];
+  int n_ops = 0;
+  struct IMAGICK_OP *parsed = parse_ops(ops,&n_ops,"imagick_async_derive");
+  if (parsed == NULL)
+    return IMAGICK_DONE(IM_ASYNC_DERIVE,KNO_ERROR_VALUE,0,0,0);
+  lispval cache_opt = kno_getopt(opts,cache_symbol,KNO_TRUE);
+  int use_cache = (!(KNO_FALSEP(cache_opt)));
+  kno_decref(cache_opt);
+  if (use_cache) {
+    if (derive_key(packet,parsed,n_ops,opts,key,
+		   "imagick_async_derive") < 0) {
+      u8_free(parsed);
+      return IMAGICK_DONE(IM_ASYNC_DERIVE,KNO_ERROR_VALUE,0,0,0);}
+    lispval cached = derived_get(key);
+    if (!(KNO_VOIDP(cached))) {
+      METRIC_ADD(derive_memory_hits,1);
+      u8_free(parsed);
+      return IMAGICK_DONE(IM_ASYNC_DERIVE,resolved_future(cached),
+			  KNO_PACKET_LENGTH(packet),0,0);}
+    u8_string dir = derive_cache_dir_copy();
+    if (dir) {
+      cached = derived_disk_get(dir,key);
+      u8_free(dir);
+      if (!(KNO_VOIDP(cached))) {
+	METRIC_ADD(derive_disk_hits,1);
+	derived_put(key,cached);
+	u8_free(parsed);
+	return IMAGICK_DONE(IM_ASYNC_DERIVE,resolved_future(cached),
+			    KNO_PACKET_LENGTH(packet),0,0);}}
+    METRIC_ADD(derive_misses,1);}
+  struct IMAGICK_JOB *job =
+    decode_job_for(packet,KNO_VOID,derive_job,"imagick_async_derive");
+  if (job == NULL) {
+    u8_free(parsed);
+    return IMAGICK_DONE(IM_ASYNC_DERIVE,KNO_ERROR_VALUE,0,0,0);}
+  job->ops = parsed;
+  job->n_ops = n_ops;
+  if (encode_job_opts(job,opts,"imagick_async_derive") < 0) {
+    release_job(job);
+    return IMAGICK_DONE(IM_ASYNC_DERIVE,KNO_ERROR_VALUE,0,0,0);}
+  lispval future = submit_job(job);
+  if (use_cache) {
+    struct KNO_IMAGICK_FUTURE *f = (struct KNO_IMAGICK_FUTURE *)future;
+    f->cache = 1;
+    memcpy(f->key,key,DIGEST_LEN);}
+  return IMAGICK_DONE(IM_ASYNC_DERIVE,future,KNO_PACKET_LENGTH(packet),0,0);
+}
+
+DEFC_PRIM("imagick/await",imagick_await,
+	  KNO_MAX_ARGS(2)|KNO_MIN_ARGS(1),
+	  "Waits for the imagick-future *future* and returns its "
+	  "result, signalling an error if its operation failed. If "
+	  "*timeout* (in seconds) is given and passes first, returns #f.",
+	  {"future",KNO_IMAGICK_FUTURE_TYPE,KNO_VOID},
+	  {"timeout",kno_any_type,KNO_VOID})
+static lispval imagick_await(lispval futureref,lispval timeout)
+{
+  struct KNO_IMAGICK_FUTURE *future=
+    kno_consptr(struct KNO_IMAGICK_FUTURE *,futureref,
+		kno_imagick_future_type);
+  struct IMAGICK_JOB *job = future->job;
+  if (job == NULL) return kno_incref(future->result);
+  long long started = metrics_start();
+  double secs = -1;
+  if (KNO_FLONUMP(timeout)) secs = KNO_FLONUM(timeout);
+  else if (KNO_UINTP(timeout)) secs = KNO_FIX2INT(timeout);
+  else if (!(KNO_VOIDP(timeout))) {
+    kno_type_error("seconds","imagick_await",timeout);
+    return IMAGICK_DONE(IM_AWAIT,KNO_ERROR_VALUE,0,0,0);}
+  struct timespec deadline;
+  if (secs >= 0) {
+    clock_gettime(CLOCK_REALTIME,&deadline);
+    deadline.tv_sec += (time_t)secs;
+    deadline.tv_nsec += (long)((secs-floor(secs))*1e9);
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;}}
+  lispval result = KNO_FALSE;
+  u8_lock_mutex(&(job->lock));
+  while (job->state != job_done) {
+    if (secs < 0)
+      u8_condvar_wait(&(job->done),&(job->lock));
+    else if (u8_condvar_timedwait(&(job->done),&(job->lock),&deadline) ==
+	     ETIMEDOUT)
+      break;}
+  if (job->state == job_done) result = future_result(future);
+  u8_unlock_mutex(&(job->lock));
+  size_t n_bytes = (KNO_PACKETP(result)) ? (KNO_PACKET_LENGTH(result)) : (0);
+  return IMAGICK_DONE(IM_AWAIT,result,0,n_bytes,0);
+}
+
+DEFC_PRIM("imagick/ready?",imagick_readyp,
+	  KNO_MAX_ARGS(1)|KNO_MIN_ARGS(1),
+	  "Returns #t if `imagick/await` would return at once for the "
+	  "imagick-future *future*",
+	  {"future",KNO_IMAGICK_FUTURE_TYPE,KNO_VOID})
+static lispval imagick_readyp(lispval futureref)
+{
+  struct KNO_IMAGICK_FUTURE *future=
+    kno_consptr(struct KNO_IMAGICK_FUTURE *,futureref,
+		kno_imagick_future_type);
+  struct IMAGICK_JOB *job = future->job;
+  if (job == NULL) return KNO_TRUE;
+  u8_lock_mutex(&(job->lock));
+  int done = (job->state == job_done);
+  u8_unlock_mutex(&(job->lock));
+  return (done) ? (KNO_TRUE) : (KNO_FALSE);
+}
+
+DEFC_PRIM("imagick/async-stats",imagick_async_stats,
+	  KNO_MAX_ARGS(0)|KNO_MIN_ARGS(0),
+	  "Returns a table describing the background threads used by "
+	  "the imagick/async primitives and the jobs queued for them.")
+static lispval imagick_async_stats()
+{
+  lispval result = kno_empty_slotmap();
+  u8_lock_mutex(&job_queue_lock);
+  int queued = async_queued, running = async_running;
+  int workers = async_workers;
+  long long completed = async_completed;
+  u8_unlock_mutex(&job_queue_lock);
+  kno_store(result,queued_symbol,KNO_INT(queued));
+  kno_store(result,running_symbol,KNO_INT(running));
+  kno_store(result,completed_symbol,KNO_INT(completed));
+  kno_store(result,workers_symbol,KNO_INT(workers));
+  kno_store(result,threads_symbol,KNO_INT(imagick_async_threads));
+  return result;
+}
+
+/* Large images */
+
+static struct RESOURCEMAP {
+  ResourceType rt;
+  char *rname;
+  lispval rsym;} resource_types[]={
+  {MemoryResource,"memory",KNO_VOID},
+  {MapResource,"map",KNO_VOID},
+  {DiskResource,"disk",KNO_VOID},
+  {AreaResource,"area",KNO_VOID},
+  {FileResource,"files",KNO_VOID},
+  {ThreadResource,"threads",KNO_VOID},
+#if (MagickLibVersion>0x670)
+  {WidthResource,"width",KNO_VOID},
+  {HeightResource,"height",KNO_VOID},
+#endif
+  {UndefinedResource,NULL,KNO_VOID}};
+
+DEFC_PRIM("imagick/resource-limit",imagick_resource_limit,
+	  KNO_MAX_ARGS(2)|KNO_MIN_ARGS(1),
+	  "Returns the ImageMagick limit on *resource* (`memory`, `map`, "
+	  "`disk`, `area`, `files`, `threads`, `width` or `height`), or "
+	  "#f if it is unlimited, first setting it to *value* if "
+	  "provided. The limits are process-wide, shared by every "
+	  "thread. When the `memory` and `map` limits are exceeded, "
+	  "pixel caches are kept on disk, bounding the memory (but not "
+	  "the disk space) used by large images.",
+	  {"resource",kno_symbol_type,KNO_VOID},
+	  {"value",kno_any_type,KNO_VOID})
+static lispval imagick_resource_limit(lispval resource,lispval value)
+{
+  struct RESOURCEMAP *scan = resource_types;
+  while (scan->rname)
+    if (scan->rsym == resource) break;
+    else scan++;
+  if (scan->rname == NULL)
+    return kno_type_error("imagick resource","imagick_resource_limit",
+			  resource);
+  if (KNO_VOIDP(value)) {}
+  else if (KNO_UINTP(value))
+    MagickSetResourceLimit(scan->rt,(MagickSizeType)KNO_FIX2INT(value));
+  else return kno_type_error("resource limit","imagick_resource_limit",value);
+  MagickSizeType limit = MagickGetResourceLimit(scan->rt);
+  /* Unlimited resources are reported as the largest MagickSizeType */
+  if (limit >= ((MagickSizeType)LLONG_MAX)) return KNO_FALSE;
+  else return KNO_INT((long long)limit);
+}
+
+static lispval crop_symbol, fit_symbol;
+
+DEFC_PRIM("imagick/convert-file",imagick_convert_file,
+	  KNO_MAX_ARGS(3)|KNO_MIN_ARGS(2),
+	  "Converts the image file *infile* into *outfile* without "
+	  "keeping an imagick object around. *opts* may specify "
+	  "`crop` (a vector #(x y width height)), which is passed to "
+	  "the reader as an extract geometry, `fit` (a (*width* . "
+	  "*height*) pair), which also lets JPEG decode at reduced "
+	  "size, `filter` and `format`. The image is still decoded "
+	  "whole (most readers, including JPEG and TIFF, apply the "
+	  "extract after decoding), so inputs which would exceed "
+	  "IMAGICK:MAXPIXELMB are refused before being read. Use "
+	  "`imagick/tile-pyramid` on the file to process larger images "
+	  "in strips.",
+	  {"infile",kno_string_type,KNO_VOID},
+	  {"outfile",kno_string_type,KNO_VOID},
+	  {"opts",kno_any_type,KNO_VOID})
+static lispval imagick_convert_file(lispval infile,lispval outfile,
+				    lispval opts)
+{
+  long long started = metrics_start();
+  lispval crop = kno_getopt(opts,crop_symbol,KNO_VOID);
+  lispval fit = kno_getopt(opts,fit_symbol,KNO_VOID);
+  lispval filter = kno_getopt(opts,filter_symbol,KNO_VOID);
+  lispval fmt = kno_getopt(opts,format,KNO_VOID);
+  u8_string inpath = NULL, outpath = NULL;
+  lispval result = KNO_VOID;
+  struct KNO_IMAGICK *temp = imagick_alloc();
+  MagickWand *wand = temp->wand;
+  if (KNO_VOIDP(crop))
+    inpath = u8_strdup(KNO_CSTRING(infile));
+  else if ( (KNO_VECTORP(crop)) && (KNO_VECTOR_LENGTH(crop) == 4) &&
+	    (KNO_UINTP(KNO_VECTOR_REF(crop,0))) &&
+	    (KNO_UINTP(KNO_VECTOR_REF(crop,1))) &&
+	    (KNO_UINTP(KNO_VECTOR_REF(crop,2))) &&
+	    (KNO_UINTP(KNO_VECTOR_REF(crop,3))) )
+    /* Raw readers only read the region; others crop after decoding */
+    inpath = u8_mkstring("%s[%lldx%lld+%lld+%lld]",KNO_CSTRING(infile),
+			 KNO_FIX2INT(KNO_VECTOR_REF(crop,2)),
+			 KNO_FIX2INT(KNO_VECTOR_REF(crop,3)),
+			 KNO_FIX2INT(KNO_VECTOR_REF(crop,0)),
+			 KNO_FIX2INT(KNO_VECTOR_REF(crop,1)));
+  else {
+    result = kno_type_error("crop region","imagick_convert_file",crop);
+    goto cleanup;}
+  char hint[64] = "";
+  if (!(KNO_VOIDP(fit))) {
+    if (!( (KNO_PAIRP(fit)) && (KNO_UINTP(KNO_CAR(fit))) &&
+	   (KNO_UINTP(KNO_CDR(fit))) )) {
+      result = kno_type_error("fit size","imagick_convert_file",fit);
+      goto cleanup;}
+    else if (KNO_VOIDP(crop)) {
+      sprintf(hint,"%lldx%lld",KNO_FIX2INT(KNO_CAR(fit)),
+	      KNO_FIX2INT(KNO_CDR(fit)));
+      MagickSetOption(wand,"jpeg:size",hint);}}
+  /* The whole image is decoded even when cropping, so it has to fit
+     within IMAGICK:MAXPIXELMB */
+  if (imagick_check_file_room(KNO_CSTRING(infile),(hint[0])?(hint):(NULL),
+			      "imagick_convert_file") < 0) {
+    result = KNO_ERROR_VALUE;
+    goto cleanup;}
+  if (MagickReadImage(wand,inpath) == MagickFalse) {
+    grabmagickerr("imagick_convert_file",wand);
+    result = KNO_ERROR_VALUE;
+    goto cleanup;}
+  imagick_account(temp);
+  if (!(KNO_VOIDP(fit))) {
+    size_t target_width, target_height;
+    fit_dimensions(MagickGetImageWidth(wand),MagickGetImageHeight(wand),
+		   KNO_FIX2INT(KNO_CAR(fit)),KNO_FIX2INT(KNO_CDR(fit)),
+		   &target_width,&target_height);
+    if (MagickResizeImage(wand,target_width,target_height,
+			  getfilter(filter,"imagick_convert_file"),1.0)
+	== MagickFalse) {
+      grabmagickerr("imagick_convert_file",wand);
+      result = KNO_ERROR_VALUE;
+      goto cleanup;}}
+  if (KNO_STRINGP(fmt))
+    outpath = u8_mkstring("%s:%s",KNO_CSTRING(fmt),KNO_CSTRING(outfile));
+  else if (KNO_SYMBOLP(fmt))
+    outpath = u8_mkstring("%s:%s",KNO_SYMBOL_NAME(fmt),KNO_CSTRING(outfile));
+  else outpath = u8_strdup(KNO_CSTRING(outfile));
+  if (MagickWriteImages(wand,outpath,MagickTrue) == MagickFalse) {
+    grabmagickerr("imagick_convert_file",wand);
+    result = KNO_ERROR_VALUE;}
+  else result = kno_incref(outfile);
+ cleanup:
+  imagick_release(temp);
+  if (inpath) u8_free(inpath);
+  if (outpath) u8_free(outpath);
+  kno_decref(crop); kno_decref(fit); kno_decref(filter); kno_decref(fmt);
+  if (!(KNO_ABORTP(result))) U8_CLEAR_ERRNO();
+  return IMAGICK_DONE(IM_CONVERT_FILE,result,0,0,0);
+}
+
+struct PYRAMID_TILE {
+  char key[64];
+  MagickWand *wand;
+  unsigned char *data;
+  size_t n_bytes;
+  char *errmsg;};
 
-void magickwand_atexit()
+static void encode_tile(void *data,int i)
 {
-  MagickWandTerminus();
+  struct PYRAMID_TILE *tile = ((struct PYRAMID_TILE *)data)+i;
+  tile->data = MagickGetImageBlob(tile->wand,&(tile->n_bytes));
+  if (tile->data == NULL) tile->errmsg = copymagickerr(tile->wand);
+  DestroyMagickWand(tile->wand);
+  tile->wand = NULL;
 }
 
-void grabmagickerr(u8_context cxt,MagickWand *wand)
+/* Writes the encoding of tile to DIR/level/col_row.suffix */
+static int write_tile(u8_string dir,int level,struct PYRAMID_TILE *tile,
+		      const char *suffix)
 {
-  ExceptionType severity;
-  char *description = MagickGetException(wand,&severity);
-  if (errno) u8_graberrno(cxt,NULL);
-  u8_seterr(MagickWandError,cxt,u8_strdup(description));
-  MagickRelinquishMemory(description);
-  MagickClearException(wand);
+  char path[PATH_MAX];
+  const char *name = strchr(tile->key,'/')+1;
+  snprintf(path,sizeof(path),"%s/%d",dir,level);
+  if (u8_mkdirs(path,0775) < 0) {
+    u8_graberrno("imagick_tile_pyramid",u8_strdup(path));
+    return -1;}
+  snprintf(path,sizeof(path),"%s/%d/%s.%s",dir,level,name,suffix);
+  FILE *f = fopen(path,"wb");
+  if ( (f == NULL) ||
+       (fwrite(tile->data,1,tile->n_bytes,f) < tile->n_bytes) ||
+       (fclose(f) != 0) ) {
+    u8_graberrno("imagick_tile_pyramid",u8_strdup(path));
+    return -1;}
+  return 0;
 }
 
-static int unparse_imagick(struct U8_OUTPUT *out,lispval x)
+/* Encodes tiles in parallel and stores the encodings in result or,
+   if dir is given, writes them into dir, counting them in *n_written.
+   Each encoding is freed once it has been stored or written. */
+static int store_tiles(struct PYRAMID_TILE *tiles,size_t n_tiles,
+		       int level,const char *fmt,int n_threads,
+		       lispval result,u8_string dir,long long *n_written)
 {
-  struct KNO_IMAGICK *wrapper = (struct KNO_IMAGICK *)x;
-  u8_printf(out,"#<IMAGICK %lx>",((unsigned long)(wrapper->wand)));
+  imagick_parallel(n_tiles,n_threads,encode_tile,tiles);
+  size_t i = 0; while (i < n_tiles) {
+    struct PYRAMID_TILE *tile = &(tiles[i++]);
+    if (tile->data == NULL) {
+      u8_seterr(MagickWandError,"imagick_tile_pyramid",tile->errmsg);
+      tile->errmsg = NULL;
+      return -1;}
+    if (dir) {
+      char suffix[16];
+      int j = 0; while ( (fmt[j]) && (j < 15) ) {
+	suffix[j] = tolower(fmt[j]); j++;}
+      suffix[j] = '\0';
+      if (write_tile(dir,level,tile,suffix) < 0) return -1;
+      (*n_written)++;}
+    else {
+      lispval key = kno_mkstring(tile->key);
+      lispval packet = kno_make_packet(NULL,tile->n_bytes,tile->data);
+      kno_store(result,key,packet);
+      kno_decref(key); kno_decref(packet);}
+    MagickRelinquishMemory(tile->data);
+    tile->data = NULL;}
   return 1;
 }
 
-static void recycle_imagick(struct KNO_RAW_CONS *c)
+static void free_tiles(struct PYRAMID_TILE *tiles,size_t n_tiles)
 {
-  struct KNO_IMAGICK *wrapper = (struct KNO_IMAGICK *)c;
-  DestroyMagickWand(wrapper->wand);
-  if (!(KNO_STATIC_CONSP(c))) u8_free(c);
+  size_t i = 0; while (i < n_tiles) {
+    struct PYRAMID_TILE *tile = &(tiles[i++]);
+    if (tile->wand) DestroyMagickWand(tile->wand);
+    if (tile->data) MagickRelinquishMemory(tile->data);
+    if (tile->errmsg) u8_free(tile->errmsg);}
+  u8_free(tiles);
 }
-DEFC_PRIM("file->imagick",file2imagick,
-	  KNO_MAX_ARGS(1)|KNO_MIN_ARGS(1),
-	  "**undocumented**",
-	  {"arg",kno_string_type,KNO_VOID})
-
 
-lispval file2imagick(lispval arg)
+/* Cuts one level of a tile pyramid into tiles and stores their
+   encodings in result or, if dir is given, writes them into dir,
+   counting them in *n_written */
+static int pyramid_level(MagickWand *level_wand,int level,
+			 size_t tilesize,size_t overlap,const char *fmt,
+			 int n_threads,lispval result,u8_string dir,
+			 long long *n_written)
 {
-  MagickWand *wand;
-  MagickBooleanType retval;
-  struct KNO_IMAGICK *imagickref = u8_alloc(struct KNO_IMAGICK);
-  KNO_INIT_FRESH_CONS(imagickref,kno_imagick_type);
-  imagickref->wand = wand = NewMagickWand();
-  retval = MagickReadImage(wand,KNO_CSTRING(arg));
-  if (retval == MagickFalse) {
-    grabmagickerr("file2imagick",wand);
-    u8_free(imagickref);
-    u8_free(wand);
-    return KNO_ERROR_VALUE;}
-  else {
-    U8_CLEAR_ERRNO();
-    return (lispval)imagickref;}
+  size_t w = MagickGetImageWidth(level_wand);
+  size_t h = MagickGetImageHeight(level_wand);
+  size_t columns = (w+tilesize-1)/tilesize, rows = (h+tilesize-1)/tilesize;
+  size_t n_tiles = columns*rows;
+  int retval = 1;
+  struct PYRAMID_TILE *tiles = u8_zalloc_n(n_tiles,struct PYRAMID_TILE);
+  size_t row = 0; while (row < rows) {
+    size_t col = 0; while (col < columns) {
+      struct PYRAMID_TILE *tile = &(tiles[row*columns+col]);
+      size_t x0 = col*tilesize, y0 = row*tilesize;
+      size_t x1 = x0+tilesize+overlap, y1 = y0+tilesize+overlap;
+      x0 = (x0 > overlap) ? (x0-overlap) : (0);
+      y0 = (y0 > overlap) ? (y0-overlap) : (0);
+      if (x1 > w) x1 = w;
+      if (y1 > h) y1 = h;
+      sprintf(tile->key,"%d/%lu_%lu",level,
+	      (unsigned long)col,(unsigned long)row);
+      tile->wand = MagickGetImageRegion(level_wand,x1-x0,y1-y0,x0,y0);
+      if ( (tile->wand == NULL) ||
+	   (MagickSetImageFormat(tile->wand,fmt) == MagickFalse) ) {
+	grabmagickerr("imagick_tile_pyramid",
+		      ((tile->wand)?(tile->wand):(level_wand)));
+	retval = -1;
+	goto cleanup;}
+      col++;}
+    row++;}
+  retval = store_tiles(tiles,n_tiles,level,fmt,n_threads,
+		       result,dir,n_written);
+ cleanup:
+  free_tiles(tiles,n_tiles);
+  return retval;
 }
-DEFC_PRIM("packet->imagick",packet2imagick,
-	  KNO_MAX_ARGS(1)|KNO_MIN_ARGS(1),
-	  "**undocumented**",
-	  {"arg",kno_packet_type,KNO_VOID})
 
-lispval packet2imagick(lispval arg)
+/* Builds every level of a pyramid from the current image of wand,
+   holding one level's pixels at a time */
+static int wand_pyramid(MagickWand *wand,size_t tilesize,size_t overlap,
+			const char *fmt,lispval result,u8_string dir,
+			long long *n_written)
 {
-  MagickWand *wand;
-  MagickBooleanType retval;
-  struct KNO_IMAGICK *imagickref = u8_alloc(struct KNO_IMAGICK);
-  KNO_INIT_FRESH_CONS(imagickref,kno_imagick_type);
-  imagickref->wand = wand = NewMagickWand();
-  retval = MagickReadImageBlob
-    (imagickref->wand,KNO_PACKET_DATA(arg),KNO_PACKET_LENGTH(arg));
-  if (retval == MagickFalse) {
-    grabmagickerr("file2imagick",wand);
-    u8_free(imagickref);
-    u8_free(wand);
-    return KNO_ERROR_VALUE;}
-  else {
-    U8_CLEAR_ERRNO();
-    return (lispval)imagickref;}
+  MagickWand *level_wand = MagickGetImage(wand);
+  if (level_wand == NULL) {
+    grabmagickerr("imagick_tile_pyramid",wand);
+    return -1;}
+  size_t w = MagickGetImageWidth(level_wand);
+  size_t h = MagickGetImageHeight(level_wand);
+  size_t maxdim = (w > h) ? (w) : (h);
+  int level = 0; while ((((size_t)1)<<level) < maxdim) level++;
+  while (level >= 0) {
+    if (pyramid_level(level_wand,level,tilesize,overlap,fmt,
+		      imagick_threads,result,dir,n_written) < 0) {
+      DestroyMagickWand(level_wand);
+      return -1;}
+    if (level > 0) {
+      w = (w+1)/2; h = (h+1)/2;
+      if (MagickResizeImage(level_wand,w,h,default_filter,1.0) ==
+	  MagickFalse) {
+	grabmagickerr("imagick_tile_pyramid",level_wand);
+	DestroyMagickWand(level_wand);
+	return -1;}}
+    level--;}
+  DestroyMagickWand(level_wand);
+  return 1;
 }
-DEFC_PRIM("imagick->file",imagick2file,
-	  KNO_MAX_ARGS(2)|KNO_MIN_ARGS(1),
-	  "**undocumented**",
-	  {"imagickref",KNO_IMAGICK_TYPE,KNO_VOID},
-	  {"filename",kno_string_type,KNO_VOID})
 
-lispval imagick2file(lispval imagickref,lispval filename)
+/* Streaming pyramids
+
+   When the source of imagick/tile-pyramid is a file, it is read with
+   MagickCore's ReadStream, which hands over the pixels a row at a
+   time instead of allocating a pixel cache for the whole image. Each
+   level of the pyramid is a PYRAMID_SINK holding just the band of
+   rows for its next row of tiles (with the overlap on either side).
+   Once the band is complete its tiles are encoded and the rows no
+   longer needed are dropped. Every pair of rows is also averaged
+   (2x2) into a row of the sink for the level below, so the memory
+   used is about two bands of the full resolution image, however tall
+   it is. Pixels are kept as 8-bit RGBA. */
+
+struct PYRAMID_SINK {
+  int level;
+  size_t w, h;
+  size_t n_rows;   /* rows received so far */
+  size_t band_y;   /* the image row held in the first row of band */
+  size_t tile_row; /* the next row of tiles to emit */
+  unsigned char *band, *pending, *half;
+  struct PYRAMID_SINK *below;};
+
+struct PYRAMID_STREAM {
+  const Image *image;
+  size_t tilesize, overlap;
+  const char *fmt, *map;
+  lispval result;
+  u8_string dir;
+  long long n_written;
+  /* failed is set (with an error) when making tiles fails, and
+     unstreamable when the image can't be read as rows of RGB(A) */
+  int failed, unstreamable;
+  unsigned char *row;
+  struct PYRAMID_SINK *top;};
+
+static struct PYRAMID_SINK *new_pyramid_sink(int level,size_t w,size_t h,
+					     size_t band_rows)
 {
-  MagickBooleanType retval;
-  struct KNO_IMAGICK *wrapper=
-    kno_consptr(struct KNO_IMAGICK *,imagickref,kno_imagick_type);
-  MagickWand *wand = wrapper->wand;
-  retval = MagickWriteImage(wand,KNO_CSTRING(filename));
-  if (retval == MagickFalse) {
-    grabmagickerr("imagick2file",wand);
-    return KNO_ERROR_VALUE;}
-  else {
-    U8_CLEAR_ERRNO();
-    return kno_incref(imagickref);}
+  struct PYRAMID_SINK *sink = u8_zalloc(struct PYRAMID_SINK);
+  sink->level = level;
+  sink->w = w; sink->h = h;
+  sink->band = u8_malloc(w*4*((band_rows < h) ? (band_rows) : (h)));
+  if (level > 0) {
+    sink->pending = u8_malloc(w*4);
+    sink->half = u8_malloc(((w+1)/2)*4);
+    sink->below = new_pyramid_sink(level-1,(w+1)/2,(h+1)/2,band_rows);}
+  return sink;
 }
-DEFC_PRIM("imagick->packet",imagick2packet,
-	  KNO_MAX_ARGS(1)|KNO_MIN_ARGS(1),
-	  "**undocumented**",
-	  {"imagickref",KNO_IMAGICK_TYPE,KNO_VOID})
 
-lispval imagick2packet(lispval imagickref)
+static void free_pyramid_sink(struct PYRAMID_SINK *sink)
 {
-  unsigned char *data = NULL; size_t n_bytes;
-  struct KNO_IMAGICK *wrapper=
-    kno_consptr(struct KNO_IMAGICK *,imagickref,kno_imagick_type);
-  MagickWand *wand = wrapper->wand;
-  MagickResetIterator(wand);
-  data = MagickGetImageBlob(wand,&n_bytes);
-  if (data == NULL) {
-    grabmagickerr("imagick2packet",wand);
-    return KNO_ERROR_VALUE;}
-  else {
-    lispval packet = kno_make_packet(NULL,n_bytes,data);
-    MagickRelinquishMemory(data);
-    U8_CLEAR_ERRNO();
-    return packet;}
+  while (sink) {
+    struct PYRAMID_SINK *below = sink->below;
+    u8_free(sink->band);
+    if (sink->pending) u8_free(sink->pending);
+    if (sink->half) u8_free(sink->half);
+    u8_free(sink);
+    sink = below;}
 }
-DEFC_PRIM("imagick/clone",imagick2imagick,
-	  KNO_MAX_ARGS(1)|KNO_MIN_ARGS(1),
-	  "**undocumented**",
-	  {"imagickref",KNO_IMAGICK_TYPE,KNO_VOID})
 
-lispval imagick2imagick(lispval imagickref)
+/* Averages the w pixels of rows a and b, two by two, into out */
+static void halve_rows(const unsigned char *a,const unsigned char *b,
+		       size_t w,unsigned char *out)
 {
-  struct KNO_IMAGICK *wrapper=
-    kno_consptr(struct KNO_IMAGICK *,imagickref,kno_imagick_type);
-  struct KNO_IMAGICK *fresh = u8_alloc(struct KNO_IMAGICK);
-  MagickWand *wand = CloneMagickWand(wrapper->wand);
-  KNO_INIT_FRESH_CONS(fresh,kno_imagick_type);
-  fresh->wand = wand;
-  U8_CLEAR_ERRNO();
-  return (lispval)fresh;
+  size_t x = 0; while (x < w) {
+    size_t x2 = (x+1 < w) ? (x+1) : (x);
+    int c = 0; while (c < 4) {
+      out[c] = (a[x*4+c]+a[x2*4+c]+b[x*4+c]+b[x2*4+c]+2)/4;
+      c++;}
+    out += 4;
+    x += 2;}
 }
 
-/* Getting properties */
-
-static lispval format, resolution, size, width, height, interlace;
-static lispval line_interlace, plane_interlace, partition_interlace;
-
-static lispval imagick_table_get(lispval imagickref,lispval field,lispval dflt)
+/* Encodes the tiles of the rows [y0,y1) held in the band of sink */
+static int sink_tiles(struct PYRAMID_STREAM *stream,
+		      struct PYRAMID_SINK *sink,size_t y0,size_t y1)
 {
-  /* enum result_type {imbool,imint,imdouble,imsize,imbox,imtrans} rt; */
-  struct KNO_IMAGICK *wrapper=
-    kno_consptr(struct KNO_IMAGICK *,imagickref,kno_imagick_type);
-  MagickWand *wand = wrapper->wand;
-  if (KNO_EQ(field,format)) {
-    const char *fmt = MagickGetImageFormat(wand);
-    return kno_mkstring((char *)fmt);}
-#if (MagickLibVersion>0x670)
-  else if (KNO_EQ(field,resolution)) {
-    double x = 0, y = 0;
-    /* MagickBooleanType rv = */
-    MagickGetResolution(wand,&x,&y);
-    return kno_conspair(kno_make_double(x),kno_make_double(y));}
-#endif
-  else if (KNO_EQ(field,interlace)) {
-    InterlaceType it = MagickGetInterlaceScheme(wand);
-    if (it == NoInterlace)
-      return KNO_FALSE;
-    else if (it == LineInterlace)
-      return line_interlace;
-    else if (it == PlaneInterlace)
-      return plane_interlace;
-    else if (it == PartitionInterlace)
-      return partition_interlace;
-    else return KNO_EMPTY_CHOICE;}
-  else if (KNO_EQ(field,size)) {
-    size_t w = MagickGetImageWidth(wand);
-    size_t h = MagickGetImageHeight(wand);
-    return kno_conspair(KNO_INT(w),KNO_INT(h));}
-  else if (KNO_EQ(field,width)) {
-    size_t w = MagickGetImageWidth(wand);
-    return KNO_INT(w);}
-  else if (KNO_EQ(field,height)) {
-    size_t h = MagickGetImageHeight(wand);
-    return KNO_INT(h);}
-  else return KNO_VOID;
+  size_t tilesize = stream->tilesize, overlap = stream->overlap;
+  size_t w = sink->w, rowbytes = w*4;
+  size_t columns = (w+tilesize-1)/tilesize, col = 0;
+  struct PYRAMID_TILE *tiles = u8_zalloc_n(columns,struct PYRAMID_TILE);
+  unsigned char *buf = u8_malloc((tilesize+2*overlap)*4*(y1-y0));
+  int retval = 1;
+  while (col < columns) {
+    struct PYRAMID_TILE *tile = &(tiles[col]);
+    size_t x0 = col*tilesize, x1 = x0+tilesize+overlap, y = y0;
+    x0 = (x0 > overlap) ? (x0-overlap) : (0);
+    if (x1 > w) x1 = w;
+    unsigned char *scan = buf;
+    while (y < y1) {
+      memcpy(scan,sink->band+(y-sink->band_y)*rowbytes+x0*4,(x1-x0)*4);
+      scan += (x1-x0)*4;
+      y++;}
+    sprintf(tile->key,"%d/%lu_%lu",sink->level,
+	    (unsigned long)col,(unsigned long)sink->tile_row);
+    tile->wand = NewMagickWand();
+    if ( (MagickConstituteImage(tile->wand,x1-x0,y1-y0,stream->map,
+				CharPixel,buf) == MagickFalse) ||
+	 (MagickSetImageFormat(tile->wand,stream->fmt) == MagickFalse) ) {
+      grabmagickerr("imagick_tile_pyramid",tile->wand);
+      retval = -1;
+      break;}
+    col++;}
+  u8_free(buf);
+  if (retval > 0)
+    retval = store_tiles(tiles,columns,sink->level,stream->fmt,
+			 imagick_threads,stream->result,stream->dir,
+			 &(stream->n_written));
+  free_tiles(tiles,columns);
+  return retval;
 }
 
-static FilterTypes default_filter = TriangleFilter;
-
-static FilterTypes getfilter(lispval arg,u8_string cxt)
+/* Adds the next row of sink, emitting its tiles and passing rows down
+   as they are completed */
+static int sink_row(struct PYRAMID_STREAM *stream,struct PYRAMID_SINK *sink,
+		    const unsigned char *row)
 {
-  u8_string name = NULL;
-  if ((KNO_VOIDP(arg))||(KNO_FALSEP(arg)))
-    return default_filter;
-  else if (KNO_SYMBOLP(arg))
-    name = KNO_SYMBOL_NAME(arg);
-  else if (KNO_STRINGP(arg))
-    name = KNO_CSTRING(arg);
-  else name = NULL;
-  if (name == NULL) {
-    u8_log(LOG_WARN,cxt,"Bad filter arg %q",arg);
-    return default_filter;}
-  if (strcasecmp(name,"triangle")==0) return TriangleFilter;
-  else if (strcasecmp(name,"box")==0) return BoxFilter;
-  else if (strcasecmp(name,"blackman")==0) return BlackmanFilter;
-  else if (strcasecmp(name,"catrom")==0) return CatromFilter;
-  else if (strcasecmp(name,"gaussian")==0) return GaussianFilter;
-  else if (strcasecmp(name,"cubic")==0) return CubicFilter;
-  else if (strcasecmp(name,"hanning")==0) return HanningFilter;
-  else if (strcasecmp(name,"hermite")==0) return HermiteFilter;
-  else if (strcasecmp(name,"lanczos")==0) return LanczosFilter;
-  else if (strcasecmp(name,"mitchell")==0) return MitchellFilter;
-  else if (strcasecmp(name,"point")==0) return PointFilter;
-  else if (strcasecmp(name,"quadratic")==0) return QuadraticFilter;
-  else if (strcasecmp(name,"sinc")==0) return SincFilter;
-  else if (strcasecmp(name,"bessel")==0) return BesselFilter;
-  else {
-    u8_log(LOG_WARN,cxt,"Bad filter arg %q",arg);
-    return default_filter;}
+  size_t tilesize = stream->tilesize, overlap = stream->overlap;
+  size_t rowbytes = sink->w*4;
+  if (sink->n_rows >= sink->h) return 0;
+  memcpy(sink->band+(sink->n_rows-sink->band_y)*rowbytes,row,rowbytes);
+  sink->n_rows++;
+  if (sink->below) {
+    if (sink->n_rows%2) {
+      memcpy(sink->pending,row,rowbytes);
+      /* The last row of an odd height is paired with itself */
+      if (sink->n_rows == sink->h) {
+	halve_rows(sink->pending,sink->pending,sink->w,sink->half);
+	if (sink_row(stream,sink->below,sink->half) < 0) return -1;}}
+    else {
+      halve_rows(sink->pending,row,sink->w,sink->half);
+      if (sink_row(stream,sink->below,sink->half) < 0) return -1;}}
+  size_t y0 = sink->tile_row*tilesize;
+  size_t y1 = y0+tilesize+overlap;
+  y0 = (y0 > overlap) ? (y0-overlap) : (0);
+  if (y1 > sink->h) y1 = sink->h;
+  if (sink->n_rows == y1) {
+    if (sink_tiles(stream,sink,y0,y1) < 0) return -1;
+    sink->tile_row++;
+    /* Keep just the rows which the next row of tiles overlaps */
+    size_t next = sink->tile_row*tilesize;
+    next = (next > overlap) ? (next-overlap) : (0);
+    if (next < y1)
+      memmove(sink->band,sink->band+(next-sink->band_y)*rowbytes,
+	      (y1-next)*rowbytes);
+    sink->band_y = next;}
+  return 1;
 }
 
+/* ReadStream runs in the calling thread, so its handler finds the
+   stream being read here */
+static __thread struct PYRAMID_STREAM *current_pyramid_stream = NULL;
 
-DEFC_PRIM("imagick/format",imagick_format,
-	  KNO_MAX_ARGS(2)|KNO_MIN_ARGS(2),
-	  "**undocumented**",
-	  {"imagickref",KNO_IMAGICK_TYPE,KNO_VOID},
-	  {"format",kno_string_type,KNO_VOID})
-static lispval imagick_format(lispval imagickref,lispval format)
+static size_t pyramid_stream_handler(const Image *image,const void *pixels,
+				     const size_t columns)
 {
-  MagickBooleanType retval;
-  struct KNO_IMAGICK *wrapper=
-    kno_consptr(struct KNO_IMAGICK *,imagickref,kno_imagick_type);
-  MagickWand *wand = wrapper->wand;
-  retval = MagickSetImageFormat(wand,KNO_CSTRING(format));
-  if (retval == MagickFalse) {
-    grabmagickerr("imagick_format",wand);
-    return KNO_ERROR_VALUE;}
-  else return kno_incref(imagickref);
+  struct PYRAMID_STREAM *stream = current_pyramid_stream;
+  if (stream->image == NULL) {
+    if (!( (image->colorspace == sRGBColorspace) ||
+	   (image->colorspace == GRAYColorspace) )) {
+      stream->unstreamable = 1;
+      return 0;}
+    size_t w = image->columns, h = image->rows;
+    size_t maxdim = (w > h) ? (w) : (h);
+    int level = 0; while ((((size_t)1)<<level) < maxdim) level++;
+    stream->image = image;
+    stream->map = (image->matte) ? ("RGBA") : ("RGBP");
+    stream->row = u8_malloc(w*4);
+    stream->top = new_pyramid_sink
+      (level,w,h,stream->tilesize+2*stream->overlap);}
+  else if (image != stream->image)
+    /* Only the first frame is used */
+    return columns;
+  /* Readers which don't deliver whole rows in order can't be used */
+  if ( (columns == 0) || ((columns%image->columns) != 0) ) {
+    stream->unstreamable = 1;
+    return 0;}
+  const PixelPacket *p = (const PixelPacket *)pixels;
+  size_t n_rows = columns/image->columns, i = 0;
+  while (i < n_rows) {
+    unsigned char *out = stream->row;
+    size_t x = 0; while (x < image->columns) {
+      out[0] = ScaleQuantumToChar(p->red);
+      out[1] = ScaleQuantumToChar(p->green);
+      out[2] = ScaleQuantumToChar(p->blue);
+      out[3] = (image->matte) ?
+	(ScaleQuantumToChar((Quantum)(QuantumRange-p->opacity))) : (255);
+      out += 4; p++; x++;}
+    if (sink_row(stream,stream->top,stream->row) < 0) {
+      stream->failed = 1;
+      return 0;}
+    i++;}
+  return columns;
 }
 
+/* Streams the pyramid of the image file at path, returning 1 if it
+   was built, 0 if the file can't be streamed and -1 (with an error)
+   if it fails */
+static int stream_pyramid(u8_string path,struct PYRAMID_STREAM *stream)
+{
+  ImageInfo *info = AcquireImageInfo();
+  ExceptionInfo *exception = AcquireExceptionInfo();
+  CopyMagickString(info->filename,path,MaxTextExtent);
+  current_pyramid_stream = stream;
+  Image *image = ReadStream(info,pyramid_stream_handler,exception);
+  current_pyramid_stream = NULL;
+  if (image) DestroyImageList(image);
+  int rv = 1;
+  if (stream->failed) rv = -1;
+  else if ( (stream->unstreamable) || (stream->top == NULL) ) rv = 0;
+  else if (stream->top->n_rows < stream->top->h) {
+    u8_seterr(MagickWandError,"imagick_tile_pyramid",
+	      u8_mkstring("%s: %s",path,
+			  ((exception->reason) ? (exception->reason) :
+			   ("image data ended early"))));
+    rv = -1;}
+  DestroyExceptionInfo(exception);
+  DestroyImageInfo(info);
+  if (stream->top) free_pyramid_sink(stream->top);
+  if (stream->row) u8_free(stream->row);
+  stream->top = NULL;
+  stream->row = NULL;
+  return rv;
+}
 
-DEFC_PRIM("imagick/fit",imagick_fit,
-	  KNO_MAX_ARGS(5)|KNO_MIN_ARGS(3),
-	  "**undocumented**",
-	  {"imagickref",KNO_IMAGICK_TYPE,KNO_VOID},
-	  {"w_arg",kno_fixnum_type,KNO_VOID},
-	  {"h_arg",kno_fixnum_type,KNO_VOID},
-	  {"filter",kno_any_type,KNO_VOID},
-	  {"blur",kno_flonum_type,KNO_VOID})
-static lispval imagick_fit(lispval imagickref,lispval w_arg,lispval h_arg,
-			   lispval filter,lispval blur)
+DEFC_PRIM("imagick/tile-pyramid",imagick_tile_pyramid,
+	  KNO_MAX_ARGS(5)|KNO_MIN_ARGS(1),
+	  "Builds a deep-zoom style tile pyramid from *source*, returning "
+	  "a table mapping \"level/col_row\" keys to encoded tiles of "
+	  "*tilesize* pixels (default 256) with *overlap* pixels "
+	  "(default 0) in *format* (default \"JPEG\"). The highest level "
+	  "is full resolution and each lower level is half the size of "
+	  "the one above it. If *dir* is given, each tile is written to "
+	  "*dir*/level/col_row.format as soon as it is encoded and the "
+	  "number of tiles is returned. *source* is either an imagick "
+	  "object, whose current image is used one level at a time, or "
+	  "the name of an RGB or gray image file, which is read a row "
+	  "at a time, so that only a band of rows per level is held "
+	  "in memory, with 2x2 averaging for the lower levels. Files "
+	  "which can't be read that way are decoded whole, within "
+	  "IMAGICK:MAXPIXELMB.",
+	  {"source",kno_any_type,KNO_VOID},
+	  {"tilesize",kno_fixnum_type,KNO_INT(256)},
+	  {"format",kno_string_type,KNO_VOID},
+	  {"overlap",kno_fixnum_type,KNO_INT(0)},
+	  {"dir",kno_string_type,KNO_VOID})
+static lispval imagick_tile_pyramid(lispval source,lispval tilesize,
+				    lispval fmt,lispval overlap,lispval dir)
 {
-  MagickBooleanType retval;
-  struct KNO_IMAGICK *wrapper=
-    kno_consptr(struct KNO_IMAGICK *,imagickref,kno_imagick_type);
-  MagickWand *wand = wrapper->wand;
-  if (!(KNO_UINTP(w_arg))) return kno_type_error("uint","imagick_fit",w_arg);
-  else if (!(KNO_UINTP(h_arg))) return kno_type_error("uint","imagick_fit",h_arg);
-  int width = KNO_FIX2INT(w_arg), height = KNO_FIX2INT(h_arg);
-  size_t iwidth = MagickGetImageWidth(wand);
-  size_t iheight = MagickGetImageHeight(wand);
-  size_t target_width, target_height;
-  double xscale = ((double)width)/((double)iwidth);
-  double yscale = ((double)height)/((double)iheight);
-  double scale = ((xscale<yscale)?(xscale):(yscale));
-  target_width = (int)floor(iwidth*scale);
-  target_height = (int)floor(iheight*scale);
-  retval = MagickResizeImage
-    (wand,target_width,target_height,
-     getfilter(filter,"imagick_fit"),
-     ((KNO_VOIDP(blur))?(1.0):(KNO_FLONUM(blur))));
-  if (retval == MagickFalse) {
-    grabmagickerr("imagick_fit",wand);
-    return KNO_ERROR_VALUE;}
+  long long started = metrics_start();
+  if (!( (KNO_TYPEP(source,kno_imagick_type)) || (KNO_STRINGP(source)) )) {
+    kno_type_error("imagick or filename","imagick_tile_pyramid",source);
+    return IMAGICK_DONE(IM_TILE_PYRAMID,KNO_ERROR_VALUE,0,0,0);}
+  else if (!( (KNO_UINTP(tilesize)) && (KNO_FIX2INT(tilesize) > 0) )) {
+    kno_type_error("tile size","imagick_tile_pyramid",tilesize);
+    return IMAGICK_DONE(IM_TILE_PYRAMID,KNO_ERROR_VALUE,0,0,0);}
+  else if (!(KNO_UINTP(overlap))) {
+    kno_type_error("uint","imagick_tile_pyramid",overlap);
+    return IMAGICK_DONE(IM_TILE_PYRAMID,KNO_ERROR_VALUE,0,0,0);}
+  const char *fmtname = (KNO_STRINGP(fmt)) ? (KNO_CSTRING(fmt)) : ("JPEG");
+  u8_string dirname = (KNO_STRINGP(dir)) ? (KNO_CSTRING(dir)) : (NULL);
+  lispval result = (dirname) ? (KNO_VOID) : (kno_make_hashtable(NULL,64));
+  long long n_written = 0;
+  int rv = 0;
+  if (KNO_STRINGP(source)) {
+    struct PYRAMID_STREAM stream;
+    memset(&stream,0,sizeof(stream));
+    stream.tilesize = KNO_FIX2INT(tilesize);
+    stream.overlap = KNO_FIX2INT(overlap);
+    stream.fmt = fmtname;
+    stream.result = result;
+    stream.dir = dirname;
+    rv = stream_pyramid(KNO_CSTRING(source),&stream);
+    n_written = stream.n_written;
+    if (rv == 0) {
+      /* Fall back on decoding the whole file */
+      struct KNO_IMAGICK *temp = imagick_alloc();
+      n_written = 0;
+      if (imagick_check_file_room(KNO_CSTRING(source),NULL,
+				  "imagick_tile_pyramid") < 0)
+	rv = -1;
+      else if (MagickReadImage(temp->wand,KNO_CSTRING(source)) ==
+	       MagickFalse) {
+	grabmagickerr("imagick_tile_pyramid",temp->wand);
+	rv = -1;}
+      else {
+	imagick_account(temp);
+	rv = wand_pyramid(temp->wand,KNO_FIX2INT(tilesize),
+			  KNO_FIX2INT(overlap),fmtname,result,dirname,
+			  &n_written);}
+      imagick_release(temp);}}
   else {
-    U8_CLEAR_ERRNO();
-    return kno_incref(imagickref);}
+    struct KNO_IMAGICK *wrapper=
+      kno_consptr(struct KNO_IMAGICK *,source,kno_imagick_type);
+    rv = wand_pyramid(wrapper->wand,KNO_FIX2INT(tilesize),
+		      KNO_FIX2INT(overlap),fmtname,result,dirname,
+		      &n_written);}
+  if (rv < 0) {
+    kno_decref(result);
+    return IMAGICK_DONE(IM_TILE_PYRAMID,KNO_ERROR_VALUE,0,0,0);}
+  if (dirname) result = KNO_INT(n_written);
+  U8_CLEAR_ERRNO();
+  return IMAGICK_DONE(IM_TILE_PYRAMID,result,0,0,0);
 }
 
 
@@ -407,6 +5667,7 @@ DEFC_PRIM("imagick/interlace",imagick_interlace,
 	  {"scheme",kno_any_type,KNO_VOID})
 static lispval imagick_interlace(lispval imagickref,lispval scheme)
 {
+  long long started = metrics_start();
   MagickBooleanType retval;
   struct KNO_IMAGICK *wrapper=
     kno_consptr(struct KNO_IMAGICK *,imagickref,kno_imagick_type);
@@ -417,15 +5678,16 @@ static lispval imagick_interlace(lispval imagickref,lispval scheme)
   else if (scheme == line_interlace) it = LineInterlace;
   else if (scheme == plane_interlace) it = PlaneInterlace;
   else if (scheme == partition_interlace) it = PartitionInterlace;
-  else return kno_type_error
-	 ("MagickWand Interlace type","imagick_interlace",scheme);
+  else {
+    kno_type_error("MagickWand Interlace type","imagick_interlace",scheme);
+    return IMAGICK_DONE(IM_INTERLACE,KNO_ERROR_VALUE,0,0,0);}
   retval = MagickSetInterlaceScheme(wand,it);
   if (retval == MagickFalse) {
-    grabmagickerr("imagick_fit",wand);
-    return KNO_ERROR_VALUE;}
+    grabmagickerr("imagick_interlace",wand);
+    return IMAGICK_DONE(IM_INTERLACE,KNO_ERROR_VALUE,0,0,0);}
   else {
     U8_CLEAR_ERRNO();
-    return kno_incref(imagickref);}
+    return IMAGICK_DONE(IM_INTERLACE,kno_incref(imagickref),0,0,0);}
 }
 
 
@@ -442,14 +5704,23 @@ static lispval imagick_extend(lispval imagickref,lispval w_arg,lispval h_arg,
 			      lispval x_arg,lispval y_arg,
 			      lispval bgcolor)
 {
+  long long started = metrics_start();
   MagickBooleanType retval;
   struct KNO_IMAGICK *wrapper=
     kno_consptr(struct KNO_IMAGICK *,imagickref,kno_imagick_type);
   MagickWand *wand = wrapper->wand;
-  if (!(KNO_UINTP(w_arg))) return kno_type_error("uint","imagick_fit",w_arg);
-  if (!(KNO_UINTP(h_arg))) return kno_type_error("uint","imagick_fit",h_arg);
-  if (!(KNO_UINTP(x_arg))) return kno_type_error("uint","imagick_fit",x_arg);
-  if (!(KNO_UINTP(y_arg))) return kno_type_error("uint","imagick_fit",y_arg);
+  if (!(KNO_UINTP(w_arg))) {
+    kno_type_error("uint","imagick_fit",w_arg);
+    return IMAGICK_DONE(IM_EXTEND,KNO_ERROR_VALUE,0,0,0);}
+  if (!(KNO_UINTP(h_arg))) {
+    kno_type_error("uint","imagick_fit",h_arg);
+    return IMAGICK_DONE(IM_EXTEND,KNO_ERROR_VALUE,0,0,0);}
+  if (!(KNO_UINTP(x_arg))) {
+    kno_type_error("uint","imagick_fit",x_arg);
+    return IMAGICK_DONE(IM_EXTEND,KNO_ERROR_VALUE,0,0,0);}
+  if (!(KNO_UINTP(y_arg))) {
+    kno_type_error("uint","imagick_fit",y_arg);
+    return IMAGICK_DONE(IM_EXTEND,KNO_ERROR_VALUE,0,0,0);}
   size_t width = KNO_FIX2INT(w_arg), height = KNO_FIX2INT(h_arg);
   size_t xoff = KNO_FIX2INT(x_arg), yoff = KNO_FIX2INT(y_arg);
   if (KNO_STRINGP(bgcolor)) {
@@ -460,10 +5731,12 @@ static lispval imagick_extend(lispval imagickref,lispval w_arg,lispval h_arg,
   retval = MagickExtentImage(wand,width,height,xoff,yoff);
   if (retval == MagickFalse) {
     grabmagickerr("imagick_extend",wand);
-    return KNO_ERROR_VALUE;}
+    return IMAGICK_DONE(IM_EXTEND,KNO_ERROR_VALUE,0,0,0);}
   else {
+    imagick_account(wrapper);
     U8_CLEAR_ERRNO();
-    return kno_incref(imagickref);}
+    return IMAGICK_DONE(IM_EXTEND,kno_incref(imagickref),
+			0,0,wand_pixels(wand));}
 }
 
 
@@ -475,6 +5748,7 @@ DEFC_PRIM("imagick/charcoal",imagick_charcoal,
 	  {"sigma",kno_flonum_type,KNO_VOID})
 static lispval imagick_charcoal(lispval imagickref,lispval radius,lispval sigma)
 {
+  long long started = metrics_start();
   MagickBooleanType retval;
   struct KNO_IMAGICK *wrapper=
     kno_consptr(struct KNO_IMAGICK *,imagickref,kno_imagick_type);
@@ -483,10 +5757,12 @@ static lispval imagick_charcoal(lispval imagickref,lispval radius,lispval sigma)
   retval = MagickCharcoalImage(wand,r,s);
   if (retval == MagickFalse) {
     grabmagickerr("imagick_charcoal",wand);
-    return KNO_ERROR_VALUE;}
+    return IMAGICK_DONE(IM_CHARCOAL,KNO_ERROR_VALUE,0,0,0);}
   else {
+    imagick_account(wrapper);
     U8_CLEAR_ERRNO();
-    return kno_incref(imagickref);}
+    return IMAGICK_DONE(IM_CHARCOAL,kno_incref(imagickref),
+			0,0,wand_pixels(wand));}
 }
 
 
@@ -498,6 +5774,7 @@ DEFC_PRIM("imagick/emboss",imagick_emboss,
 	  {"sigma",kno_flonum_type,KNO_VOID})
 static lispval imagick_emboss(lispval imagickref,lispval radius,lispval sigma)
 {
+  long long started = metrics_start();
   MagickBooleanType retval;
   struct KNO_IMAGICK *wrapper=
     kno_consptr(struct KNO_IMAGICK *,imagickref,kno_imagick_type);
@@ -506,10 +5783,12 @@ static lispval imagick_emboss(lispval imagickref,lispval radius,lispval sigma)
   retval = MagickEmbossImage(wand,r,s);
   if (retval == MagickFalse) {
     grabmagickerr("imagick_emboss",wand);
-    return KNO_ERROR_VALUE;}
+    return IMAGICK_DONE(IM_EMBOSS,KNO_ERROR_VALUE,0,0,0);}
   else {
+    imagick_account(wrapper);
     U8_CLEAR_ERRNO();
-    return kno_incref(imagickref);}
+    return IMAGICK_DONE(IM_EMBOSS,kno_incref(imagickref),
+			0,0,wand_pixels(wand));}
 }
 
 
@@ -521,6 +5800,7 @@ DEFC_PRIM("imagick/blur",imagick_blur,
 	  {"sigma",kno_flonum_type,KNO_VOID})
 static lispval imagick_blur(lispval imagickref,lispval radius,lispval sigma)
 {
+  long long started = metrics_start();
   MagickBooleanType retval;
   struct KNO_IMAGICK *wrapper=
     kno_consptr(struct KNO_IMAGICK *,imagickref,kno_imagick_type);
@@ -529,10 +5809,12 @@ static lispval imagick_blur(lispval imagickref,lispval radius,lispval sigma)
   retval = MagickGaussianBlurImage(wand,r,s);
   if (retval == MagickFalse) {
     grabmagickerr("imagick_blur",wand);
-    return KNO_ERROR_VALUE;}
+    return IMAGICK_DONE(IM_BLUR,KNO_ERROR_VALUE,0,0,0);}
   else {
+    imagick_account(wrapper);
     U8_CLEAR_ERRNO();
-    return kno_incref(imagickref);}
+    return IMAGICK_DONE(IM_BLUR,kno_incref(imagickref),
+			0,0,wand_pixels(wand));}
 }
 
 
@@ -543,6 +5825,7 @@ DEFC_PRIM("imagick/edge",imagick_edge,
 	  {"radius",kno_flonum_type,KNO_VOID})
 static lispval imagick_edge(lispval imagickref,lispval radius)
 {
+  long long started = metrics_start();
   MagickBooleanType retval;
   struct KNO_IMAGICK *wrapper=
     kno_consptr(struct KNO_IMAGICK *,imagickref,kno_imagick_type);
@@ -551,10 +5834,12 @@ static lispval imagick_edge(lispval imagickref,lispval radius)
   retval = MagickEdgeImage(wand,r);
   if (retval == MagickFalse) {
     grabmagickerr("imagick_edge",wand);
-    return KNO_ERROR_VALUE;}
+    return IMAGICK_DONE(IM_EDGE,KNO_ERROR_VALUE,0,0,0);}
   else {
+    imagick_account(wrapper);
     U8_CLEAR_ERRNO();
-    return kno_incref(imagickref);}
+    return IMAGICK_DONE(IM_EDGE,kno_incref(imagickref),
+			0,0,wand_pixels(wand));}
 }
 
 
@@ -562,7 +5847,7 @@ static lispval imagick_edge(lispval imagickref,lispval radius)
 DEFC_PRIM("imagick/crop",imagick_crop,
 	  KNO_MAX_ARGS(5)|KNO_MIN_ARGS(3),
 	  "**undocumented**",
-	  {"imagickref",KNO_IMAGICK_TYPE,KNO_VOID},
+	  {"imagickref",kno_any_type,KNO_VOID},
 	  {"width",kno_fixnum_type,KNO_VOID},
 	  {"height",kno_fixnum_type,KNO_INT(0)},
 	  {"xoff",kno_fixnum_type,KNO_INT(0)},
@@ -571,6 +5856,14 @@ static lispval imagick_crop(lispval imagickref,
 			    lispval width,lispval height,
 			    lispval xoff,lispval yoff)
 {
+  long long started = metrics_start();
+  if (KNO_TYPEP(imagickref,kno_imagick_lazy_type)) {
+    lispval args[4] = { width, height, xoff, yoff };
+    return IMAGICK_DONE(IM_CROP,lazy_record(imagickref,"crop",4,args,
+					    "imagick_crop"),0,0,0);}
+  else if (!(KNO_TYPEP(imagickref,kno_imagick_type))) {
+    kno_type_error("imagick","imagick_crop",imagickref);
+    return IMAGICK_DONE(IM_CROP,KNO_ERROR_VALUE,0,0,0);}
   MagickBooleanType retval;
   struct KNO_IMAGICK *wrapper=
     kno_consptr(struct KNO_IMAGICK *,imagickref,kno_imagick_type);
@@ -580,19 +5873,28 @@ static lispval imagick_crop(lispval imagickref,
   retval = MagickCropImage(wand,w,h,x,y);
   if (retval == MagickFalse) {
     grabmagickerr("imagick_crop",wand);
-    return KNO_ERROR_VALUE;}
+    return IMAGICK_DONE(IM_CROP,KNO_ERROR_VALUE,0,0,0);}
   else {
+    imagick_account(wrapper);
     U8_CLEAR_ERRNO();
-    return kno_incref(imagickref);}
+    return IMAGICK_DONE(IM_CROP,kno_incref(imagickref),
+			0,0,wand_pixels(wand));}
 }
 
 
 DEFC_PRIM("imagick/flip",imagick_flip,
 	  KNO_MAX_ARGS(1)|KNO_MIN_ARGS(1),
 	  "**undocumented**",
-	  {"imagickref",KNO_IMAGICK_TYPE,KNO_VOID})
+	  {"imagickref",kno_any_type,KNO_VOID})
 static lispval imagick_flip(lispval imagickref)
 {
+  long long started = metrics_start();
+  if (KNO_TYPEP(imagickref,kno_imagick_lazy_type))
+    return IMAGICK_DONE(IM_FLIP,lazy_record(imagickref,"flip",0,NULL,
+					    "imagick_flip"),0,0,0);
+  else if (!(KNO_TYPEP(imagickref,kno_imagick_type))) {
+    kno_type_error("imagick","imagick_flip",imagickref);
+    return IMAGICK_DONE(IM_FLIP,KNO_ERROR_VALUE,0,0,0);}
   MagickBooleanType retval;
   struct KNO_IMAGICK *wrapper=
     kno_consptr(struct KNO_IMAGICK *,imagickref,kno_imagick_type);
@@ -600,19 +5902,28 @@ static lispval imagick_flip(lispval imagickref)
   retval = MagickFlipImage(wand);
   if (retval == MagickFalse) {
     grabmagickerr("imagick_flip",wand);
-    return KNO_ERROR_VALUE;}
+    return IMAGICK_DONE(IM_FLIP,KNO_ERROR_VALUE,0,0,0);}
   else {
+    imagick_account(wrapper);
     U8_CLEAR_ERRNO();
-    return kno_incref(imagickref);}
+    return IMAGICK_DONE(IM_FLIP,kno_incref(imagickref),
+			0,0,wand_pixels(wand));}
 }
 
 
 DEFC_PRIM("imagick/flop",imagick_flop,
 	  KNO_MAX_ARGS(1)|KNO_MIN_ARGS(1),
 	  "**undocumented**",
-	  {"imagickref",KNO_IMAGICK_TYPE,KNO_VOID})
+	  {"imagickref",kno_any_type,KNO_VOID})
 static lispval imagick_flop(lispval imagickref)
 {
+  long long started = metrics_start();
+  if (KNO_TYPEP(imagickref,kno_imagick_lazy_type))
+    return IMAGICK_DONE(IM_FLOP,lazy_record(imagickref,"flop",0,NULL,
+					    "imagick_flop"),0,0,0);
+  else if (!(KNO_TYPEP(imagickref,kno_imagick_type))) {
+    kno_type_error("imagick","imagick_flop",imagickref);
+    return IMAGICK_DONE(IM_FLOP,KNO_ERROR_VALUE,0,0,0);}
   MagickBooleanType retval;
   struct KNO_IMAGICK *wrapper=
     kno_consptr(struct KNO_IMAGICK *,imagickref,kno_imagick_type);
@@ -620,10 +5931,12 @@ static lispval imagick_flop(lispval imagickref)
   retval = MagickFlopImage(wand);
   if (retval == MagickFalse) {
     grabmagickerr("imagick_flop",wand);
-    return KNO_ERROR_VALUE;}
+    return IMAGICK_DONE(IM_FLOP,KNO_ERROR_VALUE,0,0,0);}
   else {
+    imagick_account(wrapper);
     U8_CLEAR_ERRNO();
-    return kno_incref(imagickref);}
+    return IMAGICK_DONE(IM_FLOP,kno_incref(imagickref),
+			0,0,wand_pixels(wand));}
 }
 
 
@@ -633,6 +5946,7 @@ DEFC_PRIM("imagick/equalize",imagick_equalize,
 	  {"imagickref",KNO_IMAGICK_TYPE,KNO_VOID})
 static lispval imagick_equalize(lispval imagickref)
 {
+  long long started = metrics_start();
   MagickBooleanType retval;
   struct KNO_IMAGICK *wrapper=
     kno_consptr(struct KNO_IMAGICK *,imagickref,kno_imagick_type);
@@ -640,10 +5954,12 @@ static lispval imagick_equalize(lispval imagickref)
   retval = MagickEqualizeImage(wand);
   if (retval == MagickFalse) {
     grabmagickerr("imagick_equalize",wand);
-    return KNO_ERROR_VALUE;}
+    return IMAGICK_DONE(IM_EQUALIZE,KNO_ERROR_VALUE,0,0,0);}
   else {
+    imagick_account(wrapper);
     U8_CLEAR_ERRNO();
-    return kno_incref(imagickref);}
+    return IMAGICK_DONE(IM_EQUALIZE,kno_incref(imagickref),
+			0,0,wand_pixels(wand));}
 }
 
 
@@ -653,6 +5969,7 @@ DEFC_PRIM("imagick/despeckle",imagick_despeckle,
 	  {"imagickref",KNO_IMAGICK_TYPE,KNO_VOID})
 static lispval imagick_despeckle(lispval imagickref)
 {
+  long long started = metrics_start();
   MagickBooleanType retval;
   struct KNO_IMAGICK *wrapper=
     kno_consptr(struct KNO_IMAGICK *,imagickref,kno_imagick_type);
@@ -660,10 +5977,12 @@ static lispval imagick_despeckle(lispval imagickref)
   retval = MagickDespeckleImage(wand);
   if (retval == MagickFalse) {
     grabmagickerr("imagick_despeckle",wand);
-    return KNO_ERROR_VALUE;}
+    return IMAGICK_DONE(IM_DESPECKLE,KNO_ERROR_VALUE,0,0,0);}
   else {
+    imagick_account(wrapper);
     U8_CLEAR_ERRNO();
-    return kno_incref(imagickref);}
+    return IMAGICK_DONE(IM_DESPECKLE,kno_incref(imagickref),
+			0,0,wand_pixels(wand));}
 }
 
 
@@ -673,6 +5992,7 @@ DEFC_PRIM("imagick/enhance",imagick_enhance,
 	  {"imagickref",KNO_IMAGICK_TYPE,KNO_VOID})
 static lispval imagick_enhance(lispval imagickref)
 {
+  long long started = metrics_start();
   MagickBooleanType retval;
   struct KNO_IMAGICK *wrapper=
     kno_consptr(struct KNO_IMAGICK *,imagickref,kno_imagick_type);
@@ -680,32 +6000,148 @@ static lispval imagick_enhance(lispval imagickref)
   retval = MagickEnhanceImage(wand);
   if (retval == MagickFalse) {
     grabmagickerr("imagick_enhance",wand);
-    return KNO_ERROR_VALUE;}
+    return IMAGICK_DONE(IM_ENHANCE,KNO_ERROR_VALUE,0,0,0);}
   else {
+    imagick_account(wrapper);
     U8_CLEAR_ERRNO();
-    return kno_incref(imagickref);}
+    return IMAGICK_DONE(IM_ENHANCE,kno_incref(imagickref),
+			0,0,wand_pixels(wand));}
+}
+
+
+/* Deskewing */
+
+#define DEFAULT_DESKEW_THRESHOLD 0.4
+#define DEFAULT_SKEW_SIZE 1024
+
+/* Returns the deskew threshold, as a fraction of the intensity
+   range, or -1 (signalling an error) if arg is invalid */
+static double deskew_threshold(lispval arg,u8_context cxt)
+{
+  double t;
+  if ( (KNO_VOIDP(arg)) || (KNO_DEFAULTP(arg)) || (KNO_FALSEP(arg)) )
+    return DEFAULT_DESKEW_THRESHOLD;
+  else if (KNO_FLONUMP(arg)) t = KNO_FLONUM(arg);
+  else if (KNO_FIXNUMP(arg)) t = KNO_FIX2INT(arg);
+  else t = -1;
+  if ( (t < 0) || (t > 1) ) {
+    kno_type_error("threshold (0.0-1.0)",cxt,arg);
+    return -1;}
+  return t;
+}
+
+/* Estimates the skew of the current image of wand, in degrees, by
+   deskewing a grayscale copy scaled to fit in size x size pixels.
+   Returns 0 (and sets *ok to 0) if the estimate fails. */
+static double estimate_skew(MagickWand *wand,double threshold,size_t size,
+			    int *ok,u8_context cxt)
+{
+  MagickWand *copy = MagickGetImage(wand);
+  double angle = 0;
+  *ok = 0;
+  if (copy == NULL) {
+    grabmagickerr(cxt,wand);
+    return 0;}
+  size_t iwidth = MagickGetImageWidth(copy);
+  size_t iheight = MagickGetImageHeight(copy);
+  size_t w = iwidth, h = iheight;
+  if ( (size) && ( (iwidth > size) || (iheight > size) ) )
+    fit_dimensions(iwidth,iheight,size,size,&w,&h);
+  /* Scale before converting, so that the copy's full resolution
+     pixels are never written (and so never actually copied) */
+  if ( ( ( (w != iwidth) || (h != iheight) ) &&
+	 (MagickScaleImage(copy,w,h) == MagickFalse) ) ||
+       (MagickTransformImageColorspace(copy,GRAYColorspace) == MagickFalse) ||
+       (MagickDeskewImage(copy,threshold*QuantumRange) == MagickFalse) ) {
+    grabmagickerr(cxt,copy);
+    DestroyMagickWand(copy);
+    return 0;}
+  char *value = MagickGetImageProperty(copy,"deskew:angle");
+  if (value == NULL) value = MagickGetImageArtifact(copy,"deskew:angle");
+  if (value) {
+    angle = strtod(value,NULL);
+    MagickRelinquishMemory(value);
+    *ok = 1;}
+  else u8_seterr("NoDeskewAngle",cxt,NULL);
+  DestroyMagickWand(copy);
+  return angle;
 }
 
+DEFC_PRIM("imagick/skew-angle",imagick_skew_angle,
+	  KNO_MAX_ARGS(3)|KNO_MIN_ARGS(1),
+	  "Estimates the skew, in degrees, of the current image of "
+	  "*imagickref* without modifying it. The estimate is made on "
+	  "a grayscale copy scaled to fit within *size* (default 1024) "
+	  "pixels, using *threshold* (a fraction of the intensity range, "
+	  "default 0.4) as with `imagick/deskew`.",
+	  {"imagickref",KNO_IMAGICK_TYPE,KNO_VOID},
+	  {"threshold",kno_any_type,KNO_VOID},
+	  {"size",kno_fixnum_type,KNO_VOID})
+static lispval imagick_skew_angle(lispval imagickref,lispval threshold,
+				  lispval size)
+{
+  long long started = metrics_start();
+  struct KNO_IMAGICK *wrapper=
+    kno_consptr(struct KNO_IMAGICK *,imagickref,kno_imagick_type);
+  double t = deskew_threshold(threshold,"imagick_skew_angle");
+  if (t < 0) return IMAGICK_DONE(IM_SKEW_ANGLE,KNO_ERROR_VALUE,0,0,0);
+  size_t max = (KNO_UINTP(size)) ? (KNO_FIX2INT(size)) : (DEFAULT_SKEW_SIZE);
+  int ok = 0;
+  double angle = estimate_skew(wrapper->wand,t,max,&ok,"imagick_skew_angle");
+  if (!(ok))
+    return IMAGICK_DONE(IM_SKEW_ANGLE,KNO_ERROR_VALUE,0,0,0);
+  U8_CLEAR_ERRNO();
+  return IMAGICK_DONE(IM_SKEW_ANGLE,kno_make_double(angle),
+		      0,0,wand_pixels(wrapper->wand));
+}
 
 DEFC_PRIM("imagick/deskew",imagick_deskew,
-	  KNO_MAX_ARGS(2)|KNO_MIN_ARGS(2),
-	  "**undocumented**",
+	  KNO_MAX_ARGS(3)|KNO_MIN_ARGS(1),
+	  "Straightens each frame of *imagickref*, detecting text "
+	  "lines or edges whose contrast exceeds *threshold* (a "
+	  "fraction of the intensity range, default 0.4, as with "
+	  "`convert -deskew 40%`). If *minangle* is given, the skew "
+	  "of each frame is first estimated as by `imagick/skew-angle` "
+	  "and frames skewed by less than *minangle* degrees are left "
+	  "untouched.",
 	  {"imagickref",KNO_IMAGICK_TYPE,KNO_VOID},
-	  "threshold",kno_flonum_type,KNO_VOID)
-static lispval imagick_deskew(lispval imagickref,lispval threshold)
+	  {"threshold",kno_any_type,KNO_VOID},
+	  {"minangle",kno_any_type,KNO_VOID})
+static lispval imagick_deskew(lispval imagickref,lispval threshold,
+			      lispval minangle)
 {
-  MagickBooleanType retval;
+  long long started = metrics_start();
   struct KNO_IMAGICK *wrapper=
     kno_consptr(struct KNO_IMAGICK *,imagickref,kno_imagick_type);
-  MagickWand *wand = wrapper->wand;
-  double t = KNO_FLONUM(threshold);
-  retval = MagickEdgeImage(wand,t);
-  if (retval == MagickFalse) {
-    grabmagickerr("imagick_deskew",wand);
-    return KNO_ERROR_VALUE;}
+  double t = deskew_threshold(threshold,"imagick_deskew");
+  if (t < 0) return IMAGICK_DONE(IM_DESKEW,KNO_ERROR_VALUE,0,0,0);
+  double min = 0;
+  if ( (KNO_VOIDP(minangle)) || (KNO_FALSEP(minangle)) ) {}
+  else if (KNO_FLONUMP(minangle)) min = KNO_FLONUM(minangle);
+  else if (KNO_FIXNUMP(minangle)) min = KNO_FIX2INT(minangle);
   else {
-    U8_CLEAR_ERRNO();
-    return kno_incref(imagickref);}
+    kno_type_error("angle","imagick_deskew",minangle);
+    return IMAGICK_DONE(IM_DESKEW,KNO_ERROR_VALUE,0,0,0);}
+  MagickWand *wand = wrapper->wand;
+  MagickResetIterator(wand);
+  while (MagickNextImage(wand) != MagickFalse) {
+    if (min > 0) {
+      int ok = 0;
+      double angle = estimate_skew(wand,t,DEFAULT_SKEW_SIZE,&ok,
+				   "imagick_deskew");
+      if (!(ok)) {
+	imagick_account(wrapper);
+	return IMAGICK_DONE(IM_DESKEW,KNO_ERROR_VALUE,0,0,0);}
+      if (fabs(angle) < min) continue;}
+    if (MagickDeskewImage(wand,t*QuantumRange) == MagickFalse) {
+      grabmagickerr("imagick_deskew",wand);
+      imagick_account(wrapper);
+      return IMAGICK_DONE(IM_DESKEW,KNO_ERROR_VALUE,0,0,0);}}
+  MagickResetIterator(wand);
+  imagick_account(wrapper);
+  U8_CLEAR_ERRNO();
+  return IMAGICK_DONE(IM_DESKEW,kno_incref(imagickref),
+		      0,0,wand_pixels(wand));
 }
 
 
@@ -793,6 +6229,95 @@ static void init_symbols()
   plane_interlace = kno_intern("plane");
   partition_interlace = kno_intern("parition");
 
+  name_symbol = kno_intern("name");
+  filter_symbol = kno_intern("filter");
+  frames_symbol = kno_intern("frames");
+  depth_symbol = kno_intern("depth");
+  colorspace_symbol = kno_intern("colorspace");
+  compression_symbol = kno_intern("compression");
+  crop_symbol = kno_intern("crop");
+  fit_symbol = kno_intern("fit");
+  ping_symbol = kno_intern("ping");
+  autoorient_symbol = kno_intern("autoorient");
+  strip_symbol = kno_intern("strip");
+
+  pool_size_symbol = kno_intern("pooled");
+  pool_max_symbol = kno_intern("max");
+  pool_requests_symbol = kno_intern("requests");
+  pool_reused_symbol = kno_intern("reused");
+  pool_returned_symbol = kno_intern("returned");
+  pool_discarded_symbol = kno_intern("discarded");
+  pool_reuse_rate_symbol = kno_intern("reuse-rate");
+
+  struct RESOURCEMAP *rscan = resource_types;
+  while (rscan->rname) {
+    rscan->rsym = kno_intern(rscan->rname);
+    rscan++;}
+
+  struct FILTERMAP *fscan = filter_types;
+  while (fscan->fname) {
+    fscan->fsym = kno_intern(fscan->fname);
+    fscan++;}
+
+  struct RESIZEMAP *mscan = resize_modes;
+  while (mscan->mname) {
+    mscan->msym = kno_intern(mscan->mname);
+    mscan++;}
+  mode_symbol = kno_intern("mode");
+
+  struct OPMAP *oscan = imagick_ops;
+  while (oscan->opname) {
+    oscan->opsym = kno_intern(oscan->opname);
+    oscan++;}
+
+  quality_symbol = kno_intern("quality");
+  options_symbol = kno_intern("options");
+  progressive_symbol = kno_intern("progressive");
+  sampling_symbol = kno_intern("sampling");
+
+  minquality_symbol = kno_intern("minquality");
+  maxquality_symbol = kno_intern("maxquality");
+  tolerance_symbol = kno_intern("tolerance");
+  threads_symbol = kno_intern("threads");
+  packet_symbol = kno_intern("packet");
+  bytes_symbol = kno_intern("bytes");
+  trials_symbol = kno_intern("trials");
+
+  char_symbol = kno_intern("char");
+  short_symbol = kno_intern("short");
+  float_symbol = kno_intern("float");
+  double_symbol = kno_intern("double");
+  gray_symbol = kno_intern("gray");
+  luma_symbol = kno_intern("luma");
+  ycbcr_symbol = kno_intern("ycbcr");
+
+  mean_symbol = kno_intern("mean");
+  variance_symbol = kno_intern("variance");
+  min_symbol = kno_intern("min");
+  max_symbol = kno_intern("max");
+  count_symbol = kno_intern("count");
+  columns_symbol = kno_intern("columns");
+  rows_symbol = kno_intern("rows");
+
+  gravity_symbol = kno_intern("gravity");
+  operator_symbol = kno_intern("operator");
+  opacity_symbol = kno_intern("opacity");
+  x_symbol = kno_intern("x");
+  y_symbol = kno_intern("y");
+
+  cache_symbol = kno_intern("cache");
+  memory_hits_symbol = kno_intern("memory-hits");
+  disk_hits_symbol = kno_intern("disk-hits");
+  misses_symbol = kno_intern("misses");
+  evictions_symbol = kno_intern("evictions");
+  entries_symbol = kno_intern("entries");
+  disk_bytes_symbol = kno_intern("disk-bytes");
+
+  queued_symbol = kno_intern("queued");
+  running_symbol = kno_intern("running");
+  completed_symbol = kno_intern("completed");
+  workers_symbol = kno_intern("workers");
+
 }
 
 static lispval imagick_module;
@@ -806,8 +6331,26 @@ int kno_init_imagick()
   kno_imagick_type = kno_register_cons_type("imagick",KNO_IMAGICK_TYPE);
   kno_unparsers[kno_imagick_type]=unparse_imagick;
   kno_recyclers[kno_imagick_type]=recycle_imagick;
+  kno_imagick_lazy_type =
+    kno_register_cons_type("imagick-lazy",KNO_IMAGICK_LAZY_TYPE);
+  kno_unparsers[kno_imagick_lazy_type]=unparse_imagick_lazy;
+  kno_recyclers[kno_imagick_lazy_type]=recycle_imagick_lazy;
+  kno_imagick_future_type =
+    kno_register_cons_type("imagick-future",KNO_IMAGICK_FUTURE_TYPE);
+  kno_unparsers[kno_imagick_future_type]=unparse_imagick_future;
+  kno_recyclers[kno_imagick_future_type]=recycle_imagick_future;
 
   init_symbols();
+  init_metrics_symbols();
+
+  u8_init_mutex(&derived_lock);
+  u8_init_mutex(&derived_disk_lock);
+  u8_init_mutex(&derive_cache_dir_lock);
+  u8_init_mutex(&job_queue_lock);
+  u8_init_condvar(&job_queue_ready);
+  pthread_key_create(&imagick_pool_key,free_imagick_pool);
+  init_phash_cosines();
+  init_simd_kernels();
 
   kno_tablefns[kno_imagick_type]=u8_zalloc(struct KNO_TABLEFNS);
   kno_tablefns[kno_imagick_type]->get = (kno_table_get_fn)imagick_table_get;
@@ -818,6 +6361,49 @@ int kno_init_imagick()
   kno_tablefns[kno_imagick_type]->getsize = NULL;
   kno_tablefns[kno_imagick_type]->keys = NULL;
 
+  kno_register_config
+    ("IMAGICK:THREADS",
+     "Maximum number of threads used by imagick primitives which "
+     "process several images in parallel",
+     kno_intconfig_get,kno_intconfig_set,&imagick_threads);
+  kno_register_config
+    ("IMAGICK:POOLSIZE",
+     "Maximum number of cleared wands kept for reuse by each thread",
+     kno_intconfig_get,kno_intconfig_set,&imagick_pool_max);
+  kno_register_config
+    ("IMAGICK:MAXPIXELMB",
+     "Decoding fails when the pixel memory held by imagick objects "
+     "exceeds this many megabytes (0 means no limit)",
+     kno_intconfig_get,kno_intconfig_set,&imagick_max_pixel_mb);
+  kno_register_config
+    ("IMAGICK:CACHEMB",
+     "Megabytes of imagick/derive results kept in memory "
+     "(0 disables the memory cache)",
+     kno_intconfig_get,kno_intconfig_set,&derive_cache_mb);
+  kno_register_config
+    ("IMAGICK:CACHEDIR",
+     "Directory where imagick/derive results are cached on disk",
+     cache_dir_config_get,cache_dir_config_set,&derive_cache_dir);
+  kno_register_config
+    ("IMAGICK:CACHEDISKMB",
+     "Megabytes of imagick/derive results kept in IMAGICK:CACHEDIR",
+     kno_intconfig_get,kno_intconfig_set,&derive_disk_mb);
+  kno_register_config
+    ("IMAGICK:ASYNCTHREADS",
+     "Maximum number of background threads (and so of images being "
+     "processed) for the imagick/async primitives",
+     kno_intconfig_get,kno_intconfig_set,&imagick_async_threads);
+  kno_register_config
+    ("IMAGICK:SIMD",
+     "The vector kernels (scalar, sse2 or avx2) used for 8-bit luma "
+     "export, by default the best this CPU supports. It can be set "
+     "to a lower level (for comparison) but not a higher one.",
+     kno_sconfig_get,simd_config_set,&simd_kernels);
+  kno_register_config
+    ("IMAGICK:METRICS",
+     "Whether to record call statistics for imagick primitives",
+     kno_boolconfig_get,kno_boolconfig_set,&metrics_enabled);
+
   link_local_cprims();
 
   MagickWandGenesis();
@@ -834,7 +6420,7 @@ static void link_local_cprims()
   KNO_LINK_CPRIM("imagick/keys",imagick_getkeys,1,imagick_module);
   KNO_LINK_CPRIM("imagick/get",imagick_get,3,imagick_module);
   KNO_LINK_CPRIM("imagick/display",imagick_display,2,imagick_module);
-  KNO_LINK_CPRIM("imagick/deskew",imagick_deskew,2,imagick_module);
+  KNO_LINK_CPRIM("imagick/deskew",imagick_deskew,3,imagick_module);
   KNO_LINK_CPRIM("imagick/enhance",imagick_enhance,1,imagick_module);
   KNO_LINK_CPRIM("imagick/despeckle",imagick_despeckle,1,imagick_module);
   KNO_LINK_CPRIM("imagick/equalize",imagick_equalize,1,imagick_module);
@@ -847,18 +6433,18 @@ static void link_local_cprims()
   KNO_LINK_CPRIM("imagick/charcoal",imagick_charcoal,3,imagick_module);
   KNO_LINK_CPRIM("imagick/extend",imagick_extend,6,imagick_module);
   KNO_LINK_CPRIM("imagick/interlace",imagick_interlace,2,imagick_module);
-  KNO_LINK_CPRIM("imagick/fit",imagick_fit,5,imagick_module);
+  KNO_LINK_CPRIM("imagick/fit",imagick_fit,6,imagick_module);
   KNO_LINK_CPRIM("imagick/format",imagick_format,2,imagick_module);
   KNO_LINK_CPRIM("imagick/clone",imagick2imagick,1,imagick_module);
-  KNO_LINK_CPRIM("imagick->packet",imagick2packet,1,imagick_module);
-  KNO_LINK_CPRIM("imagick->file",imagick2file,2,imagick_module);
-  KNO_LINK_CPRIM("packet->imagick",packet2imagick,1,imagick_module);
-  KNO_LINK_CPRIM("file->imagick",file2imagick,1,imagick_module);
-  KNO_LINK_CPRIM("imagick->file",imagick2file,2,imagick_module);
-  KNO_LINK_CPRIM("imagick->packet",imagick2packet,1,imagick_module);
+  KNO_LINK_CPRIM("imagick->packet",imagick2packet,2,imagick_module);
+  KNO_LINK_CPRIM("imagick->file",imagick2file,3,imagick_module);
+  KNO_LINK_CPRIM("packet->imagick",packet2imagick,2,imagick_module);
+  KNO_LINK_CPRIM("file->imagick",file2imagick,2,imagick_module);
+  KNO_LINK_CPRIM("imagick->file",imagick2file,3,imagick_module);
+  KNO_LINK_CPRIM("imagick->packet",imagick2packet,2,imagick_module);
   KNO_LINK_CPRIM("imagick/clone",imagick2imagick,1,imagick_module);
   KNO_LINK_CPRIM("imagick/format",imagick_format,2,imagick_module);
-  KNO_LINK_CPRIM("imagick/fit",imagick_fit,5,imagick_module);
+  KNO_LINK_CPRIM("imagick/fit",imagick_fit,6,imagick_module);
   KNO_LINK_CPRIM("imagick/interlace",imagick_interlace,2,imagick_module);
   KNO_LINK_CPRIM("imagick/extend",imagick_extend,6,imagick_module);
   KNO_LINK_CPRIM("imagick/charcoal",imagick_charcoal,3,imagick_module);
@@ -871,8 +6457,48 @@ static void link_local_cprims()
   KNO_LINK_CPRIM("imagick/equalize",imagick_equalize,1,imagick_module);
   KNO_LINK_CPRIM("imagick/despeckle",imagick_despeckle,1,imagick_module);
   KNO_LINK_CPRIM("imagick/enhance",imagick_enhance,1,imagick_module);
-  KNO_LINK_CPRIM("imagick/deskew",imagick_deskew,2,imagick_module);
+  KNO_LINK_CPRIM("imagick/deskew",imagick_deskew,3,imagick_module);
   KNO_LINK_CPRIM("imagick/display",imagick_display,2,imagick_module);
   KNO_LINK_CPRIM("imagick/get",imagick_get,3,imagick_module);
   KNO_LINK_CPRIM("imagick/keys",imagick_getkeys,1,imagick_module);
+  KNO_LINK_CPRIM("imagick/renditions",imagick_renditions,3,imagick_module);
+  KNO_LINK_CPRIM("imagick->pixels",imagick2pixels,3,imagick_module);
+  KNO_LINK_CPRIM("pixels->imagick",pixels2imagick,4,imagick_module);
+  KNO_LINK_CPRIM("imagick/stats",imagick_stats,3,imagick_module);
+  KNO_LINK_CPRIM("imagick/histogram",imagick_histogram,4,imagick_module);
+  KNO_LINK_CPRIM("imagick/tile-stats",imagick_tile_stats,5,imagick_module);
+  KNO_LINK_CPRIM("imagick/dhash",imagick_dhash,1,imagick_module);
+  KNO_LINK_CPRIM("imagick/phash",imagick_phash,1,imagick_module);
+  KNO_LINK_CPRIM("imagick/hamming",imagick_hamming,2,imagick_module);
+  KNO_LINK_CPRIM("imagick/hash-search",imagick_hash_search,4,imagick_module);
+  KNO_LINK_CPRIM("imagick/probe",imagick_probe,1,imagick_module);
+  KNO_LINK_CPRIM("imagick/resource-limit",imagick_resource_limit,2,imagick_module);
+  KNO_LINK_CPRIM("imagick/convert-file",imagick_convert_file,3,imagick_module);
+  KNO_LINK_CPRIM("imagick/tile-pyramid",imagick_tile_pyramid,5,imagick_module);
+  KNO_LINK_CPRIM("stream->imagick",stream2imagick,2,imagick_module);
+  KNO_LINK_CPRIM("imagick->stream",imagick2stream,3,imagick_module);
+  KNO_LINK_CPRIM("imagick/pool-stats",imagick_pool_stats,0,imagick_module);
+  KNO_LINK_CPRIM("imagick/composite",imagick_composite,3,imagick_module);
+  KNO_LINK_CPRIM("imagick/stamp",imagick_stamp,3,imagick_module);
+  KNO_LINK_CPRIM("imagick/derive",imagick_derive,3,imagick_module);
+  KNO_LINK_CPRIM("imagick/lazy",imagick_lazy,2,imagick_module);
+  KNO_LINK_CPRIM("imagick/realize",imagick_realize,1,imagick_module);
+  KNO_LINK_CPRIM("imagick/skew-angle",imagick_skew_angle,3,imagick_module);
+  KNO_LINK_CPRIM("imagick/derive-cache",imagick_derive_cache,1,imagick_module);
+  KNO_LINK_CPRIM("imagick/async-decode",imagick_async_decode,2,imagick_module);
+  KNO_LINK_CPRIM("imagick/async-apply",imagick_async_apply,2,imagick_module);
+  KNO_LINK_CPRIM("imagick/async-encode",imagick_async_encode,2,imagick_module);
+  KNO_LINK_CPRIM("imagick/async-derive",imagick_async_derive,3,imagick_module);
+  KNO_LINK_CPRIM("imagick/await",imagick_await,2,imagick_module);
+  KNO_LINK_CPRIM("imagick/ready?",imagick_readyp,1,imagick_module);
+  KNO_LINK_CPRIM("imagick/async-stats",imagick_async_stats,0,imagick_module);
+  KNO_LINK_CPRIM("imagick/colorspace",imagick_colorspace,2,imagick_module);
+  KNO_LINK_CPRIM("imagick/frame-count",imagick_frame_count,1,imagick_module);
+  KNO_LINK_CPRIM("imagick/frame",imagick_frame,2,imagick_module);
+  KNO_LINK_CPRIM("imagick/apply",imagick_apply,3,imagick_module);
+  KNO_LINK_CPRIM("imagick/encode-to-size",imagick_encode_to_size,3,
+		 imagick_module);
+  KNO_LINK_CPRIM("imagick/footprint",imagick_footprint,1,imagick_module);
+  KNO_LINK_CPRIM("imagick/release!",imagick_release_prim,1,imagick_module);
+  KNO_LINK_CPRIM("imagick/metrics",imagick_metrics_prim,1,imagick_module);
 }
@@ -29,11 +29,15 @@
 #include <libu8/u8printf.h>
 #include <libu8/u8crypto.h>
 
+#include "imagetools_metrics.h"
+
 static lispval dotsize_symbol, margin_symbol, version_symbol, robustness_symbol;
 static lispval l_sym, m_sym, q_sym, h_sym;
 
 static u8_mutex qrencode_lock;
 
+static struct KNO_PRIM_METRIC qrencode_metric = {"qrencode"};
+
 KNO_EXPORT int kno_init_qrcode(void) KNO_LIBINIT_FN;
 
 static int geteclevel(lispval level_arg)
@@ -159,11 +163,13 @@ DEFC_PRIM("qrencode",qrencode_prim,
 	  "opts",kno_any_type,KNO_VOID)
 static lispval qrencode_prim(lispval string,lispval opts)
 {
+  long long started = metrics_start();
   lispval level_arg = kno_getopt(opts,robustness_symbol,KNO_FALSE);
   lispval version_arg = kno_getopt(opts,version_symbol,KNO_INT(0));
   if (!(KNO_UINTP(version_arg))) {
     kno_decref(level_arg);
-    return kno_type_error("uint","qrencode_prim",version_arg);}
+    kno_type_error("uint","qrencode_prim",version_arg);
+    return metrics_done(&qrencode_metric,started,KNO_ERROR_VALUE,0,0,0);}
   QRecLevel eclevel = geteclevel(level_arg);
   {
     lispval result;
@@ -175,10 +181,22 @@ static lispval qrencode_prim(lispval string,lispval opts)
     result = write_png_packet(qrcode,opts);
     QRcode_free(qrcode);
     kno_decref(level_arg);
-    return result;
+    size_t bytes_out = (KNO_PACKETP(result)) ? (KNO_PACKET_LENGTH(result)) : (0);
+    return metrics_done(&qrencode_metric,started,result,
+			KNO_STRLEN(string),bytes_out,0);
   }
 }
 
+DEFC_PRIM("qrcode/metrics",qrcode_metrics_prim,
+	  KNO_MAX_ARGS(1)|KNO_MIN_ARGS(0),
+	  "Returns a table of call statistics for qrencode. If *reset* "
+	  "is true, the statistics are zeroed after being read.",
+	  {"reset",kno_any_type,KNO_FALSE})
+static lispval qrcode_metrics_prim(lispval reset)
+{
+  return metrics_table(&qrencode_metric,1,(!(KNO_FALSEP(reset))));
+}
+
 /* Initialization */
 
 static long long int qrencode_init = 0;
@@ -198,6 +216,12 @@ KNO_EXPORT int kno_init_qrcode()
   version_symbol = kno_intern("version");
   robustness_symbol = kno_intern("robustness");
 
+  init_metrics_symbols();
+  kno_register_config
+    ("QRCODE:METRICS",
+     "Whether to record call statistics for qrencode",
+     kno_boolconfig_get,kno_boolconfig_set,&metrics_enabled);
+
   link_local_cprims();
 
   qrencode_init = u8_millitime();
@@ -212,4 +236,5 @@ KNO_EXPORT int kno_init_qrcode()
 static void link_local_cprims()
 {
   KNO_LINK_CPRIM("qrencode",qrencode_prim,2,qrcode_module);
+  KNO_LINK_CPRIM("qrcode/metrics",qrcode_metrics_prim,1,qrcode_module);
 }